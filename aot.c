@@ -0,0 +1,257 @@
+#include "aot.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "perf.h"
+#include "sbas.h"
+#include "utils.h"
+
+/**
+ * Layout of a code cache file:
+ * - this header
+ * - `lineCount` `LineTable` entries at `lineTableOffset`
+ * - a `CodeHeader` followed by `codeSize` bytes of linked machine code at the
+ *   page-aligned `codeOffset`, so both can be mapped as they are
+ */
+typedef struct {
+  char magic[8];
+  uint32_t version;
+  uint32_t options;  // `optionsKey` of the options the code was emitted with
+  uint64_t sourceHash;
+  uint64_t sourceLen;
+  uint64_t codeHash;
+  uint32_t codeSize;
+  uint32_t lineCount;
+  uint64_t lineTableOffset;
+  uint64_t codeOffset;
+} AotHeader;
+
+static int check_header(const AotHeader* header, const char* src, size_t len, int options, off_t fileSize);
+static int write_file(const char* path, const unsigned char* data, size_t size);
+static void record_loaded_code(int fd, const AotHeader* header, funcp code, const char* src, size_t len);
+
+/**
+ * Validates the code cache file at `path` against the source and maps its code R+X
+ */
+funcp sbasAotLoad(const char* path, const char* src, size_t len, const CompileOptions* options) {
+  AotHeader header;
+  struct stat st;
+  funcp result_func = NULL;
+
+  // instrumented code is never stored
+  if (options && options->instrument) {
+    return NULL;
+  }
+
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd == -1) {
+    if (errno != ENOENT) {
+      fprintf(stderr, "sbasAotLoad: failed to open %s.\n", path);
+    }
+    return NULL;
+  }
+
+  if (fstat(fd, &st) == -1 || pread(fd, &header, sizeof(header), 0) != (ssize_t)sizeof(header)) {
+    fprintf(stderr, "sbasAotLoad: %s is truncated.\n", path);
+    goto on_cleanup;
+  }
+  if (check_header(&header, src, len, options ? optionsKey(options->optLevel, options->noAlign) : 0, st.st_size) ==
+      -1) {
+    goto on_cleanup;
+  }
+
+  size_t mapSize = roundToPages(CODE_HEADER_SIZE + header.codeSize);
+  unsigned char* map = mmap(NULL, mapSize, PROT_READ | PROT_EXEC, MAP_PRIVATE, fd, header.codeOffset);
+  if (map == MAP_FAILED) {
+    fprintf(stderr, "sbasAotLoad: failed to mmap %s.\n", path);
+    goto on_cleanup;
+  }
+
+  // sbasCleanup trusts the header, so it must describe this very mapping
+  const CodeHeader* codeHeader = (const CodeHeader*)map;
+  if (codeHeader->mapSize != mapSize || codeHeader->owner != NULL || codeHeader->counters != NULL ||
+      hashBytes(map + CODE_HEADER_SIZE, header.codeSize) != header.codeHash) {
+    fprintf(stderr, "sbasAotLoad: %s is corrupt.\n", path);
+    munmap(map, mapSize);
+    goto on_cleanup;
+  }
+
+  result_func = (funcp)(map + CODE_HEADER_SIZE);
+  record_loaded_code(fd, &header, result_func, src, len);
+
+on_cleanup:
+  close(fd);  // the mapping outlives the descriptor
+  return result_func;
+}
+
+/**
+ * Lays out the code cache file in memory and writes it to `path` in one go
+ */
+int sbasAotStore(const char* path, const char* src, size_t len, const SbasObject* obj) {
+  // counters are only placed by `map_function`, a file mapping has nowhere to write them
+  if (obj->counterOf) {
+    fprintf(stderr, "sbasAotStore: instrumented code can't be cached.\n");
+    return -1;
+  }
+
+  size_t lineTableSize = obj->lines * sizeof(LineTable);
+  size_t codeOffset = roundToPages(sizeof(AotHeader) + lineTableSize);
+  size_t fileSize = codeOffset + CODE_HEADER_SIZE + obj->size;
+
+  unsigned char* file = calloc(1, fileSize);
+  if (!file) {
+    fprintf(stderr, "sbasAotStore: failed to alloc file buffer.\n");
+    return -1;
+  }
+
+  AotHeader* header = (AotHeader*)file;
+  memcpy(header->magic, AOT_MAGIC, sizeof(AOT_MAGIC));
+  header->version = AOT_VERSION;
+  header->options = optionsKey(obj->optLevel, obj->noAlign);
+  header->sourceHash = hashBytes(src, len);
+  header->sourceLen = len;
+  header->codeHash = hashBytes(obj->code, obj->size);
+  header->codeSize = obj->size;
+  header->lineCount = obj->lines;
+  header->lineTableOffset = sizeof(AotHeader);
+  header->codeOffset = codeOffset;
+  if (lineTableSize) {
+    memcpy(file + header->lineTableOffset, obj->lt, lineTableSize);
+  }
+
+  CodeHeader* codeHeader = (CodeHeader*)(file + codeOffset);
+  codeHeader->mapSize = roundToPages(CODE_HEADER_SIZE + obj->size);
+  codeHeader->owner = NULL;
+  memcpy(file + codeOffset + CODE_HEADER_SIZE, obj->code, obj->size);
+
+  int result = write_file(path, file, fileSize);
+  free(file);
+  return result;
+}
+
+/**
+ * Maps the code cache file at `path` if it's good for `src` and `options`,
+ * otherwise translates `src`, refreshes the file and maps the fresh code
+ */
+funcp sbasCompileCached(const char* path, const char* src, size_t len, const CompileOptions* options) {
+  SbasObject obj = {0};
+
+  if (options && options->instrument) {
+    return sbasCompileWithOptions(src, len, options);
+  }
+
+  funcp result_func = sbasAotLoad(path, src, len, options);
+  if (result_func) {
+    return result_func;
+  }
+
+  if (sbasTranslateWithOptions(src, len, options, &obj) == -1) {
+    return NULL;
+  }
+
+  // a cache that can't be written only costs the next start a compile
+  sbasAotStore(path, src, len, &obj);
+
+  result_func = sbasMapObject(&obj);
+  if (result_func) {
+    perfRecordCode(result_func, obj.size, obj.lt, obj.lines, src, len);
+  }
+  sbasFreeObject(&obj);
+  return result_func;
+}
+
+/**
+ * Checks that a code cache file header belongs to `src` and that every
+ * section it describes lies within the file
+ * @returns 0 when the file can be mapped, -1 otherwise
+ */
+static int check_header(const AotHeader* header, const char* src, size_t len, int options, off_t fileSize) {
+  if (memcmp(header->magic, AOT_MAGIC, sizeof(AOT_MAGIC)) != 0 || header->version != AOT_VERSION) {
+    fprintf(stderr, "check_header: not a code cache file of this SBas version.\n");
+    return -1;
+  }
+
+  // a stale file is expected after editing the source or changing the options: recompile quietly
+  if (header->sourceLen != len || header->sourceHash != hashBytes(src, len) || header->options != (uint32_t)options) {
+    return -1;
+  }
+
+  uint64_t lineTableEnd = header->lineTableOffset + (uint64_t)header->lineCount * sizeof(LineTable);
+  size_t pagesize = sysconf(_SC_PAGESIZE);
+  if (header->codeSize == 0 || header->lineTableOffset < sizeof(AotHeader) || lineTableEnd > header->codeOffset ||
+      header->codeOffset % pagesize != 0 ||
+      header->codeOffset + CODE_HEADER_SIZE + header->codeSize > (uint64_t)fileSize) {
+    fprintf(stderr, "check_header: code cache file is corrupt.\n");
+    return -1;
+  }
+
+  return 0;
+}
+
+/**
+ * Describes a function loaded from a code cache file to perf,
+ * with the line table stored next to its code
+ */
+static void record_loaded_code(int fd, const AotHeader* header, funcp code, const char* src, size_t len) {
+  if (!perfEnabled()) return;
+
+  size_t lineTableSize = header->lineCount * sizeof(LineTable);
+  LineTable* lt = lineTableSize ? malloc(lineTableSize) : NULL;
+
+  // without its line table, the function can still be named
+  if (lt && pread(fd, lt, lineTableSize, header->lineTableOffset) != (ssize_t)lineTableSize) {
+    free(lt);
+    lt = NULL;
+  }
+  perfRecordCode(code, header->codeSize, lt, lt ? header->lineCount : 0, src, len);
+  free(lt);
+}
+
+/**
+ * Writes `data` to a temporary file next to `path` and renames it into place
+ * @returns 0 on success, -1 on failure
+ */
+static int write_file(const char* path, const unsigned char* data, size_t size) {
+  size_t pathLen = strlen(path);
+  char* tmpPath = malloc(pathLen + 32);
+  if (!tmpPath) {
+    fprintf(stderr, "write_file: failed to alloc path.\n");
+    return -1;
+  }
+  snprintf(tmpPath, pathLen + 32, "%s.%ld.tmp", path, (long)getpid());
+
+  int result = -1;
+  int fd = open(tmpPath, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd == -1) {
+    fprintf(stderr, "write_file: failed to create %s.\n", tmpPath);
+    goto on_cleanup;
+  }
+
+  size_t written = 0;
+  while (written < size) {
+    ssize_t n = write(fd, data + written, size - written);
+    if (n == -1 && errno == EINTR) continue;
+    if (n <= 0) break;
+    written += n;
+  }
+
+  if (close(fd) == -1 || written != size || rename(tmpPath, path) == -1) {
+    fprintf(stderr, "write_file: failed to write %s.\n", path);
+    unlink(tmpPath);
+    goto on_cleanup;
+  }
+
+  result = 0;
+
+on_cleanup:
+  free(tmpPath);
+  return result;
+}
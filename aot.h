@@ -0,0 +1,48 @@
+#ifndef AOT_H
+#define AOT_H
+#include <stddef.h>
+
+#include "types.h"
+
+#define AOT_MAGIC "SBASAOT"  // first bytes of every code cache file
+#define AOT_VERSION 1        // bump whenever the emitted machine code changes
+
+/**
+ * Loads a SBas function from a code cache file written by `sbasAotStore`.
+ * The linked machine code is mapped straight from the file as R+X, so nothing
+ * is assembled. The file is only used if it was written for the very same
+ * source and optimization level and passes validation.
+ * @param path the code cache file
+ * @param src SBas source the function must have been compiled from
+ * @param len amount of bytes in `src`
+ * @param options options the function must have been compiled with, `NULL` for the defaults
+ * @returns the function, free it with `sbasCleanup`; `NULL` if the file is
+ * missing, stale or corrupt
+ */
+funcp sbasAotLoad(const char* path, const char* src, size_t len, const CompileOptions* options);
+
+/**
+ * Writes a translated SBas function to a code cache file.
+ * The file is written aside and renamed into place, so concurrent loaders
+ * never see it half written.
+ * @param path the code cache file
+ * @param src SBas source `obj` was translated from
+ * @param len amount of bytes in `src`
+ * @param obj the object filled in by `sbasTranslate`, at any optimization level but not instrumented
+ * @returns 0 on success, -1 on failure
+ */
+int sbasAotStore(const char* path, const char* src, size_t len, const SbasObject* obj);
+
+/**
+ * Loads a SBas function from a code cache file, or compiles it and
+ * (re)writes the file when it can't be used
+ * @param path the code cache file
+ * @param src SBas source, it doesn't need to be NUL-terminated
+ * @param len amount of bytes in `src`
+ * @param options compilation knobs, `NULL` for the defaults. Instrumented
+ * functions are compiled without touching the file
+ * @returns the function, free it with `sbasCleanup`; `NULL` on failure
+ */
+funcp sbasCompileCached(const char* path, const char* src, size_t len, const CompileOptions* options);
+
+#endif
@@ -0,0 +1,537 @@
+#define _GNU_SOURCE  // memfd_create and fallocate
+#include "arena.h"
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "perf.h"
+#include "sbas.h"
+#include "utils.h"
+
+#define OP_INT3 0xCC  // fills the gaps between functions so stray jumps trap
+
+/**
+ * A slice of a region, either holding a function or waiting to be reused
+ *
+ * Fields:
+ * - `offset`: start of the slice from the region base, multiple of `ARENA_ALIGNMENT`
+ * - `size`: bytes in the slice, multiple of `ARENA_ALIGNMENT`
+ * - `isFree`: whether the slice can be handed out again
+ */
+typedef struct {
+  size_t offset;
+  size_t size;
+  char isFree;
+} ArenaBlock;
+
+/**
+ * A single mapping shared by many functions.
+ * Blocks tile `[0, top)` without gaps and are kept sorted by offset.
+ *
+ * Dual-mapped regions map the same memfd twice: `base` is the R+X view
+ * functions run from and `rw` the R+W view code is written through.
+ * Other regions are a single mapping flipped with `mprotect`, `rw` being `base`.
+ */
+typedef struct ArenaRegion {
+  unsigned char* base;
+  unsigned char* rw;
+  int fd;              // memfd behind both views, -1 for single mappings
+  size_t size;         // mapped bytes
+  size_t top;          // end of the last block: bytes past it were never handed out
+  size_t freeBytes;    // bytes held by free blocks
+  ArenaBlock* blocks;  // every block below `top`
+  int blockCount;
+  int blockCapacity;
+  char writable;  // R+W, holding functions that wait for `sbasArenaCommit`: the staging region of new code
+  struct ArenaRegion* next;
+} ArenaRegion;
+
+struct CodeArena {
+  size_t regionSize;
+  char dualMapped;  // new regions get an R+W and an R+X view instead of being flipped
+  ArenaRegion* regions;
+};
+
+static size_t round_up(size_t value, size_t multiple);
+static ArenaRegion* map_region(CodeArena* arena, size_t minSize);
+static int map_views(ArenaRegion* region);
+static void unmap_region(ArenaRegion* region);
+static int make_region_writable(ArenaRegion* region);
+static int make_region_executable(ArenaRegion* region);
+static int insert_block(ArenaRegion* region, int index, size_t offset, size_t size, char isFree);
+static void remove_block(ArenaRegion* region, int index);
+static unsigned char* reserve(CodeArena* arena, size_t size, ArenaRegion** owner);
+static char takes_code(const ArenaRegion* region);
+static ArenaRegion* find_region(CodeArena* arena, unsigned char* ptr);
+static int find_block(ArenaRegion* region, size_t offset);
+
+/**
+ * Creates an arena that maps `regionSize` bytes whenever it runs out of space
+ */
+CodeArena* sbasArenaCreate(size_t regionSize) {
+  CodeArena* arena = calloc(1, sizeof(CodeArena));
+  if (!arena) {
+    fprintf(stderr, "sbasArenaCreate: failed to alloc arena.\n");
+    return NULL;
+  }
+
+  size_t pagesize = sysconf(_SC_PAGESIZE);
+  arena->regionSize = round_up(regionSize ? regionSize : ARENA_DEFAULT_REGION_SIZE, pagesize);
+  return arena;
+}
+
+/**
+ * Creates an arena whose regions are written through a second, R+W view
+ */
+CodeArena* sbasArenaCreateDualMapped(size_t regionSize) {
+  CodeArena* arena = sbasArenaCreate(regionSize);
+  if (arena) {
+    arena->dualMapped = 1;
+  }
+  return arena;
+}
+
+/**
+ * Compiles the SBas function at the open `FILE*` handle `f` into the arena
+ */
+funcp sbasArenaCompile(CodeArena* arena, FILE* f) {
+  size_t len = 0;
+  rewind(f);  // compile the whole file, wherever previous reads left it
+
+  char* src = readSource(f, &len);
+  if (!src) {
+    return NULL;
+  }
+
+  funcp entry = sbasArenaCompileBuffer(arena, src, len);
+  free(src);
+  return entry;
+}
+
+/**
+ * Translates the SBas function in the `len` bytes at `src` and copies it
+ * to the first free slice of the arena that fits it
+ */
+funcp sbasArenaCompileBuffer(CodeArena* arena, const char* src, size_t len) {
+  SbasObject obj = {0};
+  unsigned char* writable = NULL;
+
+  if (sbasTranslate(src, len, &obj) == -1) {
+    return NULL;
+  }
+
+  funcp entry = arenaReserveCode(arena, obj.size, &writable);
+  if (entry) {
+    memcpy(writable, obj.code, obj.size);
+    perfRecordCode(entry, obj.size, obj.lt, obj.lines, src, len);
+  }
+
+  sbasFreeObject(&obj);
+  return entry;
+}
+
+/**
+ * Hands out a slice of `size` bytes filled with `int3`, together with the
+ * address it can be written at: the slice itself, made writable, or its
+ * alias in the R+W view of a dual-mapped region
+ */
+funcp arenaReserveCode(CodeArena* arena, size_t size, unsigned char** writable) {
+  ArenaRegion* region = NULL;
+
+  size_t slotSize = round_up(size, ARENA_ALIGNMENT);
+  unsigned char* entry = reserve(arena, slotSize, &region);
+  if (!entry) {
+    return NULL;
+  }
+
+  if (make_region_writable(region) == -1) {
+    sbasArenaFree(arena, (funcp)entry);
+    return NULL;
+  }
+
+  *writable = region->rw + (entry - region->base);
+  memset(*writable, OP_INT3, slotSize);
+  return (funcp)entry;
+}
+
+/**
+ * Flips every region written since the last commit to R+X.
+ * Dual-mapped regions are always executable, so there's nothing to flip.
+ */
+int sbasArenaCommit(CodeArena* arena) {
+  for (ArenaRegion* region = arena->regions; region; region = region->next) {
+    if (make_region_executable(region) == -1) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+/**
+ * Marks the slice of `sbasFunc` as free, merging it with free neighbours
+ */
+void sbasArenaFree(CodeArena* arena, funcp sbasFunc) {
+  unsigned char* ptr = (unsigned char*)sbasFunc;
+
+  ArenaRegion* region = find_region(arena, ptr);
+  int index = region ? find_block(region, ptr - region->base) : -1;
+  if (index == -1 || region->blocks[index].isFree) {
+    fprintf(stderr, "sbasArenaFree: %p is not a function of this arena.\n", (void*)ptr);
+    return;
+  }
+
+  region->blocks[index].isFree = 1;
+  region->freeBytes += region->blocks[index].size;
+
+  // merge with the following block
+  if (index + 1 < region->blockCount && region->blocks[index + 1].isFree) {
+    region->blocks[index].size += region->blocks[index + 1].size;
+    remove_block(region, index + 1);
+  }
+
+  // merge with the preceding block
+  if (index > 0 && region->blocks[index - 1].isFree) {
+    region->blocks[index - 1].size += region->blocks[index].size;
+    remove_block(region, index);
+    index--;
+  }
+
+  // a free block at the end just gives its bytes back to the bump pointer
+  if (index == region->blockCount - 1) {
+    region->top = region->blocks[index].offset;
+    region->freeBytes -= region->blocks[index].size;
+    remove_block(region, index);
+  }
+}
+
+/**
+ * Unmaps empty regions and, when `moved` is given, slides live functions
+ * over the free blocks of their region
+ */
+int sbasArenaCompact(CodeArena* arena, ArenaMoveCallback moved, void* ctx) {
+  size_t pagesize = sysconf(_SC_PAGESIZE);
+  ArenaRegion** link = &arena->regions;
+
+  while (*link) {
+    ArenaRegion* region = *link;
+
+    if (region->top == 0) {
+      *link = region->next;
+      unmap_region(region);
+      continue;
+    }
+
+    if (moved && region->freeBytes > 0) {
+      const char hadPendingCode = region->writable;
+      if (make_region_writable(region) == -1) {
+        return -1;
+      }
+
+      size_t cursor = 0;
+      int live = 0;
+      for (int i = 0; i < region->blockCount; i++) {
+        ArenaBlock block = region->blocks[i];
+        if (block.isFree) continue;
+
+        if (block.offset != cursor) {
+          memmove(region->rw + cursor, region->rw + block.offset, block.size);
+          moved((funcp)(region->base + block.offset), (funcp)(region->base + cursor), ctx);
+        }
+        region->blocks[live].offset = cursor;
+        region->blocks[live].size = block.size;
+        region->blocks[live].isFree = 0;
+        live++;
+        cursor += block.size;
+      }
+      memset(region->rw + cursor, OP_INT3, region->top - cursor);
+
+      region->blockCount = live;
+      region->top = cursor;
+      region->freeBytes = 0;
+
+      if (!hadPendingCode && make_region_executable(region) == -1) {
+        return -1;
+      }
+
+      // the pages past the new top hold nothing but padding
+      size_t usedPages = round_up(region->top, pagesize);
+      if (usedPages < region->size) {
+        if (region->fd != -1) {
+          // shared pages outlive MADV_DONTNEED, drop them from the memfd itself
+          fallocate(region->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, usedPages, region->size - usedPages);
+        } else {
+          madvise(region->base + usedPages, region->size - usedPages, MADV_DONTNEED);
+        }
+      }
+    }
+
+    link = &region->next;
+  }
+  return 0;
+}
+
+/**
+ * Unmaps every region and frees the arena itself
+ */
+void sbasArenaDestroy(CodeArena* arena) {
+  if (!arena) return;
+
+  ArenaRegion* region = arena->regions;
+  while (region) {
+    ArenaRegion* next = region->next;
+    unmap_region(region);
+    region = next;
+  }
+  free(arena);
+}
+
+/**
+ * Rounds `value` up to the next multiple of `multiple`
+ */
+static size_t round_up(size_t value, size_t multiple) { return ((value + multiple - 1) / multiple) * multiple; }
+
+/**
+ * Maps a new R+W region big enough for `minSize` bytes and links it to the arena
+ */
+static ArenaRegion* map_region(CodeArena* arena, size_t minSize) {
+  size_t pagesize = sysconf(_SC_PAGESIZE);
+  size_t size = minSize > arena->regionSize ? round_up(minSize, pagesize) : arena->regionSize;
+
+  ArenaRegion* region = calloc(1, sizeof(ArenaRegion));
+  if (!region) {
+    fprintf(stderr, "map_region: failed to alloc region.\n");
+    return NULL;
+  }
+
+  region->size = size;
+  region->fd = -1;
+
+  if (arena->dualMapped) {
+    if (map_views(region) == -1) {
+      free(region);
+      return NULL;
+    }
+  } else {
+    region->base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (region->base == MAP_FAILED) {
+      fprintf(stderr, "map_region: failed to mmap region.\n");
+      free(region);
+      return NULL;
+    }
+    region->rw = region->base;
+    region->writable = 1;
+  }
+
+  region->next = arena->regions;
+  arena->regions = region;
+  return region;
+}
+
+/**
+ * Backs a region with a memfd mapped twice, R+W for writing and R+X for running.
+ * Neither view ever changes protection, so no mapping is ever both writable and executable.
+ * @returns 0 on success, -1 on failure
+ */
+static int map_views(ArenaRegion* region) {
+  region->fd = memfd_create("sbas-code", MFD_CLOEXEC);
+  if (region->fd == -1) {
+    fprintf(stderr, "map_views: failed to create memfd.\n");
+    return -1;
+  }
+
+  if (ftruncate(region->fd, region->size) != 0) {
+    fprintf(stderr, "map_views: failed to size memfd.\n");
+    goto on_error;
+  }
+
+  region->rw = mmap(NULL, region->size, PROT_READ | PROT_WRITE, MAP_SHARED, region->fd, 0);
+  if (region->rw == MAP_FAILED) {
+    fprintf(stderr, "map_views: failed to mmap R+W view.\n");
+    goto on_error;
+  }
+
+  region->base = mmap(NULL, region->size, PROT_READ | PROT_EXEC, MAP_SHARED, region->fd, 0);
+  if (region->base == MAP_FAILED) {
+    fprintf(stderr, "map_views: failed to mmap R+X view.\n");
+    munmap(region->rw, region->size);
+    goto on_error;
+  }
+  return 0;
+
+on_error:
+  close(region->fd);
+  return -1;
+}
+
+/**
+ * Unmaps a region and frees its bookkeeping
+ */
+static void unmap_region(ArenaRegion* region) {
+  munmap(region->base, region->size);
+  if (region->fd != -1) {
+    munmap(region->rw, region->size);
+    close(region->fd);
+  }
+  free(region->blocks);
+  free(region);
+}
+
+/**
+ * Flips a region to R+W so new code can be copied into it.
+ * Functions already in it can't run until the next commit, which is why only
+ * empty regions and compaction flip committed ones.
+ */
+static int make_region_writable(ArenaRegion* region) {
+  if (region->writable || region->fd != -1) return 0;
+
+  if (mprotect(region->base, region->size, PROT_READ | PROT_WRITE) != 0) {
+    fprintf(stderr, "make_region_writable: failed to set region to R+W through mprotect.\n");
+    return -1;
+  }
+  region->writable = 1;
+  return 0;
+}
+
+/**
+ * Drops the write flag of a region, enforcing W^X
+ */
+static int make_region_executable(ArenaRegion* region) {
+  if (!region->writable || region->fd != -1) return 0;
+
+  if (mprotect(region->base, region->size, PROT_READ | PROT_EXEC) != 0) {
+    fprintf(stderr, "make_region_executable: failed to set region to R+X through mprotect.\n");
+    return -1;
+  }
+  region->writable = 0;
+  return 0;
+}
+
+/**
+ * Inserts a block at position `index` of the region's block list
+ * @returns 0 on success, -1 on failure
+ */
+static int insert_block(ArenaRegion* region, int index, size_t offset, size_t size, char isFree) {
+  if (region->blockCount == region->blockCapacity) {
+    int capacity = region->blockCapacity ? region->blockCapacity * 2 : 16;
+    ArenaBlock* blocks = realloc(region->blocks, capacity * sizeof(ArenaBlock));
+    if (!blocks) {
+      fprintf(stderr, "insert_block: failed to grow block list.\n");
+      return -1;
+    }
+    region->blocks = blocks;
+    region->blockCapacity = capacity;
+  }
+
+  memmove(&region->blocks[index + 1], &region->blocks[index], (region->blockCount - index) * sizeof(ArenaBlock));
+  region->blocks[index].offset = offset;
+  region->blocks[index].size = size;
+  region->blocks[index].isFree = isFree;
+  region->blockCount++;
+  return 0;
+}
+
+/**
+ * Removes the block at position `index` of the region's block list
+ */
+static void remove_block(ArenaRegion* region, int index) {
+  memmove(&region->blocks[index], &region->blocks[index + 1], (region->blockCount - index - 1) * sizeof(ArenaBlock));
+  region->blockCount--;
+}
+
+/**
+ * Hands out `size` bytes, preferring free blocks over untouched space
+ * and untouched space over mapping a new region
+ *
+ * @param owner pointer where the region holding the slice is stored
+ * @returns the start of the slice, `NULL` on failure
+ */
+static unsigned char* reserve(CodeArena* arena, size_t size, ArenaRegion** owner) {
+  ArenaRegion* region;
+
+  // first fit among the blocks freed so far
+  for (region = arena->regions; region; region = region->next) {
+    if (region->freeBytes < size || !takes_code(region)) continue;
+
+    for (int i = 0; i < region->blockCount; i++) {
+      ArenaBlock* block = &region->blocks[i];
+      if (!block->isFree || block->size < size) continue;
+
+      if (block->size > size) {
+        if (insert_block(region, i + 1, block->offset + size, block->size - size, 1) == -1) {
+          return NULL;
+        }
+        block = &region->blocks[i];  // the list may have moved
+        block->size = size;
+      }
+      block->isFree = 0;
+      region->freeBytes -= size;
+
+      *owner = region;
+      return region->base + block->offset;
+    }
+  }
+
+  // bump allocation past the last block of a region
+  for (region = arena->regions; region; region = region->next) {
+    if (region->size - region->top >= size && takes_code(region)) break;
+  }
+  if (!region) {
+    region = map_region(arena, size);
+    if (!region) return NULL;
+  }
+
+  if (insert_block(region, region->blockCount, region->top, size, 0) == -1) {
+    return NULL;
+  }
+  unsigned char* slice = region->base + region->top;
+  region->top += size;
+
+  *owner = region;
+  return slice;
+}
+
+/**
+ * Whether new code can be written to a region without stopping the functions
+ * in it: flipping a committed region back to R+W would fault every call into it
+ * until the next commit, so only staging regions, empty ones and dual-mapped
+ * ones take code
+ */
+static char takes_code(const ArenaRegion* region) {
+  return region->fd != -1 || region->writable || region->top == 0;
+}
+
+/**
+ * Finds the region whose mapping contains `ptr`, `NULL` if there is none
+ */
+static ArenaRegion* find_region(CodeArena* arena, unsigned char* ptr) {
+  for (ArenaRegion* region = arena->regions; region; region = region->next) {
+    if (ptr >= region->base && ptr < region->base + region->size) {
+      return region;
+    }
+  }
+  return NULL;
+}
+
+/**
+ * Binary searches the block starting exactly at `offset`
+ * @returns the block's index, -1 if no block starts there
+ */
+static int find_block(ArenaRegion* region, size_t offset) {
+  int low = 0;
+  int high = region->blockCount - 1;
+
+  while (low <= high) {
+    int mid = low + (high - low) / 2;
+    if (region->blocks[mid].offset == offset) return mid;
+
+    if (region->blocks[mid].offset < offset) {
+      low = mid + 1;
+    } else {
+      high = mid - 1;
+    }
+  }
+  return -1;
+}
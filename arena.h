@@ -0,0 +1,102 @@
+#ifndef ARENA_H
+#define ARENA_H
+#include <stddef.h>
+#include <stdio.h>
+
+#include "types.h"
+
+#define ARENA_ALIGNMENT 64                   // every entry starts at a cache line
+#define ARENA_DEFAULT_REGION_SIZE (64 * 1024)  // bytes mapped per region when none is asked for
+
+/**
+ * A pool of large executable regions shared by many SBas functions.
+ *
+ * Functions compiled into an arena are written while their region is R+W and
+ * only become callable after `sbasArenaCommit`, which flips every region touched
+ * since the previous commit back to R+X with a single `mprotect` per region.
+ *
+ * Committed functions keep running while later ones are compiled: new code only
+ * goes to staging regions, holding nothing but uncommitted functions, so a
+ * committed region takes no more code until all of its functions are freed.
+ * Batching compilations between commits keeps regions full.
+ */
+typedef struct CodeArena CodeArena;
+
+/**
+ * Called by `sbasArenaCompact` for every function whose code was moved
+ */
+typedef void (*ArenaMoveCallback)(funcp from, funcp to, void* ctx);
+
+/**
+ * Creates an empty code arena
+ * @param regionSize bytes to map per region (rounded to pages), 0 for `ARENA_DEFAULT_REGION_SIZE`
+ */
+CodeArena* sbasArenaCreate(size_t regionSize);
+
+/**
+ * Creates an empty code arena that never changes page protections.
+ * Each region is a memfd mapped twice: an R+W view the compiler writes through
+ * and an R+X view functions run from, so W^X holds for every mapping while
+ * compiling, freeing and compacting need no `mprotect`. Functions are callable
+ * as soon as they're compiled and `sbasArenaCommit` has nothing to do.
+ * @param regionSize bytes to map per region (rounded to pages), 0 for `ARENA_DEFAULT_REGION_SIZE`
+ */
+CodeArena* sbasArenaCreateDualMapped(size_t regionSize);
+
+/**
+ * Compiles a SBas function into the arena.
+ * The returned pointer can't be called before the next `sbasArenaCommit`, while
+ * functions committed earlier stay callable.
+ * @param arena the arena to place the function in
+ * @param f **open** file handle of the `.sbas` file
+ */
+funcp sbasArenaCompile(CodeArena* arena, FILE* f);
+
+/**
+ * Compiles a SBas function held in memory into the arena.
+ * The returned pointer can't be called before the next `sbasArenaCommit`, while
+ * functions committed earlier stay callable.
+ * @param arena the arena to place the function in
+ * @param src SBas source, it doesn't need to be NUL-terminated
+ * @param len amount of bytes in `src`
+ */
+funcp sbasArenaCompileBuffer(CodeArena* arena, const char* src, size_t len);
+
+/**
+ * Makes every function compiled since the last commit executable
+ * @returns 0 on success, -1 on failure
+ */
+int sbasArenaCommit(CodeArena* arena);
+
+/**
+ * Releases the space of a function so later compilations can reuse it.
+ * Its region is kept mapped: see `sbasArenaCompact`
+ */
+void sbasArenaFree(CodeArena* arena, funcp sbasFunc);
+
+/**
+ * Returns unused memory to the system.
+ * Regions left without functions are unmapped. If `moved` is given, live
+ * functions are also packed to the start of their region and `moved` is told
+ * about each new address. No function of the arena may be running meanwhile.
+ * @returns 0 on success, -1 on failure
+ */
+int sbasArenaCompact(CodeArena* arena, ArenaMoveCallback moved, void* ctx);
+
+/**
+ * Unmaps every region of the arena, invalidating all of its functions
+ */
+void sbasArenaDestroy(CodeArena* arena);
+
+/**
+ * Hands out a slice of the arena for code written by the caller, as the
+ * compile functions do. It can't be called before the next `sbasArenaCommit`.
+ * @param arena the arena to place the code in
+ * @param size bytes of code
+ * @param writable receives the address the code is written at, which differs
+ * from the returned one in dual-mapped arenas
+ * @returns where the code runs from, release it with `sbasArenaFree`; `NULL` on failure
+ */
+funcp arenaReserveCode(CodeArena* arena, size_t size, unsigned char** writable);
+
+#endif
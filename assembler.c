@@ -1,39 +1,88 @@
 #include "assembler.h"
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
 #include "config.h"
+#include "ir.h"
+#include "lexer.h"
+#include "linker.h"
 #include "utils.h"
 
-#define BUFFER_SIZE 128  // length of a parsed line and of an error message
-
-/**
- * A SBas operand such as:
- * - variables (vX)
- * - parameters (pX)
- * - immediate values ($snum)
- *
- * Fields:
- * - `type`: `v`, `p` or `$`
- * - `value`: variable/parameter index (1..5) or an immediate value
- */
-typedef struct {
-  char type;
-  int value;
-} Operand;
+#define MAX_STATEMENT_SIZE 64  // upper bound of the bytes a single SBas command assembles to
+#define INITIAL_BYTES_PER_LINE 16  // first guess of the code size, the buffer grows past it
+#define PEEPHOLE_WINDOW 4  // upper bound of the instructions a single SBas command is emitted as
+#define MAX_MUL_STEPS 2    // longest instruction sequence a multiplication by a constant is rewritten as
+#define IMUL_LATENCY 3     // cycles `imul` takes, the sequences must beat it
+#define MOV_LATENCY 1      // cycles of copying the source to the destination, as move elimination isn't guaranteed
+#define MAX_TAIL_GROWTH 4  // bytes a return may grow the code by when copied over the taken jump to it
+#define FLAGS_UNSET -2     // block entry flags before any of its predecessors is emitted
 
 static void emit_instruction(unsigned char code[], int* pos, Instruction* inst);
 static void emit_prologue(unsigned char code[], int* pos);
 static void save_callee_saved_registers(unsigned char code[], int* pos);
 static void emit_return_value(unsigned char code[], int* pos, Operand* returnSymbol);
 static void emit_return(unsigned char code[], int* pos, Operand* returnSymbol, char* retFound, int* cleanupOffset);
-static void emit_attribution(unsigned char code[], int* pos, Operand* dest, Operand* source);
-static void emit_arithmetic_operation(unsigned char code[], int* pos, Operand* dest, Operand* lhs, char op, Operand* rhs);
-static void emit_cmp(unsigned char code[], int* pos, Operand* op);
 static void emit_near_jump(unsigned char code[], int* pos);
+static void emit_counter_increment(unsigned char code[], int* pos);
 static void restore_callee_saved_registers(unsigned char code[], int* pos);
 static void emit_epilogue(unsigned char code[], int* pos);
+static void push_saved_registers(unsigned char code[], int* pos, unsigned short saved);
+static void pop_saved_registers_and_return(unsigned char code[], int* pos, unsigned short saved);
+static unsigned short allocate_registers(const IrFunction* ir, int regOf[IR_VAR_COUNT + 1]);
+static Operand place_operand(Operand operand, const int regOf[IR_VAR_COUNT + 1]);
+static char duplicates_return(const IrFunction* ir, unsigned block, const int regOf[IR_VAR_COUNT + 1],
+                              unsigned short saved);
+static int tail_growth(Operand* returnSymbol, unsigned short saved);
 static int get_hardware_reg_index(char type, int idx);
+static char is_register(const Operand* operand);
+static char same_register(const Operand* a, const Operand* b);
+static int reserve_code(SbasObject* obj, int* capacity, int pos, int bytes);
+
+/**
+ * The instructions of a single SBas command, held back from `emit_instruction`
+ * so the peephole optimizer can rewrite them as a whole
+ */
+typedef struct {
+  Instruction insts[PEEPHOLE_WINDOW];
+  int count;
+} InstructionWindow;
+
+/**
+ * The instructions a multiplication by a constant can be rewritten with
+ */
+typedef enum {
+  MUL_STEP_LEA,    // x += x << amount, through `lea (x,x,2^amount)`
+  MUL_STEP_SHIFT,  // x <<= amount
+  MUL_STEP_ADD,    // x += source
+  MUL_STEP_SUB,    // x -= source
+  MUL_STEP_NEG,    // x = -x
+} MulStepKind;
+
+// cycles of latency of each `MulStepKind` on current x86-64 cores: a `lea` with a
+// base and a scaled index but no displacement takes a single one, like an ALU operation
+static const int MUL_STEP_LATENCY[] = {
+    [MUL_STEP_LEA] = 1, [MUL_STEP_SHIFT] = 1, [MUL_STEP_ADD] = 1, [MUL_STEP_SUB] = 1, [MUL_STEP_NEG] = 1,
+};
+
+typedef struct {
+  unsigned char kind;
+  unsigned char amount;
+} MulStep;
+
+static void emit_attribution(InstructionWindow* window, Operand* dest, Operand* source);
+static void emit_arithmetic_operation(InstructionWindow* window, Operand* dest, Operand* lhs, char op, Operand* rhs);
+static void emit_cmp(InstructionWindow* window, Operand* op);
+static int emit_constant_multiplication(InstructionWindow* window, Operand* dest, Operand* lhs, Operand* rhs);
+static int plan_multiplication(int factor, char sourceIsDest, MulStep steps[MAX_MUL_STEPS], int* stepCount);
+static void push_instruction(InstructionWindow* window, const Instruction* inst);
+static void flush_window(unsigned char code[], int* pos, InstructionWindow* window, char peephole, int* flagsOf);
+static void optimize_window(InstructionWindow* window);
+static void track_flags(InstructionWindow* window, int* flagsOf);
+static void fold_move(InstructionWindow* window, int i);
+static void shorten_instruction(Instruction* inst);
+static void make_lea(Instruction* inst, int dest, int base, int index, int scale, int displacement);
 
 typedef enum {
   OP_SAVE_BASE_PTR_IN_STACK_FRAME = 0x55,               // pushq %rbp
@@ -47,8 +96,16 @@ typedef enum {
   OP_IMUL_REG_BY_RM_STORE_IN_REG = (0x0F << 8) | 0xAF,  // multiply r/m 32/64 by r32/64 and store in r32/64 (r32/64 := r/m 32/64 * r32/64 )
   OP_IMUL_RM_BY_BYTE_STORE_IN_REG = 0x6B,               // multiply r/m 32/64 by imm8 and store in r32/64
   OP_IMUL_RM_BY_INT_STORE_IN_REG = 0x69,                // multiply r/m 32/64 by imm32 and store in r32/64
+  OP_INC_RM = 0xFF,                                     // increment r/m 32/64 (with the `reg` field set to 0)
+  OP_NEG_RM = 0xF7,                                     // negate r/m 32/64 (with the `reg` field set to 3)
+  OP_LEA = 0x8D,                                        // store effective address of m in r32/64
+  OP_XOR_REG_TO_RM = 0x31,                              // r/m 32/64 xor r32/64
+  OP_TEST_REG_RM = 0x85,                                // and r32/64 with r/m 32/64, only setting flags
+  OP_SHIFT_BY_IMM8 = 0xC1,                              // shift r/m 32/64 by imm8 (with the `reg` field telling which shift)
   OP_JMP_REL32 = 0xE9,                                  // unconditional jump to 32-bit offset
   OP_JLE_REL32 = 0x0F << 8 | 0x8E,                      // jump if less or equal to 32-bit offset
+  OP_PUSH_RD = 0x50,                                     // push r64 (requires register id `rd` embedded in opcode)
+  OP_POP_RD = 0x58,                                     // pop r64 (requires register id `rd` embedded in opcode)
   OP_LEAVE = 0xc9,                                      // movq %rbp, %rsp ; popq %rbp
   OP_RET = 0xc3,                                        // set %rip to address on top of stack, usually placed there by a `call`
 } Opcode;
@@ -64,6 +121,13 @@ typedef enum {
 
   // (01) Memory access: (register + signed byte). Used for stack frame offsets
   MOD_REG_PLUS_DISP8 = 1,
+
+  // (10) Memory access: (register + signed int). Used by `lea` for large constants
+  MOD_REG_PLUS_DISP32 = 2,
+
+  // (00) Memory access with no displacement, except for r/m = 101 that means
+  // (next instruction + signed int). Used for line counters
+  MOD_INDIRECT = 0,
 } Mod;
 
 /**
@@ -95,60 +159,86 @@ typedef enum {
  */
 typedef enum {
   EXT_ADD = 0,
+  EXT_INC = 0,  // with OP_INC_RM
+  EXT_DEC = 1,  // 001, with OP_INC_RM
+  EXT_NEG = 3,  // 011, with OP_NEG_RM
+  EXT_SHL = 4,  // 100, with OP_SHIFT_BY_IMM8
   EXT_SUB = 5,  // 101
   EXT_CMP = 7   // 111
 } OpcodeExtension;
 
 /**
- * Receives an **open** file handle of the SBas file and
+ * Receives the source of a SBas function and
  * attempts to write corresponding logic in x86-64 machine code to a buffer
  *
- * @param code writable buffer
- * @param f **open** file handle to SBas file
- * @param lt pointer to a line table struct
- * @param rt pointer to a relocation table struct
+ * @param src SBas source, it doesn't need to be NUL-terminated
+ * @param len amount of bytes in `src`
+ * @param options compilation knobs
+ * @param obj object whose `lt` has an entry per source line; receives the
+ * machine code in `code`, grown as needed, and its length in `size`
+ * @param rt pointer to a relocation table struct, with an entry per source line,
+ * two when instrumenting
  * @param relocCount pointer to a counter for tracking lines with jumps
  *
  * @returns 0 on success, -1 on failure
  */
-char sbasAssemble(unsigned char* code, FILE* f, LineTable* lt, RelocationTable* rt, int* relocCount) {
-  unsigned line = 1;                       // count in the SBas file
-  char lineBuffer[BUFFER_SIZE] = {0};      // a line in the SBas file
-  char errorMsgBuffer[BUFFER_SIZE] = {0};  // a compilation error message
-  int pos = 0;                             // byte position in the buffer
-  char retFound = 0;                       // turns on when the first `'ret'` is found
-  int cleanupOffset = 0;                   // position in buffer where the stack cleanup routine starts
+char sbasAssemble(const char* src, size_t len, const CompileOptions* options, SbasObject* obj, RelocationTable* rt,
+                  int* relocCount) {
+  Lexer lexer;            // reads commands straight from `src`
+  Statement stmt;         // the command being assembled
+  int lexRet = 0;         // result of reading the next command
+  int pos = 0;            // byte position in the buffer
+  char retFound = 0;      // turns on when the first `'ret'` is found
+  int cleanupOffset = 0;  // position in buffer where the stack cleanup routine starts
+  int capacity = 0;       // bytes allocated for `obj->code`
+  unsigned fallsFrom = 0;  // previous line when it always carries on into the current one
+  InstructionWindow window = {.count = 0};  // the instructions of the current command
+  LineTable* lt = obj->lt;
+  unsigned char* code;
+
+  // guess the code size from the line count so most sources never regrow
+  if (reserve_code(obj, &capacity, 0, MAX_STATEMENT_SIZE + obj->lines * INITIAL_BYTES_PER_LINE) == -1) {
+    return -1;
+  }
+  code = obj->code;
+
+  lexerInit(&lexer, src, len);
 
   emit_prologue(code, &pos);
   save_callee_saved_registers(code, &pos);
 
-  while (fgets(lineBuffer, sizeof(lineBuffer), f)) {
-    trimLeadingSpaces(lineBuffer);
-    const char firstChar = lineBuffer[0];
-
-    if (firstChar == ' ' || firstChar == '\n' || firstChar == '\0' || firstChar == '/') {
-      line++;
-      continue;
-    }
+  while ((lexRet = lexerNextStatement(&lexer, &stmt)) == 1) {
+    const unsigned line = stmt.line;
 
-    if (line > MAX_LINES) {
-      fprintf(stderr, "sbasCompile: the provided SBas file exceeds MAX_LINES (%d)!\n", MAX_LINES);
+    if (reserve_code(obj, &capacity, pos, MAX_STATEMENT_SIZE) == -1) {
       return -1;
     }
+    code = obj->code;
 
     lt[line].line = line;
     lt[line].offset = pos;
 
-    switch (firstChar) {
-      case 'r': { /* return */
-        Operand returnSymbol = {0};
-
-        if (sscanf(lineBuffer, "ret %c%d", &returnSymbol.type, &returnSymbol.value) != 2 || (returnSymbol.type != 'v' && returnSymbol.type != '$')) {
-          compilationError("sbasCompile: invalid 'ret' command: expected 'ret <var|$int>", line);
-          return -1;
-        }
+    // the increment opens the line, so jumps to the line count too
+    if (options->instrument) {
+      emit_counter_increment(code, &pos);
+
+      // request relocation to the line's counter, past the code, during linking
+      rt[*relocCount].offset = pos;
+      rt[*relocCount].targetOffset = line * sizeof(unsigned long long);
+      rt[*relocCount].targetLine = fallsFrom;
+      rt[*relocCount].kind = RELOC_COUNTER;
+      (*relocCount)++;
+
+      // Emit 4-byte placeholder for 32-bit offset
+      code[pos++] = 0;
+      code[pos++] = 0;
+      code[pos++] = 0;
+      code[pos++] = 0;
+    }
 
-        emit_return(code, &pos, &returnSymbol, &retFound, &cleanupOffset);
+    switch (stmt.kind) {
+      case STMT_RET: {
+        emit_return(code, &pos, &stmt.lhs, &retFound, &cleanupOffset);
 
         // if a 'ret' has already been found, further ones will just jump to the stack cleanup address
         if (retFound) {
@@ -168,82 +258,23 @@ char sbasAssemble(unsigned char* code, FILE* f, LineTable* lt, RelocationTable*
 
         break;
       }
-      case 'v': { /* attribution and arithmetic operation */
-        int destId;
-        char separator;
-
-        if (sscanf(lineBuffer, "v%d %c", &destId, &separator) != 2) {
-          compilationError("sbasCompile: invalid command: expected attribution (vX: varpc) or arithmetic operation (vX = varc op varc)", line);
-          return -1;
-        }
-
-        if (destId < 1 || destId > 5) {
-          snprintf(errorMsgBuffer, BUFFER_SIZE, "sbasCompile: invalid local variable index %d. Only v1 through v5 are allowed.", destId);
-          compilationError(errorMsgBuffer, line);
-          return -1;
-        }
-
-        if (separator != ':' && separator != '=') {
-          snprintf(errorMsgBuffer, BUFFER_SIZE, "sbasCompile: invalid operator %c. Only attribution (:) and arithmetic operation (=) are supported.", separator);
-          compilationError(errorMsgBuffer, line);
-          return -1;
-        }
-
-        Operand dest = {
-            .type = firstChar,
-            .value = destId,
-        };
-        // attribution
-        if (separator == ':') {
-          Operand source = {0};
-
-          if (sscanf(lineBuffer, "v%d : %c%d", &destId, &source.type, &source.value) != 3) {
-            compilationError("sbasCompile: invalid attribution: expected 'vX: <vX|pX|$num>'", line);
-            return -1;
-          }
-
-          emit_attribution(code, &pos, &dest, &source);
-        }
-        // arithmetic operation
-        else if (separator == '=') {
-          Operand lhs, rhs = {0};
-          char operator;
-          char remaining[BUFFER_SIZE] = {0};  // used in scanset to detect extra operands/operators
-
-          if (sscanf(lineBuffer, "v%d = %c%d %c %c%d %127[^\n]", &destId, &lhs.type, &lhs.value, &operator, &rhs.type, &rhs.value, remaining) != 6) {
-            compilationError("sbasCompile: invalid arithmetic operation: expected 'vX = <vX|$num> op <vX|$num>'", line);
-            return -1;
-          }
-
-          if (operator != '+' && operator != '-' && operator != '*') {
-            snprintf(errorMsgBuffer, BUFFER_SIZE, "sbasCompile: invalid arithmetic operation %c. Only addition (+), subtraction (-), and multiplication (*) allowed.", operator);
-            compilationError(errorMsgBuffer, line);
-            return -1;
-          }
-
-          emit_arithmetic_operation(code, &pos, &dest, &lhs, operator, &rhs);
-        }
-
+      case STMT_ATTRIBUTION: {
+        emit_attribution(&window, &stmt.dest, &stmt.lhs);
+        flush_window(code, &pos, &window, 0, NULL);
         break;
       }
-      case 'i': { /* conditional jump */
-        Operand op = {0};
-        int variableIndex;
-        unsigned targetLine;
-
-        if (sscanf(lineBuffer, "iflez v%d %u", &variableIndex, &targetLine) != 2) {
-          compilationError("sbasCompile: invalid 'iflez' command: expected 'iflez vX line'", line);
-          return -1;
-        }
-
-        op.type = 'v';
-        op.value = variableIndex;
-
-        emit_cmp(code, &pos, &op);
+      case STMT_ARITHMETIC: {
+        emit_arithmetic_operation(&window, &stmt.dest, &stmt.lhs, stmt.op, &stmt.rhs);
+        flush_window(code, &pos, &window, 0, NULL);
+        break;
+      }
+      case STMT_IFLEZ: { /* conditional jump */
+        emit_cmp(&window, &stmt.lhs);
+        flush_window(code, &pos, &window, 0, NULL);
         emit_near_jump(code, &pos);
 
         // Mark current line to be resolved in patching step
-        rt[*relocCount].targetLine = targetLine;
+        rt[*relocCount].targetLine = stmt.targetLine;
         rt[*relocCount].offset = pos;
         (*relocCount)++;
 
@@ -255,12 +286,14 @@ char sbasAssemble(unsigned char* code, FILE* f, LineTable* lt, RelocationTable*
 
         break;
       }
-      default: {
-        compilationError("sbasCompile: unknown SBas command", line);
-        return -1;
-      }
     }
-    line++;
+
+    // only `ret` and `iflez` may leave the line anywhere but the next one
+    fallsFrom = stmt.kind == STMT_ATTRIBUTION || stmt.kind == STMT_ARITHMETIC ? line : 0;
+  }
+
+  if (lexRet == -1) {
+    return -1;
   }
 
   if (!retFound) {
@@ -269,11 +302,250 @@ char sbasAssemble(unsigned char* code, FILE* f, LineTable* lt, RelocationTable*
   }
 
 #ifdef DEBUG
-  printf("sbasAssemble: processed %d lines, writing %d bytes in buffer\n", line - 1, pos);
+  printf("sbasAssemble: processed %d lines, writing %d bytes in buffer\n", lexer.line, pos);
   printf("sbasAssemble: found %d lines that should be patched\n", *relocCount);
-  printLineTable(lt, line);
+  printLineTable(lt, lexer.line + 1);
+  printRelocationTable(rt, *relocCount);
+#endif
+  obj->size = pos;
+  return 0;
+}
+
+/**
+ * Emits x86-64 machine code for an optimized SBas function, block by block.
+ * Jumps are left to the linker as in `sbasAssemble`, aimed at the line each
+ * target block starts at. Variables live in the registers `allocate_registers`
+ * picks for them, and there's no stack frame: only the callee-saved registers
+ * it had to hand out are pushed, and popped right before `ret`.
+ *
+ * Returns are duplicated where `MAX_TAIL_GROWTH` allows: later `ret`s copy the
+ * pops of the first one instead of jumping to them, and a jump to a block that
+ * only returns becomes that return, leaving the block out once nothing else
+ * enters it.
+ *
+ * @param ir the function, as left by the optimization passes
+ * @param obj object whose `lt` has an entry per source line; receives the
+ * machine code in `code`, grown as needed, and its length in `size`.
+ * Lines whose operations were optimized away keep no entry in `lt`
+ * @param rt pointer to a relocation table struct, with an entry per source line
+ * @param relocCount pointer to a counter for tracking lines with jumps
+ * @param points receives the loop heads and `iflez` compares `sbasRelax` may
+ * pad, two entries per source line; `NULL` when the code won't be padded
+ * @param pointCount pointer to a counter of the entries in `points`
+ *
+ * @returns 0 on success, -1 on failure
+ */
+char sbasAssembleIr(const IrFunction* ir, SbasObject* obj, RelocationTable* rt, int* relocCount, AlignPoint* points,
+                    int* pointCount) {
+  int pos = 0;            // byte position in the buffer
+  char retFound = 0;      // turns on when the first `'ret'` is emitted
+  int cleanupOffset = 0;  // position in buffer where the stack cleanup routine starts
+  int capacity = 0;       // bytes allocated for `obj->code`
+  int regOf[IR_VAR_COUNT + 1];  // hardware register of each variable
+  unsigned short saved = 0;     // bit r: callee-saved register r holds a variable, so it must be restored
+  InstructionWindow window = {.count = 0};  // the instructions of the current operation
+  char* duplicated = NULL;  // per block: ends with a jump to a lone return, which is copied in its place
+  char* reached = NULL;     // per block: entered by a jump or by falling through, so it's emitted
+  char* loopHead = NULL;    // per block: jumped to from itself or a later block
+  int* entryFlags = NULL;   // per block: register the flags hold a `test` of when entered, -1 if unknown
+  int flagsOf = -1;         // register the flags hold a `test` of, -1 if unknown
+  LineTable* lt = obj->lt;
+  unsigned char* code;
+  char result = -1;
+
+  duplicated = calloc(ir->blockCount, sizeof(char));
+  reached = calloc(ir->blockCount, sizeof(char));
+  loopHead = calloc(ir->blockCount, sizeof(char));
+  entryFlags = malloc(ir->blockCount * sizeof(int));
+  if (!duplicated || !reached || !loopHead || !entryFlags) {
+    fprintf(stderr, "sbasAssembleIr: failed to alloc block tables.\n");
+    goto on_cleanup;
+  }
+  if (reserve_code(obj, &capacity, 0, MAX_STATEMENT_SIZE + ir->opCount * INITIAL_BYTES_PER_LINE) == -1) {
+    goto on_cleanup;
+  }
+  code = obj->code;
+
+  saved = allocate_registers(ir, regOf);
+
+  reached[0] = 1;
+  for (unsigned b = 0; b < ir->blockCount; b++) {
+    unsigned successors[2];
+    entryFlags[b] = FLAGS_UNSET;
+    const unsigned count = irSuccessors(ir, b, successors);
+
+    duplicated[b] = duplicates_return(ir, b, regOf, saved);
+    for (unsigned s = 0; s < count && !duplicated[b]; s++) {
+      reached[successors[s]] = 1;
+      loopHead[successors[s]] |= successors[s] <= b;
+    }
+  }
+
+  // SBas functions call nothing, so they need no frame nor an aligned stack
+  push_saved_registers(code, &pos, saved);
+
+  for (unsigned b = 0; b < ir->blockCount; b++) {
+    const IrBlock* block = &ir->blocks[b];
+    if (!reached[b]) continue;
+
+    // the flags are only known when every way in leaves the same ones, loop heads are entered from blocks yet to come
+    flagsOf = loopHead[b] || entryFlags[b] == FLAGS_UNSET ? -1 : entryFlags[b];
+
+    // jumps land on the block even when none of its operations are left
+    lt[block->line].line = block->line;
+    lt[block->line].offset = pos;
+    if (points && loopHead[b]) {
+      points[(*pointCount)++] = (AlignPoint){.offset = pos, .jump = -1, .kind = ALIGN_LOOP_HEAD};
+    }
+
+    for (unsigned i = block->first; i < block->first + block->count; i++) {
+      const IrOp* op = &ir->ops[i];
+      Operand dest = place_operand((Operand){'v', op->dest}, regOf);
+      Operand lhs = place_operand(op->a, regOf);
+      Operand rhs = place_operand(op->b, regOf);
+
+      if (reserve_code(obj, &capacity, pos, MAX_STATEMENT_SIZE) == -1) {
+        goto on_cleanup;
+      }
+      code = obj->code;
+
+      if (lt[op->line].line == 0) {
+        lt[op->line].line = op->line;
+        lt[op->line].offset = pos;
+      }
+
+      switch (op->opcode) {
+        case IR_MOV:
+          emit_attribution(&window, &dest, &lhs);
+          flush_window(code, &pos, &window, 1, &flagsOf);
+          break;
+        case IR_ADD:
+        case IR_SUB:
+        case IR_MUL:
+          if (op->opcode != IR_MUL || emit_constant_multiplication(&window, &dest, &lhs, &rhs) == -1) {
+            emit_arithmetic_operation(&window, &dest, &lhs, op->opcode == IR_ADD ? '+' : op->opcode == IR_SUB ? '-' : '*',
+                                      &rhs);
+          }
+          flush_window(code, &pos, &window, 1, &flagsOf);
+          break;
+        case IR_JLEZ:
+          if (points) {
+            points[(*pointCount)++] = (AlignPoint){.offset = pos, .jump = *relocCount, .kind = ALIGN_BRANCH};
+          }
+          emit_cmp(&window, &lhs);
+          flush_window(code, &pos, &window, 1, &flagsOf);
+          emit_near_jump(code, &pos);
+
+          // resolved in the patching step, like source-level jumps
+          rt[*relocCount].targetLine = ir->blocks[op->target].line;
+          rt[*relocCount].offset = pos;
+          (*relocCount)++;
+
+          // Emit 4-byte placeholder for 32-bit offset
+          code[pos++] = 0;
+          code[pos++] = 0;
+          code[pos++] = 0;
+          code[pos++] = 0;
+          break;
+        case IR_JMP:
+          if (duplicated[b]) {
+            Operand value = place_operand(ir->ops[ir->blocks[op->target].first].a, regOf);
+            emit_return_value(code, &pos, &value);
+            if (!retFound) {
+              retFound = 1;
+              cleanupOffset = pos;
+            }
+            pop_saved_registers_and_return(code, &pos, saved);
+            break;
+          }
+          code[pos++] = OP_JMP_REL32;
+
+          rt[*relocCount].targetLine = ir->blocks[op->target].line;
+          rt[*relocCount].offset = pos;
+          (*relocCount)++;
+
+          code[pos++] = 0;
+          code[pos++] = 0;
+          code[pos++] = 0;
+          code[pos++] = 0;
+          break;
+        case IR_RET: {
+          emit_return_value(code, &pos, &lhs);
+
+          // further returns jump to the stack cleanup of the first one, unless copying it is cheap enough
+          if (!retFound || tail_growth(NULL, saved) <= MAX_TAIL_GROWTH) {
+            if (!retFound) {
+              retFound = 1;
+              cleanupOffset = pos;
+            }
+            pop_saved_registers_and_return(code, &pos, saved);
+          } else {
+            code[pos++] = OP_JMP_REL32;
+
+            rt[*relocCount].offset = pos;
+            rt[*relocCount].targetOffset = cleanupOffset;
+            (*relocCount)++;
+
+            code[pos++] = 0;
+            code[pos++] = 0;
+            code[pos++] = 0;
+            code[pos++] = 0;
+          }
+          break;
+        }
+      }
+    }
+
+    // neither `jle` nor `jmp` touch the flags, so every successor sees the ones the block leaves
+    unsigned successors[2];
+    const unsigned count = duplicated[b] ? 0 : irSuccessors(ir, b, successors);
+    for (unsigned s = 0; s < count; s++) {
+      int* entry = &entryFlags[successors[s]];
+      *entry = *entry == FLAGS_UNSET || *entry == flagsOf ? flagsOf : -1;
+    }
+  }
+
+  if (!retFound) {
+    fprintf(stderr, "sbasCompile: SBas function doesn't include 'ret'. Aborting!\n");
+    goto on_cleanup;
+  }
+
+#ifdef DEBUG
+  printf("sbasAssembleIr: processed %u blocks, writing %d bytes in buffer\n", ir->blockCount, pos);
+  printLineTable(lt, ir->lines);
   printRelocationTable(rt, *relocCount);
 #endif
+  obj->size = pos;
+  result = 0;
+
+on_cleanup:
+  free(duplicated);
+  free(reached);
+  free(loopHead);
+  free(entryFlags);
+  return result;
+}
+
+/**
+ * Makes sure the code buffer of `obj` has room for `bytes` more bytes past `pos`,
+ * doubling it when it doesn't
+ * @returns 0 on success, -1 on failure
+ */
+static int reserve_code(SbasObject* obj, int* capacity, int pos, int bytes) {
+  if (pos + bytes <= *capacity) return 0;
+
+  int newCapacity = *capacity ? *capacity : bytes;
+  while (newCapacity < pos + bytes) {
+    newCapacity *= 2;
+  }
+
+  unsigned char* code = realloc(obj->code, newCapacity);
+  if (!code) {
+    fprintf(stderr, "sbasCompile: failed to grow code buffer to %d bytes.\n", newCapacity);
+    return -1;
+  }
+  obj->code = code;
+  *capacity = newCapacity;
   return 0;
 }
 
@@ -305,10 +577,10 @@ static void emit_prologue(unsigned char code[], int* pos) {
 static void emit_return_value(unsigned char code[], int* pos, Operand* returnSymbol) {
   Instruction _return = {0};
 
-  // local variable return (ret vX)
-  if (returnSymbol->type == 'v') {
+  // local variable return (ret vX), nothing to do when it already lives in the return register
+  if (is_register(returnSymbol)) {
     int regCode = get_hardware_reg_index(returnSymbol->type, returnSymbol->value);
-    if (regCode == -1) return;
+    if (regCode == -1 || regCode == REG_RAX) return;
 
     _return.opcode = OP_MOV_REG_TO_RM;
 
@@ -442,6 +714,38 @@ static void emit_epilogue(unsigned char code[], int* pos) {
   (*pos)++;
 }
 
+/**
+ * Opens an optimized function by pushing the callee-saved registers in
+ * `saved` (bit r for register r), lowest first
+ */
+static void push_saved_registers(unsigned char code[], int* pos, unsigned short saved) {
+  for (int regCode = 0; regCode < 16; regCode++) {
+    if (!(saved & (1u << regCode))) continue;
+
+    // pushq <register>, with REX.B for r8-r15
+    if (regCode > 7) {
+      code[(*pos)++] = 0x41;
+    }
+    code[(*pos)++] = OP_PUSH_RD + (regCode & 7);
+  }
+}
+
+/**
+ * Undoes `push_saved_registers` and returns
+ */
+static void pop_saved_registers_and_return(unsigned char code[], int* pos, unsigned short saved) {
+  for (int regCode = 15; regCode >= 0; regCode--) {
+    if (!(saved & (1u << regCode))) continue;
+
+    // popq <register>, with REX.B for r8-r15
+    if (regCode > 7) {
+      code[(*pos)++] = 0x41;
+    }
+    code[(*pos)++] = OP_POP_RD + (regCode & 7);
+  }
+  code[(*pos)++] = OP_RET;
+}
+
 /**
  * Unconditionally emits a "return" as in storing the wanted return value on the return register.
  * Whether it also emits the stack cleanup instructions - restoring callee-saveds and
@@ -473,19 +777,19 @@ static void emit_return(unsigned char code[], int* pos, Operand* returnSymbol, c
  * Emits machine code for a SBas attribution:
  * vX: <vX|pX|$num>
  */
-static void emit_attribution(unsigned char code[], int* pos, Operand* dest, Operand* source) {
+static void emit_attribution(InstructionWindow* window, Operand* dest, Operand* source) {
   Instruction attribution = {0};
 
   int dstRegCode = get_hardware_reg_index(dest->type, dest->value);
   if (dstRegCode == -1) return;
 
   // Peephole optimization? Only emit mov if Source is different from Destination
-  if (source->type == 'v' && (source->value == dest->value)) {
+  if (same_register(source, dest)) {
     return;
   }
 
   // var to var attribution (vX : vY) and param to var attribution (vX : pY)
-  if (source->type == 'v' || source->type == 'p') {
+  if (is_register(source)) {
     int srcRegCode = get_hardware_reg_index(source->type, source->value);
     attribution.opcode = OP_MOV_REG_TO_RM;
 
@@ -508,16 +812,42 @@ static void emit_attribution(unsigned char code[], int* pos, Operand* dest, Oper
     fprintf(stderr, "emit_attribution: invalid source for variable attribution: %c\n", source->type);
     return;
   }
-  emit_instruction(code, pos, &attribution);
+  push_instruction(window, &attribution);
 }
 
 /**
  * Emit machine code for a SBas arithmetic operation:
  * vX = <vX | $num> op <vX | $num>
  */
-static void emit_arithmetic_operation(unsigned char code[], int* pos, Operand* dest, Operand* lhs, char op, Operand* rhs) {
+static void emit_arithmetic_operation(InstructionWindow* window, Operand* dest, Operand* lhs, char op, Operand* rhs) {
   // For commutative operations, we swap the operands so we keep a single logic path
-  if ((op == '+' || op == '*') && lhs->type == '$' && rhs->type == 'v') {
+  if ((op == '+' || op == '*') && lhs->type == '$' && is_register(rhs)) {
+    Operand* temp = lhs;
+    lhs = rhs;
+    rhs = temp;
+  }
+
+  int dstRegCode = get_hardware_reg_index(dest->type, dest->value);
+  if (dstRegCode == -1) return;
+
+  /**
+   * The first instruction overwrites the destination, so when only the RHS
+   * is the destination it has to go first: `a + vX` and `a * vX` become
+   * `vX + a` and `vX * a`, and `a - vX` becomes `-vX + a`:
+   * negl <attributedVar>
+   */
+  const char lhsIsDest = same_register(lhs, dest);
+  if (!lhsIsDest && same_register(rhs, dest)) {
+    if (op == '-') {
+      Instruction neg = {0};
+      neg.opcode = OP_NEG_RM;
+      neg.use_modrm = 1;
+      neg.mod = MOD_REGISTER_DIRECT;
+      neg.reg = EXT_NEG;
+      neg.rm = dstRegCode;
+      push_instruction(window, &neg);
+      op = '+';
+    }
     Operand* temp = lhs;
     lhs = rhs;
     rhs = temp;
@@ -529,14 +859,11 @@ static void emit_arithmetic_operation(unsigned char code[], int* pos, Operand* d
    */
   Instruction mov = {0};
 
-  int dstRegCode = get_hardware_reg_index(dest->type, dest->value);
-  if (dstRegCode == -1) return;
-
   // Peephole optimization? Only emit mov if LHS is different from Destination
-  const char isRedundantMove = (lhs->type == 'v' && (lhs->value == dest->value));
+  const char isRedundantMove = same_register(lhs, dest);
 
   if (!isRedundantMove) {
-    if (lhs->type == 'v') {
+    if (is_register(lhs)) {
       int srcRegCode = get_hardware_reg_index(lhs->type, lhs->value);
       if (srcRegCode == -1) return;
 
@@ -559,7 +886,7 @@ static void emit_arithmetic_operation(unsigned char code[], int* pos, Operand* d
       fprintf(stderr, "emit_arithmetic_operation: invalid LHS operand type: %c\n", lhs->type);
       return;
     }
-    emit_instruction(code, pos, &mov);
+    push_instruction(window, &mov);
   }
 
   /**
@@ -570,7 +897,7 @@ static void emit_arithmetic_operation(unsigned char code[], int* pos, Operand* d
   arithmeticOperation.use_modrm = 1;
   arithmeticOperation.mod = MOD_REGISTER_DIRECT;
 
-  if (rhs->type == 'v') {
+  if (is_register(rhs)) {
     int srcRegCode = get_hardware_reg_index(rhs->type, rhs->value);
 
     switch (op) {
@@ -636,14 +963,165 @@ static void emit_arithmetic_operation(unsigned char code[], int* pos, Operand* d
     fprintf(stderr, "emit_arithmetic_operation: invalid RHS operand type: %c\n", rhs->type);
     return;
   }
-  emit_instruction(code, pos, &arithmeticOperation);
+  push_instruction(window, &arithmeticOperation);
+}
+
+/**
+ * Emits `vX = vY * $k` (or `$k * vY`) as shifts, `lea`s and additions when
+ * `plan_multiplication` finds a sequence with less latency than `imul`
+ * @returns 0 if it emitted the multiplication, -1 if `imul` should
+ */
+static int emit_constant_multiplication(InstructionWindow* window, Operand* dest, Operand* lhs, Operand* rhs) {
+  MulStep steps[MAX_MUL_STEPS];
+  int stepCount = 0;
+
+  if (lhs->type == '$') {
+    Operand* temp = lhs;
+    lhs = rhs;
+    rhs = temp;
+  }
+  if (!is_register(lhs) || rhs->type != '$') return -1;
+
+  const int dst = get_hardware_reg_index(dest->type, dest->value);
+  const int src = get_hardware_reg_index(lhs->type, lhs->value);
+  if (dst == -1 || src == -1 || plan_multiplication(rhs->value, src == dst, steps, &stepCount) == -1) return -1;
+
+  // movl <source>, <attributedVar>, folded into a first `lea` by the peephole optimizer
+  if (src != dst) {
+    Instruction mov = {0};
+    mov.opcode = OP_MOV_REG_TO_RM;
+    mov.use_modrm = 1;
+    mov.mod = MOD_REGISTER_DIRECT;
+    mov.reg = src;
+    mov.rm = dst;
+    push_instruction(window, &mov);
+  }
+
+  for (int i = 0; i < stepCount; i++) {
+    Instruction step = {0};
+    step.use_modrm = 1;
+    step.mod = MOD_REGISTER_DIRECT;
+    step.rm = dst;
+
+    switch (steps[i].kind) {
+      case MUL_STEP_LEA:
+        make_lea(&step, dst, dst, dst, steps[i].amount, 0);
+        break;
+      case MUL_STEP_SHIFT:
+        // doubling right after the move is a `lea`, so they fold, and an `add` anywhere else
+        if (steps[i].amount == 1 && i == 0 && src != dst) {
+          make_lea(&step, dst, dst, dst, 0, 0);
+          break;
+        }
+        if (steps[i].amount == 1) {
+          step.opcode = OP_ADD_REG_TO_RM;
+          step.reg = dst;
+          break;
+        }
+        step.opcode = OP_SHIFT_BY_IMM8;
+        step.reg = EXT_SHL;
+        step.use_imm = 1;
+        step.imm_size = 1;
+        step.immediate = steps[i].amount;
+        break;
+      case MUL_STEP_ADD:
+        step.opcode = OP_ADD_REG_TO_RM;
+        step.reg = src;
+        break;
+      case MUL_STEP_SUB:
+        step.opcode = OP_SUB_REG_FROM_RM;
+        step.reg = src;
+        break;
+      case MUL_STEP_NEG:
+        step.opcode = OP_NEG_RM;
+        step.reg = EXT_NEG;
+        break;
+    }
+    push_instruction(window, &step);
+  }
+  return 0;
+}
+
+/**
+ * Finds the cheapest sequence of `MulStepKind`s multiplying by `factor`, by
+ * the latencies in `MUL_STEP_LATENCY` plus `MOV_LATENCY` when the source has to
+ * be copied to the destination first. Tried for |factor|, then negated:
+ * - 2^n: a shift
+ * - 3, 5 or 9 times 2^n: a `lea` and a shift
+ * - products of two of 3, 5 and 9: two `lea`s
+ * - 2^n + 1 and 2^n - 1: a shift and adding or subtracting the source, which
+ *   needs it in another register than the destination
+ * @param sourceIsDest whether the result overwrites the source
+ * @returns the latency of the sequence, or -1 if none beats `imul`
+ */
+static int plan_multiplication(int factor, char sourceIsDest, MulStep steps[MAX_MUL_STEPS], int* stepCount) {
+  // as unsigned so the most negative factor wraps like `imul` does
+  const unsigned magnitude = factor < 0 ? 0u - (unsigned)factor : (unsigned)factor;
+  MulStep candidates[3][MAX_MUL_STEPS + 1];
+  int counts[3] = {0, 0, 0};
+  int bestCost = IMUL_LATENCY;
+
+  if (magnitude == 0) return -1;
+
+  // 2^n, nothing at all for 1
+  if ((magnitude & (magnitude - 1)) == 0 && magnitude > 1) {
+    candidates[0][counts[0]++] = (MulStep){MUL_STEP_SHIFT, __builtin_ctz(magnitude)};
+  }
+
+  // (2^lea + 1) times 2^n or times (2^second + 1)
+  for (unsigned lea = 1; lea <= 3 && counts[1] == 0; lea++) {
+    const unsigned rest = magnitude / ((1u << lea) + 1);
+    if (magnitude % ((1u << lea) + 1) != 0) continue;
+
+    if ((rest & (rest - 1)) == 0) {
+      candidates[1][counts[1]++] = (MulStep){MUL_STEP_LEA, lea};
+      if (rest > 1) candidates[1][counts[1]++] = (MulStep){MUL_STEP_SHIFT, __builtin_ctz(rest)};
+    }
+    for (unsigned second = 1; second <= 3 && counts[1] == 0; second++) {
+      if (rest == (1u << second) + 1) {
+        candidates[1][counts[1]++] = (MulStep){MUL_STEP_LEA, lea};
+        candidates[1][counts[1]++] = (MulStep){MUL_STEP_LEA, second};
+      }
+    }
+  }
+
+  // 2^n + 1 and 2^n - 1, reading the source once the destination changed
+  if (!sourceIsDest && magnitude > 2 && ((magnitude - 1) & (magnitude - 2)) == 0) {
+    candidates[2][counts[2]++] = (MulStep){MUL_STEP_SHIFT, __builtin_ctz(magnitude - 1)};
+    candidates[2][counts[2]++] = (MulStep){MUL_STEP_ADD, 0};
+  } else if (!sourceIsDest && magnitude > 2 && (magnitude & (magnitude + 1)) == 0) {
+    candidates[2][counts[2]++] = (MulStep){MUL_STEP_SHIFT, __builtin_ctz(magnitude + 1)};
+    candidates[2][counts[2]++] = (MulStep){MUL_STEP_SUB, 0};
+  }
+
+  for (int c = 0; c < 3; c++) {
+    if (counts[c] == 0 && !(c == 0 && magnitude == 1)) continue;
+    if (factor < 0) candidates[c][counts[c]++] = (MulStep){MUL_STEP_NEG, 0};
+    if (counts[c] > MAX_MUL_STEPS) continue;
+
+    // the copy to the destination folds into a first `lea`, anything else waits for it
+    const MulStep* first = &candidates[c][0];
+    const char foldsMove =
+        counts[c] > 0 && (first->kind == MUL_STEP_LEA || (first->kind == MUL_STEP_SHIFT && first->amount == 1));
+    int cost = sourceIsDest || foldsMove ? 0 : MOV_LATENCY;
+    for (int i = 0; i < counts[c]; i++) {
+      cost += MUL_STEP_LATENCY[candidates[c][i].kind];
+    }
+    if (cost < bestCost) {
+      bestCost = cost;
+      *stepCount = counts[c];
+      memcpy(steps, candidates[c], counts[c] * sizeof(MulStep));
+    }
+  }
+
+  return bestCost < IMUL_LATENCY ? bestCost : -1;
 }
 
 /**
  * Writes first instruction of a SBas conditional jump (`iflez`):
  * cmpl $0, <variableRegister>
  */
-static void emit_cmp(unsigned char code[], int* pos, Operand* op) {
+static void emit_cmp(InstructionWindow* window, Operand* op) {
   int regCode = get_hardware_reg_index(op->type, op->value);
   if (regCode == -1) return;
 
@@ -655,7 +1133,7 @@ static void emit_cmp(unsigned char code[], int* pos, Operand* op) {
   cmp.reg = EXT_CMP;
   cmp.rm = regCode;
 
-  emit_instruction(code, pos, &cmp);
+  push_instruction(window, &cmp);
 }
 
 /**
@@ -680,13 +1158,320 @@ static void emit_near_jump(unsigned char code[], int* pos) {
   emit_instruction(code, pos, &jleRel32);
 }
 
+/**
+ * Emits the opcode and ModRM bytes of `incq rel32(%rip)` (7 bytes wide),
+ * bumping a line's 64-bit counter.
+ *
+ * As with `emit_near_jump`, it's the **caller's responsibility** to write the
+ * 4-byte offset to the counter right after.
+ *
+ * The increment clobbers the flags, which is harmless: every line starts
+ * with it and no SBas line reads flags set by a previous one.
+ */
+static void emit_counter_increment(unsigned char code[], int* pos) {
+  Instruction incq = {0};
+  incq.opcode = OP_INC_RM;
+  incq.is_64bit = 1;
+  incq.use_modrm = 1;
+  incq.mod = MOD_INDIRECT;
+  incq.reg = EXT_INC;
+  incq.rm = REG_RBP;  // r/m = 101 under MOD_INDIRECT: RIP-relative
+  emit_instruction(code, pos, &incq);
+}
+
+/**
+ * Queues an instruction of the current command
+ */
+static void push_instruction(InstructionWindow* window, const Instruction* inst) {
+  window->insts[window->count++] = *inst;
+}
+
+/**
+ * Encodes the queued instructions at offset `pos` in buffer `code`, first
+ * letting the peephole optimizer rewrite them if `peephole` is set, and
+ * empties the window
+ * @param flagsOf register the flags hold a `test` of, kept up to date so
+ * redundant ones are dropped; `NULL` to keep every `test`
+ */
+static void flush_window(unsigned char code[], int* pos, InstructionWindow* window, char peephole, int* flagsOf) {
+  if (peephole) {
+    optimize_window(window);
+  }
+  if (flagsOf) {
+    track_flags(window, flagsOf);
+  }
+  for (int i = 0; i < window->count; i++) {
+    emit_instruction(code, pos, &window->insts[i]);
+  }
+  window->count = 0;
+}
+
+/**
+ * The peephole optimizer: merges a register copy into the instruction
+ * consuming it, then swaps single instructions for shorter equivalents.
+ *
+ * Flags are fair game, as every `iflez` sets the ones it reads right before
+ * jumping, unless `track_flags` finds they're already set, and no other SBas
+ * command reads any.
+ */
+static void optimize_window(InstructionWindow* window) {
+  for (int i = 0; i + 1 < window->count; i++) {
+    fold_move(window, i);
+  }
+  for (int i = 0; i < window->count; i++) {
+    shorten_instruction(&window->insts[i]);
+  }
+}
+
+/**
+ * Follows the register whose `test %reg, %reg` the flags hold through the
+ * instructions of a command, dropping a `test` of that same register.
+ *
+ * `xor %reg, %reg` leaves the flags of testing the zero it writes, and `mov`
+ * and `lea` leave them alone unless they overwrite the register. Anything else
+ * makes them unknown: `add`, `sub`, `inc`, `dec` and `neg` set the overflow
+ * flag `jle` reads from the unwrapped result, so they can't stand in for a
+ * `test` of the register they write, and `imul` and shifts leave it undefined.
+ * @param flagsOf register the flags hold a `test` of, -1 if unknown
+ */
+static void track_flags(InstructionWindow* window, int* flagsOf) {
+  for (int i = 0; i < window->count; i++) {
+    const Instruction* inst = &window->insts[i];
+    const char registerDirect = inst->use_modrm && inst->mod == MOD_REGISTER_DIRECT && !inst->is_64bit;
+
+    if (registerDirect && inst->opcode == OP_TEST_REG_RM && inst->reg == inst->rm && inst->rm == *flagsOf) {
+      for (int j = i; j + 1 < window->count; j++) {
+        window->insts[j] = window->insts[j + 1];
+      }
+      window->count--;
+      i--;
+    } else if (registerDirect && (inst->opcode == OP_TEST_REG_RM || inst->opcode == OP_XOR_REG_TO_RM) &&
+               inst->reg == inst->rm) {
+      *flagsOf = inst->rm;
+    } else if (inst->is_imm_mov) {
+      *flagsOf = inst->imm_mov_rd == *flagsOf ? -1 : *flagsOf;
+    } else if (inst->opcode == OP_MOV_REG_TO_RM && inst->mod == MOD_REGISTER_DIRECT) {
+      *flagsOf = inst->rm == *flagsOf ? -1 : *flagsOf;
+    } else if (inst->opcode == OP_MOV_RM_TO_REG || inst->opcode == OP_LEA) {
+      *flagsOf = inst->reg == *flagsOf ? -1 : *flagsOf;
+    } else {
+      *flagsOf = -1;
+    }
+  }
+}
+
+/**
+ * Drops a `mov %src, %dst` feeding the next instruction when that one can read
+ * `%src` itself, writing `%dst` directly:
+ * - `add %rhs, %dst` becomes `lea (%src,%rhs), %dst`
+ * - `add/sub $imm, %dst` becomes `lea ±imm(%src), %dst`
+ * - `imul $imm, %dst, %dst` becomes `imul $imm, %src, %dst`
+ * - `lea (%dst,%dst,2^n), %dst` becomes `lea (%src,%src,2^n), %dst`
+ */
+static void fold_move(InstructionWindow* window, int i) {
+  const Instruction* mov = &window->insts[i];
+  Instruction* next = &window->insts[i + 1];
+
+  if (mov->opcode != OP_MOV_REG_TO_RM || mov->is_64bit || mov->mod != MOD_REGISTER_DIRECT) return;
+  if (next->is_64bit || !next->use_modrm) return;
+
+  const int src = mov->reg;
+  const int dst = mov->rm;
+
+  if (next->opcode == OP_ADD_REG_TO_RM && next->mod == MOD_REGISTER_DIRECT && next->rm == dst && next->reg != dst) {
+    make_lea(next, dst, src, next->reg, 0, 0);
+  } else if (next->opcode == OP_IMM8_ARITHM_OP || next->opcode == OP_IMM32_ARITHM_OP) {
+    if (next->isCmp || next->rm != dst || (next->reg != EXT_ADD && next->reg != EXT_SUB)) return;
+    // negated as unsigned so the most negative immediate wraps like `sub` does
+    const unsigned imm = (unsigned)next->immediate;
+    make_lea(next, dst, src, -1, 0, (int)(next->reg == EXT_ADD ? imm : 0u - imm));
+  } else if (next->opcode == OP_IMUL_RM_BY_BYTE_STORE_IN_REG || next->opcode == OP_IMUL_RM_BY_INT_STORE_IN_REG) {
+    if (next->reg != dst || next->rm != dst) return;
+    next->rm = src;
+  } else if (next->opcode == OP_LEA && next->use_sib && next->displacement == 0) {
+    if (next->reg != dst || next->base != dst || next->index != dst) return;
+    make_lea(next, dst, src, src, next->scale, 0);
+  } else {
+    return;
+  }
+
+  for (int j = i; j + 1 < window->count; j++) {
+    window->insts[j] = window->insts[j + 1];
+  }
+  window->count--;
+}
+
+/**
+ * Rewrites an instruction as a shorter one doing the same, if there's one:
+ * - `mov $0, %dst` becomes `xor %dst, %dst`
+ * - `add $1, %dst` becomes `inc %dst` and `sub $1, %dst` becomes `dec %dst`
+ *   (and the other way around for `$-1`)
+ * - `cmp $0, %reg` becomes `test %reg, %reg`, setting the same flags for `jle`
+ */
+static void shorten_instruction(Instruction* inst) {
+  Instruction shorter = {0};
+  shorter.use_modrm = 1;
+  shorter.mod = MOD_REGISTER_DIRECT;
+
+  if (inst->is_64bit) return;
+
+  if (inst->is_imm_mov && inst->immediate == 0) {
+    shorter.opcode = OP_XOR_REG_TO_RM;
+    shorter.reg = inst->imm_mov_rd;
+    shorter.rm = inst->imm_mov_rd;
+  } else if (inst->isCmp) {
+    shorter.opcode = OP_TEST_REG_RM;
+    shorter.reg = inst->rm;
+    shorter.rm = inst->rm;
+  } else if (inst->opcode == OP_IMM8_ARITHM_OP && (inst->reg == EXT_ADD || inst->reg == EXT_SUB) &&
+             (inst->immediate == 1 || inst->immediate == -1)) {
+    const char increments = (inst->reg == EXT_ADD) == (inst->immediate == 1);
+    shorter.opcode = OP_INC_RM;
+    shorter.reg = increments ? EXT_INC : EXT_DEC;
+    shorter.rm = inst->rm;
+  } else {
+    return;
+  }
+  *inst = shorter;
+}
+
+/**
+ * Fills `inst` with `lea displacement(%base,%index,2^scale), %dest`, in its
+ * 32-bit form. `index` is -1 when there's none.
+ */
+static void make_lea(Instruction* inst, int dest, int base, int index, int scale, int displacement) {
+  Instruction lea = {0};
+  lea.opcode = OP_LEA;
+  lea.use_modrm = 1;
+  lea.reg = dest;
+
+  // no displacement under `rbp`/`r13` as base would mean RIP-relative, so they get a zero byte
+  if (displacement == 0 && (base & 7) != REG_RBP) {
+    lea.mod = MOD_INDIRECT;
+  } else {
+    lea.mod = displacement >= -128 && displacement <= 127 ? MOD_REG_PLUS_DISP8 : MOD_REG_PLUS_DISP32;
+    lea.use_disp = 1;
+    lea.displacement = displacement;
+  }
+
+  // `rsp`/`r12` as r/m means a SIB byte follows, so they need one too
+  if (index != -1 || (base & 7) == REG_RSP) {
+    lea.rm = REG_RSP;
+    lea.use_sib = 1;
+    lea.scale = scale;
+    lea.index = index != -1 ? index : REG_RSP;
+    lea.base = base;
+  } else {
+    lea.rm = base;
+  }
+  *inst = lea;
+}
+
+/**
+ * Hands out a hardware register to every variable of `ir`, the most used
+ * ones first, so they get the registers that need no REX prefix:
+ * - caller-saved ones first: `rax`, `rcx`, then `rdx`, `rsi` and `rdi`
+ *   when the function never reads their parameter, then `r8`-`r11`
+ * - callee-saved ones only once those run out, as they cost a push and a pop
+ *
+ * Registers aren't shared, so a variable keeps its register for the whole
+ * function and a parameter register stays taken when its parameter is read.
+ * @param regOf receives the register of `vX` at `regOf[X]`, -1 for unused variables
+ * @returns a mask with bit r set for every callee-saved register r handed out
+ */
+static unsigned short allocate_registers(const IrFunction* ir, int regOf[IR_VAR_COUNT + 1]) {
+  static const int preference[] = {REG_RAX, REG_RCX, REG_RDX, REG_RSI, REG_RDI, REG_R8,  REG_R9,
+                                   REG_R10, REG_R11, REG_RBX, REG_R12, REG_R13, REG_R14, REG_R15};
+  const int firstCalleeSaved = 9;  // index of `rbx` in `preference`
+  unsigned uses[IR_VAR_COUNT + 1] = {0};
+  unsigned short taken = 0;  // bit r: register r holds a variable or a parameter still read
+  unsigned short saved = 0;
+
+  for (unsigned b = 0; b < ir->blockCount; b++) {
+    for (unsigned i = ir->blocks[b].first; i < ir->blocks[b].first + ir->blocks[b].count; i++) {
+      const IrOp* op = &ir->ops[i];
+      const Operand* operands[] = {&op->a, &op->b};
+
+      if (op->dest) uses[op->dest]++;
+      for (int o = 0; o < 2; o++) {
+        if (operands[o]->type == 'v') uses[operands[o]->value]++;
+        if (operands[o]->type == 'p') taken |= 1u << get_hardware_reg_index('p', operands[o]->value);
+      }
+    }
+  }
+
+  for (int v = 1; v <= IR_VAR_COUNT; v++) {
+    regOf[v] = -1;
+  }
+  for (int round = 1; round <= IR_VAR_COUNT; round++) {
+    int best = 0;
+    for (int v = 1; v <= IR_VAR_COUNT; v++) {
+      if (regOf[v] == -1 && uses[v] > uses[best]) best = v;
+    }
+    if (best == 0) break;
+
+    int p = 0;
+    while (taken & (1u << preference[p])) p++;
+    regOf[best] = preference[p];
+    taken |= 1u << preference[p];
+    if (p >= firstCalleeSaved) saved |= 1u << preference[p];
+  }
+  return saved;
+}
+
+/**
+ * Whether block `block` of `ir` ends with a jump to a block made of a single
+ * return, cheap enough by `MAX_TAIL_GROWTH` to copy in place of the jump
+ */
+static char duplicates_return(const IrFunction* ir, unsigned block, const int regOf[IR_VAR_COUNT + 1],
+                              unsigned short saved) {
+  const IrBlock* b = &ir->blocks[block];
+  if (b->count == 0 || ir->ops[b->first + b->count - 1].opcode != IR_JMP) return 0;
+
+  const IrBlock* target = &ir->blocks[ir->ops[b->first + b->count - 1].target];
+  if (target->count != 1 || ir->ops[target->first].opcode != IR_RET) return 0;
+
+  Operand value = place_operand(ir->ops[target->first].a, regOf);
+  return tail_growth(&value, saved) <= MAX_TAIL_GROWTH;
+}
+
+/**
+ * Bytes a return grows the code by when copied in place of a `jmp rel8` to it
+ * @param returnSymbol the value it returns, `NULL` when it's moved to the return register either way
+ * @param saved the callee-saved registers it pops, as in `push_saved_registers`
+ */
+static int tail_growth(Operand* returnSymbol, unsigned short saved) {
+  unsigned char scratch[MAX_STATEMENT_SIZE];
+  int size = 0;
+
+  if (returnSymbol) {
+    emit_return_value(scratch, &size, returnSymbol);
+  }
+  pop_saved_registers_and_return(scratch, &size, saved);
+  return size - SHORT_JUMP_SIZE;
+}
+
+/**
+ * Rewrites a variable or a parameter operand into the register holding it,
+ * as a `'r'` operand. Immediates are kept as they are
+ */
+static Operand place_operand(Operand operand, const int regOf[IR_VAR_COUNT + 1]) {
+  if (operand.type == 'v') return (Operand){'r', regOf[operand.value]};
+  if (operand.type == 'p') return (Operand){'r', get_hardware_reg_index('p', operand.value)};
+  return operand;
+}
+
 /**
  * Maps SBas variables and parameters to x86's FULL hardware index (0-15).
  *
  * - Locals ('v'): v1(RBX), v2(R12), v3(R13), v4(R14), v5(R15)
  * - Params ('p'): p1(EDI), p2(ESI), p3(EDX)
+ * - Registers ('r'): already picked by `allocate_registers`
  */
 static int get_hardware_reg_index(char type, int idx) {
+  if (type == 'r') {
+    return idx;
+  }
   if (type == 'v') {
     switch (idx) {
       case 1:
@@ -720,6 +1505,21 @@ static int get_hardware_reg_index(char type, int idx) {
   return -1;
 }
 
+/**
+ * Whether `operand` lives in a register rather than being an immediate
+ */
+static char is_register(const Operand* operand) {
+  return operand->type == 'v' || operand->type == 'p' || operand->type == 'r';
+}
+
+/**
+ * Whether both operands live in the same hardware register
+ */
+static char same_register(const Operand* a, const Operand* b) {
+  return is_register(a) && is_register(b) &&
+         get_hardware_reg_index(a->type, a->value) == get_hardware_reg_index(b->type, b->value);
+}
+
 /**
  * Emits an x86-64 instruction at offset `pos` in buffer `code`.
  * Expects the already filled out `Instruction` struct "form".
@@ -765,7 +1565,17 @@ static void emit_instruction(unsigned char code[], int* pos, Instruction* inst)
 
     // REX.B: Extension for the `r/m` field (destination)
     // used for registers of id 8-15
-    if (inst->use_modrm && inst->rm > 7) {
+    if (inst->use_modrm && !inst->use_sib && inst->rm > 7) {
+      rex |= 0x01;
+      needs_rex = 1;
+    }
+
+    // with a SIB byte, REX.X extends its `index` and REX.B its `base` instead
+    if (inst->use_sib && inst->index > 7) {
+      rex |= 0x02;
+      needs_rex = 1;
+    }
+    if (inst->use_sib && inst->base > 7) {
       rex |= 0x01;
       needs_rex = 1;
     }
@@ -801,8 +1611,15 @@ static void emit_instruction(unsigned char code[], int* pos, Instruction* inst)
     code[(*pos)++] = modrm;
   }
 
+  // scale in bits 7 and 6, then `index`'s 3 bits, then `base`'s
+  if (inst->use_sib) {
+    code[(*pos)++] = (inst->scale << 6) | ((inst->index & 7) << 3) | (inst->base & 7);
+  }
+
   // Memory offsets handling
-  if (inst->use_disp) {
+  if (inst->use_disp && inst->mod == MOD_REG_PLUS_DISP32) {
+    emitIntegerInHex(code, pos, inst->displacement);
+  } else if (inst->use_disp) {
     code[(*pos)++] = inst->displacement & 0xFF;
   }
 
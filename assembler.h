@@ -1,10 +1,14 @@
 #ifndef ASSEMBLER_H
 #define ASSEMBLER_H
 
-#include <stdio.h>
+#include <stddef.h>
 
+#include "ir.h"
 #include "types.h"
 
-char sbasAssemble(unsigned char* code, FILE* f, LineTable* lt, RelocationTable* rt, int* relocCount);
+char sbasAssemble(const char* src, size_t len, const CompileOptions* options, SbasObject* obj, RelocationTable* rt,
+                  int* relocCount);
+char sbasAssembleIr(const IrFunction* ir, SbasObject* obj, RelocationTable* rt, int* relocCount, AlignPoint* points,
+                    int* pointCount);
 
 #endif
\ No newline at end of file
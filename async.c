@@ -0,0 +1,355 @@
+#include "async.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "sbas.h"
+
+#define QUEUE_INITIAL_CAPACITY 64  // jobs each worker queue holds before growing
+
+struct CompileJob {
+  char* src;  // private copy of the source, freed once compiled
+  size_t len;
+  funcp result;
+  _Atomic JobStatus status;
+  atomic_int refs;  // one for the caller's handle, one for the service
+  char orphaned;    // the caller dropped its handle, nobody will take the function
+  pthread_mutex_t lock;
+  pthread_cond_t finished;
+};
+
+/**
+ * A worker's ring buffer of jobs.
+ * The owner takes the oldest job from the head, thieves take the newest from the tail.
+ */
+typedef struct {
+  CompileJob** jobs;
+  int capacity;
+  int head;   // index of the oldest job
+  int count;  // jobs in the queue
+  pthread_mutex_t lock;
+} JobQueue;
+
+typedef struct {
+  CompileService* service;
+  int index;  // this worker's queue
+  pthread_t thread;
+} Worker;
+
+struct CompileService {
+  Worker* workers;
+  JobQueue* queues;
+  int workerCount;
+  int startedCount;  // threads to join
+  atomic_uint nextQueue;  // round-robin cursor for submissions
+  atomic_int pending;     // queued jobs not taken by any worker yet
+  char shuttingDown;
+  pthread_mutex_t idleLock;
+  pthread_cond_t workAvailable;
+};
+
+static void* worker_loop(void* arg);
+static CompileJob* take_job(CompileService* service, int self);
+static void run_job(CompileJob* job);
+static void release_job(CompileJob* job);
+static int queue_push(JobQueue* queue, CompileJob* job);
+static CompileJob* queue_pop_head(JobQueue* queue);
+static CompileJob* queue_pop_tail(JobQueue* queue);
+
+/**
+ * Allocates the worker queues and starts `workers` threads
+ */
+CompileService* sbasServiceCreate(int workers) {
+  if (workers <= 0) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    workers = cpus > 0 ? (int)cpus : 1;
+  }
+
+  CompileService* service = calloc(1, sizeof(CompileService));
+  if (!service) {
+    fprintf(stderr, "sbasServiceCreate: failed to alloc service.\n");
+    return NULL;
+  }
+  service->workers = calloc(workers, sizeof(Worker));
+  service->queues = calloc(workers, sizeof(JobQueue));
+  if (!service->workers || !service->queues) {
+    fprintf(stderr, "sbasServiceCreate: failed to alloc workers.\n");
+    free(service->workers);
+    free(service->queues);
+    free(service);
+    return NULL;
+  }
+
+  pthread_mutex_init(&service->idleLock, NULL);
+  pthread_cond_init(&service->workAvailable, NULL);
+  for (int i = 0; i < workers; i++) {
+    pthread_mutex_init(&service->queues[i].lock, NULL);
+  }
+
+  // workers read the count as soon as they start
+  service->workerCount = workers;
+
+  for (int i = 0; i < workers; i++) {
+    service->workers[i].service = service;
+    service->workers[i].index = i;
+    if (pthread_create(&service->workers[i].thread, NULL, worker_loop, &service->workers[i]) != 0) {
+      fprintf(stderr, "sbasServiceCreate: failed to start worker %d.\n", i);
+      service->startedCount = i;
+      sbasServiceDestroy(service);
+      return NULL;
+    }
+  }
+  service->startedCount = workers;
+
+  return service;
+}
+
+/**
+ * Copies the source into a new job and pushes it to the next worker's queue
+ */
+CompileJob* sbasCompileAsync(CompileService* service, const char* src, size_t len) {
+  CompileJob* job = calloc(1, sizeof(CompileJob));
+  if (!job) {
+    fprintf(stderr, "sbasCompileAsync: failed to alloc job.\n");
+    return NULL;
+  }
+
+  // keep a valid pointer even for empty sources, which fail to compile
+  job->src = malloc(len ? len : 1);
+  if (!job->src) {
+    fprintf(stderr, "sbasCompileAsync: failed to copy source.\n");
+    free(job);
+    return NULL;
+  }
+  memcpy(job->src, src, len);
+  job->len = len;
+
+  atomic_init(&job->status, JOB_PENDING);
+  atomic_init(&job->refs, 2);
+  pthread_mutex_init(&job->lock, NULL);
+  pthread_cond_init(&job->finished, NULL);
+
+  // counted before any worker can take it, or taking it would drive the count below zero
+  atomic_fetch_add(&service->pending, 1);
+
+  unsigned index = atomic_fetch_add(&service->nextQueue, 1) % service->workerCount;
+  if (queue_push(&service->queues[index], job) == -1) {
+    atomic_fetch_sub(&service->pending, 1);
+    pthread_cond_destroy(&job->finished);
+    pthread_mutex_destroy(&job->lock);
+    free(job->src);
+    free(job);
+    return NULL;
+  }
+
+  // signaled under the lock so a worker about to sleep can't miss it
+  pthread_mutex_lock(&service->idleLock);
+  pthread_cond_signal(&service->workAvailable);
+  pthread_mutex_unlock(&service->idleLock);
+
+  return job;
+}
+
+/**
+ * Reads the job's status without taking any lock
+ */
+JobStatus sbasJobPoll(CompileJob* job) { return atomic_load(&job->status); }
+
+/**
+ * Sleeps on the job until a worker finishes it
+ */
+funcp sbasJobWait(CompileJob* job) {
+  pthread_mutex_lock(&job->lock);
+  while (atomic_load(&job->status) == JOB_PENDING) {
+    pthread_cond_wait(&job->finished, &job->lock);
+  }
+  pthread_mutex_unlock(&job->lock);
+
+  return job->result;
+}
+
+/**
+ * Drops the caller's reference to the job
+ */
+void sbasJobRelease(CompileJob* job) {
+  if (!job) return;
+
+  pthread_mutex_lock(&job->lock);
+  job->orphaned = 1;
+  pthread_mutex_unlock(&job->lock);
+
+  release_job(job);
+}
+
+/**
+ * Lets the workers drain their queues, then joins them and frees the service
+ */
+void sbasServiceDestroy(CompileService* service) {
+  if (!service) return;
+
+  pthread_mutex_lock(&service->idleLock);
+  service->shuttingDown = 1;
+  pthread_cond_broadcast(&service->workAvailable);
+  pthread_mutex_unlock(&service->idleLock);
+
+  for (int i = 0; i < service->startedCount; i++) {
+    pthread_join(service->workers[i].thread, NULL);
+  }
+
+  for (int i = 0; i < service->workerCount; i++) {
+    pthread_mutex_destroy(&service->queues[i].lock);
+    free(service->queues[i].jobs);
+  }
+  pthread_mutex_destroy(&service->idleLock);
+  pthread_cond_destroy(&service->workAvailable);
+  free(service->queues);
+  free(service->workers);
+  free(service);
+}
+
+/**
+ * Runs jobs from the worker's own queue, steals when it's empty
+ * and sleeps when no queue has work
+ */
+static void* worker_loop(void* arg) {
+  Worker* worker = arg;
+  CompileService* service = worker->service;
+
+  for (;;) {
+    CompileJob* job = take_job(service, worker->index);
+    if (job) {
+      atomic_fetch_sub(&service->pending, 1);
+      run_job(job);
+      continue;
+    }
+
+    pthread_mutex_lock(&service->idleLock);
+    while (atomic_load(&service->pending) == 0 && !service->shuttingDown) {
+      pthread_cond_wait(&service->workAvailable, &service->idleLock);
+    }
+    const char done = atomic_load(&service->pending) == 0 && service->shuttingDown;
+    pthread_mutex_unlock(&service->idleLock);
+
+    if (done) {
+      return NULL;
+    }
+  }
+}
+
+/**
+ * Takes the oldest job of the worker's queue or, failing that,
+ * the newest job of the first other queue that has one
+ */
+static CompileJob* take_job(CompileService* service, int self) {
+  CompileJob* job = queue_pop_head(&service->queues[self]);
+  if (job) return job;
+
+  for (int i = 1; i < service->workerCount; i++) {
+    job = queue_pop_tail(&service->queues[(self + i) % service->workerCount]);
+    if (job) return job;
+  }
+  return NULL;
+}
+
+/**
+ * Compiles a job's source and wakes up whoever waits on it
+ */
+static void run_job(CompileJob* job) {
+  funcp result = sbasCompileBuffer(job->src, job->len);
+  free(job->src);
+  job->src = NULL;
+
+  pthread_mutex_lock(&job->lock);
+  job->result = result;
+  atomic_store(&job->status, result ? JOB_DONE : JOB_FAILED);
+  pthread_cond_broadcast(&job->finished);
+  const char orphaned = job->orphaned;
+  pthread_mutex_unlock(&job->lock);
+
+  if (orphaned && result) {
+    sbasCleanup(result);
+  }
+  release_job(job);
+}
+
+/**
+ * Drops a reference to a job, freeing it with the last one
+ */
+static void release_job(CompileJob* job) {
+  if (atomic_fetch_sub(&job->refs, 1) != 1) return;
+
+  free(job->src);
+  pthread_mutex_destroy(&job->lock);
+  pthread_cond_destroy(&job->finished);
+  free(job);
+}
+
+/**
+ * Appends a job to the tail of a queue, doubling it when full
+ * @returns 0 on success, -1 on failure
+ */
+static int queue_push(JobQueue* queue, CompileJob* job) {
+  pthread_mutex_lock(&queue->lock);
+
+  if (queue->count == queue->capacity) {
+    int capacity = queue->capacity ? queue->capacity * 2 : QUEUE_INITIAL_CAPACITY;
+    CompileJob** jobs = malloc(capacity * sizeof(CompileJob*));
+    if (!jobs) {
+      pthread_mutex_unlock(&queue->lock);
+      fprintf(stderr, "queue_push: failed to grow job queue.\n");
+      return -1;
+    }
+
+    // unwrap the ring so the oldest job lands at index 0
+    for (int i = 0; i < queue->count; i++) {
+      jobs[i] = queue->jobs[(queue->head + i) % queue->capacity];
+    }
+    free(queue->jobs);
+    queue->jobs = jobs;
+    queue->capacity = capacity;
+    queue->head = 0;
+  }
+
+  queue->jobs[(queue->head + queue->count) % queue->capacity] = job;
+  queue->count++;
+
+  pthread_mutex_unlock(&queue->lock);
+  return 0;
+}
+
+/**
+ * Removes the oldest job of a queue, `NULL` if it's empty
+ */
+static CompileJob* queue_pop_head(JobQueue* queue) {
+  CompileJob* job = NULL;
+
+  pthread_mutex_lock(&queue->lock);
+  if (queue->count > 0) {
+    job = queue->jobs[queue->head];
+    queue->head = (queue->head + 1) % queue->capacity;
+    queue->count--;
+  }
+  pthread_mutex_unlock(&queue->lock);
+
+  return job;
+}
+
+/**
+ * Removes the newest job of a queue, `NULL` if it's empty
+ */
+static CompileJob* queue_pop_tail(JobQueue* queue) {
+  CompileJob* job = NULL;
+
+  pthread_mutex_lock(&queue->lock);
+  if (queue->count > 0) {
+    queue->count--;
+    job = queue->jobs[(queue->head + queue->count) % queue->capacity];
+  }
+  pthread_mutex_unlock(&queue->lock);
+
+  return job;
+}
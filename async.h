@@ -0,0 +1,64 @@
+#ifndef ASYNC_H
+#define ASYNC_H
+#include <stddef.h>
+
+#include "types.h"
+
+/**
+ * A fixed pool of worker threads compiling SBas functions in the background.
+ * Each worker owns a queue of jobs and steals from the others once its own
+ * queue runs dry, so a burst of submissions spreads over the whole pool.
+ */
+typedef struct CompileService CompileService;
+
+/**
+ * A handle to a compilation submitted to a `CompileService`
+ */
+typedef struct CompileJob CompileJob;
+
+typedef enum {
+  JOB_PENDING,  // still queued or being compiled
+  JOB_DONE,     // the function is ready
+  JOB_FAILED,   // the source didn't compile
+} JobStatus;
+
+/**
+ * Starts a compile service
+ * @param workers amount of worker threads, 0 for one per online CPU
+ */
+CompileService* sbasServiceCreate(int workers);
+
+/**
+ * Queues the compilation of a SBas function and returns immediately.
+ * The source is copied, so the caller may reuse `src` right away.
+ * @param service the service compiling the function
+ * @param src SBas source, it doesn't need to be NUL-terminated
+ * @param len amount of bytes in `src`
+ * @returns a handle to poll or wait on, `NULL` on failure
+ */
+CompileJob* sbasCompileAsync(CompileService* service, const char* src, size_t len);
+
+/**
+ * Checks on a job without blocking
+ */
+JobStatus sbasJobPoll(CompileJob* job);
+
+/**
+ * Blocks until a job is over
+ * @returns the compiled function, `NULL` if compilation failed
+ */
+funcp sbasJobWait(CompileJob* job);
+
+/**
+ * Drops the handle of a job. The function it compiled belongs to the caller
+ * and is freed with `sbasCleanup`; if the job is still pending, the function
+ * is freed as soon as it's compiled.
+ */
+void sbasJobRelease(CompileJob* job);
+
+/**
+ * Compiles every job still queued, then stops and joins the workers
+ */
+void sbasServiceDestroy(CompileService* service);
+
+#endif
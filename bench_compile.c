@@ -0,0 +1,169 @@
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "passes.h"
+#include "sbas.h"
+#include "timing.h"
+#include "utils.h"
+
+#define TEST_FILES_DIR "test_files"
+#define DEFAULT_ITERATIONS 2000  // compilations per file
+#define MAX_FILES 128
+
+static const char* PHASE_NAMES[PHASE_COUNT] = {"read", "tables", "optimize", "assemble", "link", "alloc", "protect"};
+
+/**
+ * Latency samples of one measurement, in nanoseconds
+ */
+typedef struct {
+  long long* ns;
+  int count;
+} Samples;
+
+static int compare_ns(const void* a, const void* b) {
+  long long x = *(const long long*)a;
+  long long y = *(const long long*)b;
+  return (x > y) - (x < y);
+}
+
+static int compare_names(const void* a, const void* b) { return strcmp(*(char* const*)a, *(char* const*)b); }
+
+/**
+ * Sorts the samples and prints their p50, p99 and max
+ */
+static void print_percentiles(const char* name, Samples* samples) {
+  qsort(samples->ns, samples->count, sizeof(long long), compare_ns);
+  long long p50 = samples->ns[samples->count / 2];
+  long long p99 = samples->ns[(int)(samples->count * 0.99)];
+  long long max = samples->ns[samples->count - 1];
+  printf("%-28s %10lld %10lld %10lld", name, p50, p99, max);
+}
+
+/**
+ * Lists the `.sbas` files of the test directory, sorted by name
+ * @returns the amount of files found
+ */
+static int list_files(char* files[], int capacity) {
+  DIR* dir = opendir(TEST_FILES_DIR);
+  if (!dir) {
+    fprintf(stderr, "bench_compile: failed to open %s.\n", TEST_FILES_DIR);
+    return 0;
+  }
+
+  int count = 0;
+  struct dirent* entry;
+  while ((entry = readdir(dir)) && count < capacity) {
+    size_t len = strlen(entry->d_name);
+    if (len > 5 && strcmp(entry->d_name + len - 5, ".sbas") == 0) {
+      files[count++] = strdup(entry->d_name);
+    }
+  }
+  closedir(dir);
+
+  qsort(files, count, sizeof(char*), compare_names);
+  return count;
+}
+
+/**
+ * Same as `sbasCompile`, at the optimization level in `options`
+ */
+static funcp compile_file(FILE* f, const CompileOptions* options) {
+  size_t len = 0;
+  char* src = NULL;
+
+  PHASE_TIME(PHASE_READ, {
+    rewind(f);
+    src = readSource(f, &len);
+  });
+  if (!src) {
+    return NULL;
+  }
+
+  funcp function = sbasCompileWithOptions(src, len, options);
+  free(src);
+  return function;
+}
+
+/**
+ * Compiles every valid file of test_files many times, timing each phase of
+ * `sbasCompile`, and reports the latency distribution of every file and phase
+ */
+int main(int argc, char* argv[]) {
+  int iterations = argc > 1 ? atoi(argv[1]) : DEFAULT_ITERATIONS;
+  CompileOptions options = {.instrument = 0, .optLevel = argc > 2 ? atoi(argv[2]) : 0};
+  char* files[MAX_FILES];
+  char path[512];
+
+  if (iterations <= 0 || options.optLevel < 0 || options.optLevel > OPT_MAX_LEVEL) {
+    fprintf(stderr, "usage: %s [iterations] [optimization level]\n", argv[0]);
+    return 1;
+  }
+
+  int fileCount = list_files(files, MAX_FILES);
+  if (fileCount == 0) return 1;
+
+  Samples phases[PHASE_COUNT];
+  for (int p = 0; p < PHASE_COUNT; p++) {
+    phases[p].ns = malloc((size_t)fileCount * iterations * sizeof(long long));
+    phases[p].count = 0;
+  }
+  Samples total = {malloc(iterations * sizeof(long long)), 0};
+
+  long long allCompilesNs = 0;
+  int allCompiles = 0;
+
+  printf("%d compilations per file at -O%d\n\n", iterations, options.optLevel);
+  printf("%-28s %10s %10s %10s %12s\n", "file (total ns)", "p50", "p99", "max", "compiles/s");
+
+  for (int i = 0; i < fileCount; i++) {
+    snprintf(path, sizeof(path), "%s/%s", TEST_FILES_DIR, files[i]);
+    FILE* f = fopen(path, "r");
+    if (!f) {
+      fprintf(stderr, "bench_compile: failed to open %s.\n", path);
+      return 1;
+    }
+
+    long long fileNs = 0;
+    total.count = 0;
+    for (int it = 0; it < iterations; it++) {
+      memset(sbasPhaseNs, 0, sizeof(sbasPhaseNs));
+
+      long long start = phaseClockNs();
+      funcp function = compile_file(f, &options);
+      long long elapsed = phaseClockNs() - start;
+
+      if (!function) {
+        fprintf(stderr, "bench_compile: failed to compile %s.\n", path);
+        return 1;
+      }
+      sbasCleanup(function);
+
+      total.ns[total.count++] = elapsed;
+      fileNs += elapsed;
+      for (int p = 0; p < PHASE_COUNT; p++) {
+        phases[p].ns[phases[p].count++] = sbasPhaseNs[p];
+      }
+    }
+    fclose(f);
+
+    print_percentiles(files[i], &total);
+    printf(" %12.0f\n", iterations * 1e9 / fileNs);
+
+    allCompilesNs += fileNs;
+    allCompiles += iterations;
+    free(files[i]);
+  }
+
+  printf("\n%-28s %10s %10s %10s\n", "phase (ns, all files)", "p50", "p99", "max");
+  for (int p = 0; p < PHASE_COUNT; p++) {
+    print_percentiles(PHASE_NAMES[p], &phases[p]);
+    printf("\n");
+    free(phases[p].ns);
+  }
+  free(total.ns);
+
+  printf("\n%d compilations, %.0f compiles/s\n", allCompiles, allCompiles * 1e9 / allCompilesNs);
+  return 0;
+}
@@ -0,0 +1,208 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "passes.h"
+#include "sbas.h"
+#include "utils.h"
+
+#define TEST_FILES_DIR "test_files"
+#define PARAM_SETS 1024         // random parameter sets cycled through, power of two
+#define DEFAULT_CALLS 2000000  // timed calls per program and implementation
+
+typedef int (*ReferenceFunc)(int p1, int p2, int p3);
+
+/**
+ * Hand-written C versions of the programs in test_files.
+ * Built with -fwrapv so overflow wraps around like the 32-bit SBas arithmetic.
+ */
+__attribute__((noinline)) static int add_one_to_arg(int p1, int p2, int p3) { return p1 + 1; }
+__attribute__((noinline)) static int all_arithmetic_cases(int p1, int p2, int p3) { return -746; }
+__attribute__((noinline)) static int arithmetic_operation(int p1, int p2, int p3) { return 280 * p1 * p1; }
+__attribute__((noinline)) static int assign_constant(int p1, int p2, int p3) { return -1004; }
+__attribute__((noinline)) static int assign_parameters(int p1, int p2, int p3) { return p1; }
+__attribute__((noinline)) static int assign_variables(int p1, int p2, int p3) { return 1; }
+__attribute__((noinline)) static int chained_ifs(int p1, int p2, int p3) { return p1 == 1 ? 99 : 42; }
+__attribute__((noinline)) static int dead_code(int p1, int p2, int p3) { return -775; }
+__attribute__((noinline)) static int difference_of_squares(int p1, int p2, int p3) { return (p1 + p2) * (p1 - p2); }
+__attribute__((noinline)) static int factorial(int p1, int p2, int p3) {
+  int result = 1;
+  for (; p1 > 0; p1--) result *= p1;
+  return result;
+}
+__attribute__((noinline)) static int is_negative(int p1, int p2, int p3) { return p1 + 1 <= 0; }
+__attribute__((noinline)) static int multiple_branches(int p1, int p2, int p3) { return p1 <= 0 ? 2 : p1 == 1 ? 3 : 1; }
+__attribute__((noinline)) static int multiplication(int p1, int p2, int p3) { return -100 * (p1 * p2); }
+__attribute__((noinline)) static int multiply_param_by_10(int p1, int p2, int p3) { return 10 * p1; }
+__attribute__((noinline)) static int return_constant(int p1, int p2, int p3) { return 16909060; }
+__attribute__((noinline)) static int return_param(int p1, int p2, int p3) { return p1; }
+__attribute__((noinline)) static int return_variable(int p1, int p2, int p3) { return 5; }
+__attribute__((noinline)) static int subtraction_1(int p1, int p2, int p3) { return 0; }
+__attribute__((noinline)) static int subtraction_2(int p1, int p2, int p3) { return 0; }
+__attribute__((noinline)) static int three_arguments(int p1, int p2, int p3) { return p1 - p2 <= 0 ? -444 : 256 * p1; }
+__attribute__((noinline)) static int two_arguments(int p1, int p2, int p3) {
+  if (-p1 <= 0) return 4096 * 16820;
+  if (-p2 <= 0) return p1;
+  return p2 * 125;
+}
+__attribute__((noinline)) static int whole_valid_grammar(int p1, int p2, int p3) { return p1; }
+
+/**
+ * A program of test_files, its C version and the range its parameters are drawn from
+ */
+typedef struct {
+  const char* file;
+  ReferenceFunc reference;
+  int min;
+  int max;
+} Program;
+
+static Program PROGRAMS[] = {
+    {"add_one_to_arg.sbas", add_one_to_arg, -1000, 1000},
+    {"all_arithmetic_cases.sbas", all_arithmetic_cases, -1000, 1000},
+    {"arithmetic_operation.sbas", arithmetic_operation, -1000, 1000},
+    {"assign_constant.sbas", assign_constant, -1000, 1000},
+    {"assign_parameters.sbas", assign_parameters, -1000, 1000},
+    {"assign_variables.sbas", assign_variables, -1000, 1000},
+    {"chained_ifs.sbas", chained_ifs, -2, 3},
+    {"dead_code.sbas", dead_code, -1000, 1000},
+    {"difference_of_squares.sbas", difference_of_squares, -1000, 1000},
+    {"factorial.sbas", factorial, -2, 12},  // loops p1 times
+    {"is_negative.sbas", is_negative, -1000, 1000},
+    {"multiple_branches.sbas", multiple_branches, -2, 3},
+    {"multiplication.sbas", multiplication, -1000, 1000},
+    {"multiply_param_by_10.sbas", multiply_param_by_10, -1000, 1000},
+    {"return_constant.sbas", return_constant, -1000, 1000},
+    {"return_param.sbas", return_param, -1000, 1000},
+    {"return_variable.sbas", return_variable, -1000, 1000},
+    {"subtraction_1.sbas", subtraction_1, -1000, 1000},
+    {"subtraction_2.sbas", subtraction_2, -1000, 1000},
+    {"three_arguments.sbas", three_arguments, -1000, 1000},
+    {"two_arguments.sbas", two_arguments, -1000, 1000},
+    {"whole_valid_grammar.sbas", whole_valid_grammar, 1, 1000},  // loops forever when p3 <= 0
+};
+
+static int params[PARAM_SETS][3];
+static volatile int sink;  // keeps results alive so no call is optimized out
+
+static long long now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/**
+ * xorshift32, seeded so every run draws the same parameters
+ */
+static unsigned next_random(unsigned* state) {
+  *state ^= *state << 13;
+  *state ^= *state >> 17;
+  *state ^= *state << 5;
+  return *state;
+}
+
+/**
+ * Calls `function` `calls` times, cycling through the parameter sets
+ * @returns elapsed nanoseconds
+ */
+static long long time_calls(ReferenceFunc function, int calls) {
+  // read through a volatile so the compiler can't see which function runs
+  ReferenceFunc volatile target = function;
+  ReferenceFunc call = target;
+  int sum = 0;
+
+  long long start = now_ns();
+  for (int i = 0; i < calls; i++) {
+    const int* p = params[i & (PARAM_SETS - 1)];
+    sum += call(p[0], p[1], p[2]);
+  }
+  long long elapsed = now_ns() - start;
+
+  sink = sum;
+  return elapsed;
+}
+
+/**
+ * Runs every program of test_files on random parameters, checks it agrees
+ * with its C version and compares their call throughput
+ */
+int main(int argc, char* argv[]) {
+  int calls = argc > 1 ? atoi(argv[1]) : DEFAULT_CALLS;
+  double maxSlowdown = argc > 2 ? atof(argv[2]) : 0;  // fail above this overall slowdown, 0 to never fail
+  CompileOptions options = {.instrument = 0, .optLevel = argc > 3 ? atoi(argv[3]) : 0};
+  int programCount = sizeof(PROGRAMS) / sizeof(PROGRAMS[0]);
+  char path[512];
+  int mismatches = 0;
+  double sbasTotalNs = 0, nativeTotalNs = 0;
+
+  if (calls <= 0 || options.optLevel < 0 || options.optLevel > OPT_MAX_LEVEL) {
+    fprintf(stderr, "usage: %s [calls] [max slowdown] [optimization level]\n", argv[0]);
+    return 1;
+  }
+
+  printf("%d calls per program over %d random parameter sets at -O%d\n\n", calls, PARAM_SETS, options.optLevel);
+  printf("%-28s %12s %10s %12s %10s %8s\n", "program", "SBas call/s", "ns/call", "gcc call/s", "ns/call", "slower");
+
+  for (int i = 0; i < programCount; i++) {
+    Program* program = &PROGRAMS[i];
+    unsigned state = 0x5BA5u + i;
+    for (int j = 0; j < PARAM_SETS; j++) {
+      for (int k = 0; k < 3; k++) {
+        params[j][k] = program->min + (int)(next_random(&state) % (unsigned)(program->max - program->min + 1));
+      }
+    }
+
+    snprintf(path, sizeof(path), "%s/%s", TEST_FILES_DIR, program->file);
+    FILE* f = fopen(path, "r");
+    if (!f) {
+      fprintf(stderr, "bench_exec: failed to open %s.\n", path);
+      return 1;
+    }
+    size_t len = 0;
+    char* src = readSource(f, &len);
+    fclose(f);
+    funcp function = src ? sbasCompileWithOptions(src, len, &options) : NULL;
+    free(src);
+    if (!function) {
+      fprintf(stderr, "bench_exec: failed to compile %s.\n", path);
+      return 1;
+    }
+    ReferenceFunc sbas = (ReferenceFunc)function;
+
+    for (int j = 0; j < PARAM_SETS; j++) {
+      int expected = program->reference(params[j][0], params[j][1], params[j][2]);
+      int actual = sbas(params[j][0], params[j][1], params[j][2]);
+      if (actual != expected) {
+        fprintf(stderr, "bench_exec: %s(%d, %d, %d) returned %d, expected %d\n", program->file, params[j][0],
+                params[j][1], params[j][2], actual, expected);
+        mismatches++;
+        break;
+      }
+    }
+
+    // warm both up before timing
+    time_calls(sbas, calls / 10);
+    time_calls(program->reference, calls / 10);
+    double sbasNs = (double)time_calls(sbas, calls) / calls;
+    double nativeNs = (double)time_calls(program->reference, calls) / calls;
+    sbasTotalNs += sbasNs;
+    nativeTotalNs += nativeNs;
+
+    printf("%-28s %12.0f %10.2f %12.0f %10.2f %7.2fx\n", program->file, 1e9 / sbasNs, sbasNs, 1e9 / nativeNs, nativeNs,
+           sbasNs / nativeNs);
+    sbasCleanup(function);
+  }
+
+  double slowdown = sbasTotalNs / nativeTotalNs;
+  printf("\nSBas is %.2fx slower than gcc -O2 over all programs\n", slowdown);
+  if (mismatches) {
+    fprintf(stderr, "bench_exec: %d programs disagree with their C version!\n", mismatches);
+    return 1;
+  }
+  if (maxSlowdown > 0 && slowdown > maxSlowdown) {
+    fprintf(stderr, "bench_exec: slower than the allowed %.2fx!\n", maxSlowdown);
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,90 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "sbas.h"
+
+#define RUNS 5                  // compilations per size, the fastest one is kept
+#define MAX_SLOWDOWN_PER_LINE 3.0  // largest tolerated ns/line ratio between the biggest and smallest program
+
+/**
+ * Writes a SBas program of `lines` commands mixing every kind of command,
+ * jumps included, and returns its length
+ */
+static size_t generate_program(char* src, int lines) {
+  static const char* body[] = {
+      "v1: p1\n", "v2 = v1 + $3\n", "v3 = v2 * $-7\n", "v1 = v3 - v2\n", "v4: $1000\n", "v5 = v4 * v1\n",
+  };
+  size_t len = 0;
+
+  for (int line = 1; line < lines; line++) {
+    if (line % 7 == 0) {
+      // a forward jump a few lines ahead, like a short `if`
+      int target = line + 3 < lines ? line + 3 : lines;
+      len += sprintf(src + len, "iflez v1 %d\n", target);
+    } else {
+      len += sprintf(src + len, "%s", body[line % 6]);
+    }
+  }
+  len += sprintf(src + len, "ret v5\n");
+  return len;
+}
+
+static long long now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/**
+ * Compiles programs from a thousand to a million lines and checks that
+ * the compile time and the memory held per line stay flat
+ */
+int main(void) {
+  const int sizes[] = {1000, 10000, 100000, 1000000};
+  const int sizeCount = sizeof(sizes) / sizeof(sizes[0]);
+  double nsPerLine[sizeof(sizes) / sizeof(sizes[0])];
+
+  printf("%10s %14s %10s %14s %14s\n", "lines", "best (us)", "ns/line", "code B/line", "tables B/line");
+
+  for (int i = 0; i < sizeCount; i++) {
+    const int lines = sizes[i];
+    char* src = malloc((size_t)lines * 32);
+    if (!src) {
+      fprintf(stderr, "bench_scaling: failed to alloc source.\n");
+      return 1;
+    }
+    size_t len = generate_program(src, lines);
+
+    long long best = -1;
+    SbasObject obj;
+    for (int run = 0; run < RUNS; run++) {
+      long long start = now_ns();
+      if (sbasTranslate(src, len, &obj) == -1) {
+        fprintf(stderr, "bench_scaling: failed to compile %d lines.\n", lines);
+        free(src);
+        return 1;
+      }
+      long long elapsed = now_ns() - start;
+      if (best == -1 || elapsed < best) best = elapsed;
+      if (run < RUNS - 1) sbasFreeObject(&obj);
+    }
+
+    // the relocation table, freed after linking, has as many entries as the line table
+    double tableBytes = (double)(lines + 1) * (sizeof(LineTable) + sizeof(RelocationTable)) / lines;
+    nsPerLine[i] = (double)best / lines;
+    printf("%10d %14.1f %10.1f %14.1f %14.1f\n", lines, best / 1000.0, nsPerLine[i], (double)obj.size / lines, tableBytes);
+
+    sbasFreeObject(&obj);
+    free(src);
+  }
+
+  double slowdown = nsPerLine[sizeCount - 1] / nsPerLine[0];
+  printf("ns/line grew %.2fx from %d to %d lines\n", slowdown, sizes[0], sizes[sizeCount - 1]);
+  if (slowdown > MAX_SLOWDOWN_PER_LINE) {
+    fprintf(stderr, "bench_scaling: compile time grows faster than the program size!\n");
+    return 1;
+  }
+  return 0;
+}
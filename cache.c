@@ -0,0 +1,444 @@
+#include "cache.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "perf.h"
+#include "utils.h"
+
+#define CACHE_INITIAL_BUCKETS 1024  // doubled whenever entries outnumber them
+
+/**
+ * A compiled function shared by every compilation of the same normalized source
+ */
+struct CacheEntry {
+  unsigned long long hash;
+  char* key;  // normalized source
+  size_t keyLen;
+  char options;  // `optionsKey` of the compilation, the same source compiled otherwise is another function
+  funcp function;
+  int size;            // bytes of machine code at `function`
+  LineTable* lt;       // line table of `function`, to describe it to perf and the profiler on later hits
+  unsigned lines;      // entries in `lt`
+  unsigned described;  // `perfGeneration` the function was last described in
+  size_t bytes;   // memory accounted to this entry
+  int refs;       // compilations that returned `function` and weren't cleaned up yet
+  char detached;  // not reachable through the table: freed by its last release
+  struct CacheEntry* next;  // next entry of the same bucket
+  struct CacheEntry* lruPrev;
+  struct CacheEntry* lruNext;
+};
+
+/**
+ * The process-wide cache. Entries nobody references are also linked in
+ * least recently used order, ready to be evicted.
+ */
+static struct {
+  pthread_mutex_t lock;
+  atomic_char enabled;
+  struct CacheEntry** buckets;
+  unsigned bucketCount;
+  struct CacheEntry* lruHead;  // least recently used
+  struct CacheEntry* lruTail;  // most recently used
+  CacheStats stats;
+} cache = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+static char* normalize(const char* src, size_t len, size_t* keyLen);
+static char is_punctuation(char c);
+static struct CacheEntry* find_entry(unsigned long long hash, const char* key, size_t keyLen, char options);
+static void insert_entry(struct CacheEntry* entry);
+static void remove_entry(struct CacheEntry* entry);
+static void lru_append(struct CacheEntry* entry);
+static void lru_remove(struct CacheEntry* entry);
+static void evict_over_bound(void);
+static void free_entry(struct CacheEntry* entry);
+
+/**
+ * Turns caching on, evicting right away if `maxBytes` is below the current usage
+ */
+void sbasCacheEnable(size_t maxBytes) {
+  pthread_mutex_lock(&cache.lock);
+
+  if (!cache.buckets) {
+    cache.buckets = calloc(CACHE_INITIAL_BUCKETS, sizeof(struct CacheEntry*));
+    if (!cache.buckets) {
+      fprintf(stderr, "sbasCacheEnable: failed to alloc cache table.\n");
+      pthread_mutex_unlock(&cache.lock);
+      return;
+    }
+    cache.bucketCount = CACHE_INITIAL_BUCKETS;
+  }
+
+  cache.stats.maxBytes = maxBytes;
+  atomic_store(&cache.enabled, 1);
+  evict_over_bound();
+
+  pthread_mutex_unlock(&cache.lock);
+}
+
+/**
+ * Empties the table: unreferenced entries go right away,
+ * referenced ones are detached until their last release
+ */
+void sbasCacheDisable(void) {
+  pthread_mutex_lock(&cache.lock);
+
+  atomic_store(&cache.enabled, 0);
+  for (unsigned i = 0; i < cache.bucketCount; i++) {
+    struct CacheEntry* entry = cache.buckets[i];
+    while (entry) {
+      struct CacheEntry* next = entry->next;
+      if (entry->refs == 0) {
+        free_entry(entry);
+      } else {
+        entry->detached = 1;
+      }
+      entry = next;
+    }
+  }
+
+  free(cache.buckets);
+  cache.buckets = NULL;
+  cache.bucketCount = 0;
+  cache.lruHead = NULL;
+  cache.lruTail = NULL;
+  cache.stats.entries = 0;
+  cache.stats.bytes = 0;
+
+  pthread_mutex_unlock(&cache.lock);
+}
+
+/**
+ * Takes a consistent snapshot of the counters
+ */
+void sbasCacheStats(CacheStats* stats) {
+  pthread_mutex_lock(&cache.lock);
+  *stats = cache.stats;
+  pthread_mutex_unlock(&cache.lock);
+}
+
+/**
+ * Looks the source up in the cache.
+ *
+ * @param src SBas source, it doesn't need to be NUL-terminated
+ * @param len amount of bytes in `src`
+ * @param options `optionsKey` of the options the function is compiled with
+ * @param pending on a miss, receives the entry to hand to `cachePublish`
+ * once the function is compiled (or to `cacheAbandon` if it isn't).
+ * Stays `NULL` when caching is off.
+ *
+ * @returns the cached function with a new reference taken, `NULL` on a miss
+ */
+funcp cacheAcquire(const char* src, size_t len, char options, struct CacheEntry** pending) {
+  *pending = NULL;
+  if (!atomic_load(&cache.enabled)) {
+    return NULL;
+  }
+
+  size_t keyLen = 0;
+  char* key = normalize(src, len, &keyLen);
+  if (!key) {
+    return NULL;
+  }
+  unsigned long long hash = hashBytes(key, keyLen) + options;
+
+  pthread_mutex_lock(&cache.lock);
+  if (!atomic_load(&cache.enabled)) {
+    pthread_mutex_unlock(&cache.lock);
+    free(key);
+    return NULL;
+  }
+
+  struct CacheEntry* entry = find_entry(hash, key, keyLen, options);
+  if (entry) {
+    if (entry->refs == 0) {
+      lru_remove(entry);
+    }
+    entry->refs++;
+    cache.stats.hits++;
+    funcp sbasFunc = entry->function;
+
+    // perf files opened or a profiler started since it was compiled don't know the function yet
+    const unsigned generation = perfGeneration();
+    const char describe = perfEnabled() && entry->described != generation;
+    entry->described = generation;
+    pthread_mutex_unlock(&cache.lock);
+
+    // the reference taken keeps the entry alive, and normalizing keeps line numbers
+    if (describe) {
+      perfRecordCode(sbasFunc, entry->size, entry->lt, entry->lines, src, len);
+    }
+    free(key);
+    return sbasFunc;
+  }
+  cache.stats.misses++;
+  pthread_mutex_unlock(&cache.lock);
+
+  entry = calloc(1, sizeof(struct CacheEntry));
+  if (!entry) {
+    fprintf(stderr, "cacheAcquire: failed to alloc cache entry.\n");
+    free(key);
+    return NULL;
+  }
+  entry->hash = hash;
+  entry->key = key;
+  entry->keyLen = keyLen;
+  entry->options = options;
+  *pending = entry;
+  return NULL;
+}
+
+/**
+ * Adds a freshly compiled function to the cache, referenced once by its compiler.
+ * If caching was turned off or another thread cached the same source
+ * meanwhile, the function just stays out of the table.
+ * @param obj the object `sbasFunc` was mapped from, whose line table is copied
+ * @param described `perfGeneration` the function was described to perf and the profiler in
+ */
+void cachePublish(struct CacheEntry* entry, funcp sbasFunc, const SbasObject* obj, unsigned described) {
+  CodeHeader* header = (CodeHeader*)((unsigned char*)sbasFunc - CODE_HEADER_SIZE);
+
+  // without its line table, the function is still described by name
+  entry->lt = malloc(obj->lines * sizeof(LineTable));
+  if (entry->lt) {
+    memcpy(entry->lt, obj->lt, obj->lines * sizeof(LineTable));
+    entry->lines = obj->lines;
+  }
+
+  entry->function = sbasFunc;
+  entry->size = obj->size;
+  entry->described = described;
+  entry->bytes = sizeof(struct CacheEntry) + entry->keyLen + entry->lines * sizeof(LineTable) + header->mapSize;
+  entry->refs = 1;
+
+  pthread_mutex_lock(&cache.lock);
+  if (!atomic_load(&cache.enabled) || find_entry(entry->hash, entry->key, entry->keyLen, entry->options)) {
+    entry->detached = 1;
+  } else {
+    insert_entry(entry);
+    evict_over_bound();
+  }
+  pthread_mutex_unlock(&cache.lock);
+}
+
+/**
+ * Frees an entry returned by `cacheAcquire` whose source failed to compile
+ */
+void cacheAbandon(struct CacheEntry* entry) {
+  if (!entry) return;
+  free(entry->key);
+  free(entry);
+}
+
+/**
+ * Drops a reference to a cached function. Once unreferenced it becomes
+ * the most recently used eviction candidate.
+ */
+void cacheRelease(struct CacheEntry* entry) {
+  pthread_mutex_lock(&cache.lock);
+
+  entry->refs--;
+  if (entry->refs == 0) {
+    if (entry->detached) {
+      free_entry(entry);
+    } else {
+      lru_append(entry);
+      evict_over_bound();
+    }
+  }
+
+  pthread_mutex_unlock(&cache.lock);
+}
+
+/**
+ * Copies `src` dropping what the lexer ignores: leading spaces, comment lines,
+ * whitespace that doesn't separate tokens and trailing empty lines.
+ * Every line keeps its newline so `iflez` targets still point to the same command.
+ * @returns the normalized copy, `NULL` on failure
+ */
+static char* normalize(const char* src, size_t len, size_t* keyLen) {
+  const char* p = src;
+  const char* end = src + len;
+  size_t n = 0;
+
+  char* key = malloc(len + 1);
+  if (!key) {
+    fprintf(stderr, "normalize: failed to alloc cache key.\n");
+    return NULL;
+  }
+
+  while (p < end) {
+    while (p < end && *p == ' ') {
+      p++;
+    }
+
+    const char* lineEnd = memchr(p, '\n', end - p);
+    if (!lineEnd) {
+      lineEnd = end;
+    }
+
+    if (p < lineEnd && *p != '/' && *p != '\0') {
+      // whatever the line starts with decides the command, even whitespace
+      key[n++] = *p++;
+
+      char pendingBlank = 0;
+      for (; p < lineEnd; p++) {
+        if (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\v' || *p == '\f') {
+          pendingBlank = 1;
+          continue;
+        }
+        // the lexer skips whitespace around separators, operators and
+        // immediates, but elsewhere it splits tokens (`v1 2` vs `v12`)
+        if (pendingBlank && !is_punctuation(key[n - 1]) && !is_punctuation(*p)) {
+          key[n++] = ' ';
+        }
+        pendingBlank = 0;
+        key[n++] = *p;
+      }
+    }
+
+    p = lineEnd;
+    if (p < end) {
+      key[n++] = '\n';
+      p++;
+    }
+  }
+
+  while (n > 0 && key[n - 1] == '\n') {
+    n--;
+  }
+
+  *keyLen = n;
+  return key;
+}
+
+/**
+ * Whether `c` is a character the lexer reads after skipping whitespace
+ * and that never belongs to a longer token
+ */
+static char is_punctuation(char c) { return c == ':' || c == '=' || c == '$' || c == '*'; }
+
+/**
+ * Finds the entry of a normalized source compiled with `options`, `NULL` if it isn't cached
+ */
+static struct CacheEntry* find_entry(unsigned long long hash, const char* key, size_t keyLen, char options) {
+  if (!cache.buckets) return NULL;
+
+  struct CacheEntry* entry = cache.buckets[hash & (cache.bucketCount - 1)];
+  for (; entry; entry = entry->next) {
+    if (entry->hash == hash && entry->keyLen == keyLen && entry->options == options &&
+        memcmp(entry->key, key, keyLen) == 0) {
+      return entry;
+    }
+  }
+  return NULL;
+}
+
+/**
+ * Links an entry to its bucket, doubling the table when it gets crowded
+ */
+static void insert_entry(struct CacheEntry* entry) {
+  if (cache.stats.entries >= cache.bucketCount) {
+    unsigned bucketCount = cache.bucketCount * 2;
+    struct CacheEntry** buckets = calloc(bucketCount, sizeof(struct CacheEntry*));
+
+    // a crowded table is still correct, just slower
+    if (buckets) {
+      for (unsigned i = 0; i < cache.bucketCount; i++) {
+        struct CacheEntry* moved = cache.buckets[i];
+        while (moved) {
+          struct CacheEntry* next = moved->next;
+          moved->next = buckets[moved->hash & (bucketCount - 1)];
+          buckets[moved->hash & (bucketCount - 1)] = moved;
+          moved = next;
+        }
+      }
+      free(cache.buckets);
+      cache.buckets = buckets;
+      cache.bucketCount = bucketCount;
+    }
+  }
+
+  struct CacheEntry** bucket = &cache.buckets[entry->hash & (cache.bucketCount - 1)];
+  entry->next = *bucket;
+  *bucket = entry;
+
+  cache.stats.entries++;
+  cache.stats.bytes += entry->bytes;
+}
+
+/**
+ * Unlinks an entry from its bucket
+ */
+static void remove_entry(struct CacheEntry* entry) {
+  struct CacheEntry** link = &cache.buckets[entry->hash & (cache.bucketCount - 1)];
+  while (*link != entry) {
+    link = &(*link)->next;
+  }
+  *link = entry->next;
+
+  cache.stats.entries--;
+  cache.stats.bytes -= entry->bytes;
+}
+
+/**
+ * Makes an unreferenced entry the most recently used one
+ */
+static void lru_append(struct CacheEntry* entry) {
+  entry->lruPrev = cache.lruTail;
+  entry->lruNext = NULL;
+  if (cache.lruTail) {
+    cache.lruTail->lruNext = entry;
+  } else {
+    cache.lruHead = entry;
+  }
+  cache.lruTail = entry;
+}
+
+/**
+ * Takes an entry out of the eviction order
+ */
+static void lru_remove(struct CacheEntry* entry) {
+  if (entry->lruPrev) {
+    entry->lruPrev->lruNext = entry->lruNext;
+  } else {
+    cache.lruHead = entry->lruNext;
+  }
+  if (entry->lruNext) {
+    entry->lruNext->lruPrev = entry->lruPrev;
+  } else {
+    cache.lruTail = entry->lruPrev;
+  }
+  entry->lruPrev = NULL;
+  entry->lruNext = NULL;
+}
+
+/**
+ * Evicts unreferenced entries, least recently used first, until the cache
+ * fits its bound. Referenced entries are never evicted, so the bound may
+ * be exceeded while they're in use.
+ */
+static void evict_over_bound(void) {
+  while (cache.stats.bytes > cache.stats.maxBytes && cache.lruHead) {
+    struct CacheEntry* victim = cache.lruHead;
+    lru_remove(victim);
+    remove_entry(victim);
+    cache.stats.evictions++;
+    free_entry(victim);
+  }
+}
+
+/**
+ * Unmaps an entry's function and frees the entry
+ */
+static void free_entry(struct CacheEntry* entry) {
+  CodeHeader* header = (CodeHeader*)((unsigned char*)entry->function - CODE_HEADER_SIZE);
+  munmap(header, header->mapSize);
+  free(entry->key);
+  free(entry->lt);
+  free(entry);
+}
@@ -0,0 +1,55 @@
+#ifndef CACHE_H
+#define CACHE_H
+#include <stddef.h>
+
+#include "types.h"
+
+/**
+ * Counters of the compile cache
+ *
+ * Fields:
+ * - `hits`: compilations answered with an already compiled function
+ * - `misses`: compilations that had to translate their source
+ * - `evictions`: unreferenced functions dropped to stay under `maxBytes`
+ * - `entries`: functions currently cached
+ * - `bytes`: memory held by the cached functions and their keys
+ * - `maxBytes`: bound set with `sbasCacheEnable`
+ */
+typedef struct {
+  unsigned long hits;
+  unsigned long misses;
+  unsigned long evictions;
+  unsigned long entries;
+  size_t bytes;
+  size_t maxBytes;
+} CacheStats;
+
+/**
+ * Makes `sbasCompile` and `sbasCompileBuffer` share functions whose sources
+ * only differ in spacing and comments.
+ *
+ * Cached functions are reference counted: every compilation returning one
+ * takes a reference and every `sbasCleanup` drops it. Functions nobody
+ * references are kept around and evicted least recently used first once the
+ * cache holds more than `maxBytes`.
+ * @param maxBytes memory bound of the cache
+ */
+void sbasCacheEnable(size_t maxBytes);
+
+/**
+ * Stops caching and frees every function nobody references.
+ * The ones still referenced are freed by their last `sbasCleanup`.
+ */
+void sbasCacheDisable(void);
+
+/**
+ * Copies the cache counters to `stats`
+ */
+void sbasCacheStats(CacheStats* stats);
+
+funcp cacheAcquire(const char* src, size_t len, char options, struct CacheEntry** pending);
+void cachePublish(struct CacheEntry* entry, funcp sbasFunc, const SbasObject* obj, unsigned described);
+void cacheAbandon(struct CacheEntry* entry);
+void cacheRelease(struct CacheEntry* entry);
+
+#endif
@@ -1,7 +1,6 @@
 #ifndef CONFIG_H
 #define CONFIG_H
 
-#define MAX_LINES 50  // threshold for processing SBas file
 // #define DEBUG   // for logging
 // Terminal output
 #define GREEN "\033[0;32m"
@@ -0,0 +1,289 @@
+#include "hotswap.h"
+
+#include <pthread.h>
+#include <stdalign.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "arena.h"
+
+#define TRAMPOLINE_SIZE 16    // jmp *8(%rip) padded so the target is 8-byte aligned
+#define TRAMPOLINE_TARGET 8   // offset of the jump target in the trampoline
+#define EPOCH_INACTIVE 0      // slot epoch of a thread outside any handle
+
+// jmp *2(%rip): the 6-byte jump reads its target right past the 2 padding bytes
+static const unsigned char TRAMPOLINE_JUMP[TRAMPOLINE_TARGET] = {0xFF, 0x25, 0x02, 0x00, 0x00, 0x00, 0xCC, 0xCC};
+
+struct FunctionHandle {
+  funcp entry;                // the trampoline, in the R+X view
+  _Atomic uintptr_t* target;  // the trampoline's jump target, in the R+W view
+  funcp body;                 // code `target` points at
+};
+
+/**
+ * Code that was replaced or destroyed while threads may still run it
+ */
+typedef struct RetiredCode {
+  funcp code;
+  uint_fast64_t epoch;  // global epoch when it became unreachable
+  struct RetiredCode* next;
+} RetiredCode;
+
+/**
+ * Announces the epoch a thread entered handle code at,
+ * on a cache line of its own so readers never contend
+ */
+typedef struct {
+  alignas(64) atomic_uint_fast64_t epoch;
+  atomic_int claimed;
+} EpochSlot;
+
+static struct {
+  pthread_mutex_t lock;
+  CodeArena* arena;  // dual-mapped, so trampolines are patched without mprotect
+  int handleCount;
+  RetiredCode* retired;
+  int retiredCount;
+} swap = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+static atomic_uint_fast64_t globalEpoch = 1;
+static EpochSlot slots[EPOCH_MAX_THREADS];
+static atomic_int unregisteredReaders;  // threads inside handle code that found no free slot
+static pthread_once_t slotKeyOnce = PTHREAD_ONCE_INIT;
+static pthread_key_t slotKey;  // releases a thread's slot when it exits
+static _Thread_local int slotIndex = -1;
+static _Thread_local int nesting;
+
+static void create_slot_key(void);
+static void release_slot(void* slot);
+static void claim_slot(void);
+static int retire(funcp code);
+static void reclaim(void);
+
+/**
+ * Compiles the body into the shared dual-mapped arena and puts a trampoline in front of it
+ */
+FunctionHandle* sbasHandleCreate(const char* src, size_t len) {
+  FunctionHandle* handle = calloc(1, sizeof(FunctionHandle));
+  if (!handle) {
+    fprintf(stderr, "sbasHandleCreate: failed to alloc handle.\n");
+    return NULL;
+  }
+
+  pthread_mutex_lock(&swap.lock);
+
+  if (!swap.arena) {
+    swap.arena = sbasArenaCreateDualMapped(0);
+    if (!swap.arena) goto on_error;
+  }
+
+  handle->body = sbasArenaCompileBuffer(swap.arena, src, len);
+  if (!handle->body) goto on_error;
+
+  unsigned char* writable = NULL;
+  handle->entry = arenaReserveCode(swap.arena, TRAMPOLINE_SIZE, &writable);
+  if (!handle->entry) goto on_error;
+
+  memcpy(writable, TRAMPOLINE_JUMP, sizeof(TRAMPOLINE_JUMP));
+  handle->target = (_Atomic uintptr_t*)(writable + TRAMPOLINE_TARGET);
+  atomic_store(handle->target, (uintptr_t)handle->body);
+
+  swap.handleCount++;
+  pthread_mutex_unlock(&swap.lock);
+  return handle;
+
+on_error:
+  // nobody saw the handle, so its code can go right away
+  if (handle->body) sbasArenaFree(swap.arena, handle->body);
+  reclaim();
+  pthread_mutex_unlock(&swap.lock);
+  free(handle);
+  return NULL;
+}
+
+/**
+ * Returns the trampoline, which outlives every body of the handle
+ */
+funcp sbasHandleEntry(FunctionHandle* handle) { return handle->entry; }
+
+/**
+ * Calls the handle's entry inside an epoch
+ */
+int sbasHandleCall(FunctionHandle* handle, int p1, int p2, int p3) {
+  sbasEpochEnter();
+  int result = handle->entry(p1, p2, p3);
+  sbasEpochExit();
+  return result;
+}
+
+/**
+ * Compiles the new body, repoints the trampoline with one atomic store
+ * and retires the old body
+ */
+int sbasHandleSwap(FunctionHandle* handle, const char* src, size_t len) {
+  pthread_mutex_lock(&swap.lock);
+
+  funcp body = sbasArenaCompileBuffer(swap.arena, src, len);
+  if (!body) {
+    pthread_mutex_unlock(&swap.lock);
+    return -1;
+  }
+
+  funcp old = handle->body;
+  handle->body = body;
+  atomic_store(handle->target, (uintptr_t)body);
+
+  retire(old);
+  reclaim();
+
+  pthread_mutex_unlock(&swap.lock);
+  return 0;
+}
+
+/**
+ * Retires the handle's body and trampoline and frees the handle
+ */
+void sbasHandleDestroy(FunctionHandle* handle) {
+  if (!handle) return;
+
+  pthread_mutex_lock(&swap.lock);
+  retire(handle->body);
+  retire(handle->entry);
+  swap.handleCount--;
+  reclaim();
+  pthread_mutex_unlock(&swap.lock);
+
+  free(handle);
+}
+
+/**
+ * Publishes the current global epoch in the thread's slot. The sequentially
+ * consistent store keeps the CPU from loading a trampoline target before the
+ * slot is visible to `reclaim`.
+ */
+void sbasEpochEnter(void) {
+  if (nesting++ > 0) return;
+
+  if (slotIndex == -1) {
+    claim_slot();
+  }
+  if (slotIndex == -1) {
+    atomic_fetch_add(&unregisteredReaders, 1);
+    return;
+  }
+  atomic_store(&slots[slotIndex].epoch, atomic_load(&globalEpoch));
+}
+
+/**
+ * Clears the thread's slot once its outermost epoch is over
+ */
+void sbasEpochExit(void) {
+  if (--nesting > 0) return;
+
+  if (slotIndex == -1) {
+    atomic_fetch_sub(&unregisteredReaders, 1);
+    return;
+  }
+  atomic_store_explicit(&slots[slotIndex].epoch, EPOCH_INACTIVE, memory_order_release);
+}
+
+/**
+ * Frees what it can and counts what's left
+ */
+int sbasHandleReclaim(void) {
+  pthread_mutex_lock(&swap.lock);
+  reclaim();
+  int pending = swap.retiredCount;
+  pthread_mutex_unlock(&swap.lock);
+
+  return pending;
+}
+
+static void create_slot_key(void) { pthread_key_create(&slotKey, release_slot); }
+
+/**
+ * Gives the slot of an exiting thread back
+ */
+static void release_slot(void* slot) {
+  EpochSlot* epochSlot = slot;
+  atomic_store(&epochSlot->epoch, EPOCH_INACTIVE);
+  atomic_store(&epochSlot->claimed, 0);
+}
+
+/**
+ * Takes the first unclaimed slot for the calling thread, leaving
+ * `slotIndex` at -1 when all of them are taken
+ */
+static void claim_slot(void) {
+  pthread_once(&slotKeyOnce, create_slot_key);
+
+  for (int i = 0; i < EPOCH_MAX_THREADS; i++) {
+    int unclaimed = 0;
+    if (atomic_compare_exchange_strong(&slots[i].claimed, &unclaimed, 1)) {
+      slotIndex = i;
+      pthread_setspecific(slotKey, &slots[i]);
+      return;
+    }
+  }
+}
+
+/**
+ * Stamps unreachable code with the current epoch and advances it, so threads
+ * entering from now on can't be running the code. Expects `swap.lock` held.
+ * @returns 0 on success, -1 on failure
+ */
+static int retire(funcp code) {
+  RetiredCode* retired = malloc(sizeof(RetiredCode));
+  if (!retired) {
+    // leaking the code is the only safe option left
+    fprintf(stderr, "retire: failed to alloc retired code, %p won't be freed.\n", (void*)code);
+    return -1;
+  }
+
+  retired->code = code;
+  retired->epoch = atomic_fetch_add(&globalEpoch, 1);
+  retired->next = swap.retired;
+  swap.retired = retired;
+  swap.retiredCount++;
+  return 0;
+}
+
+/**
+ * Frees retired code older than the epoch of every thread still inside
+ * handle code, and the arena once nothing lives in it. Expects `swap.lock` held.
+ */
+static void reclaim(void) {
+  // threads without a slot could be anywhere: keep everything
+  if (atomic_load(&unregisteredReaders) > 0) return;
+
+  uint_fast64_t oldestActive = UINT_FAST64_MAX;
+  for (int i = 0; i < EPOCH_MAX_THREADS; i++) {
+    uint_fast64_t epoch = atomic_load(&slots[i].epoch);
+    if (epoch != EPOCH_INACTIVE && epoch < oldestActive) {
+      oldestActive = epoch;
+    }
+  }
+
+  RetiredCode** link = &swap.retired;
+  while (*link) {
+    RetiredCode* retired = *link;
+
+    // a thread that entered at the retiring epoch may have read the old target
+    if (retired->epoch < oldestActive) {
+      *link = retired->next;
+      sbasArenaFree(swap.arena, retired->code);
+      free(retired);
+      swap.retiredCount--;
+    } else {
+      link = &retired->next;
+    }
+  }
+
+  if (swap.handleCount == 0 && swap.retiredCount == 0 && swap.arena) {
+    sbasArenaDestroy(swap.arena);
+    swap.arena = NULL;
+  }
+}
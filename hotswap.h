@@ -0,0 +1,73 @@
+#ifndef HOTSWAP_H
+#define HOTSWAP_H
+#include <stddef.h>
+
+#include "types.h"
+
+#define EPOCH_MAX_THREADS 256  // threads that can be inside handles at once before reclamation stalls
+
+/**
+ * A stable entry point to a SBas function whose body can be replaced while
+ * other threads keep calling it.
+ *
+ * The entry is a tiny trampoline, `jmp *target(%rip)`, in front of the current
+ * body. Swapping stores the new body's address in `target` with a single
+ * atomic write, so a call either runs the old body or the new one, never a mix.
+ * Replaced bodies are reclaimed once every thread that could still be running
+ * them has left: see `sbasEpochEnter`.
+ */
+typedef struct FunctionHandle FunctionHandle;
+
+/**
+ * Compiles a SBas function behind a new handle
+ * @param src SBas source, it doesn't need to be NUL-terminated
+ * @param len amount of bytes in `src`
+ * @returns the handle, `NULL` on failure
+ */
+FunctionHandle* sbasHandleCreate(const char* src, size_t len);
+
+/**
+ * The handle's entry point. It never changes for the life of the handle, so it
+ * can be cached and called from anywhere, inside `sbasEpochEnter`/`sbasEpochExit`.
+ */
+funcp sbasHandleEntry(FunctionHandle* handle);
+
+/**
+ * Enters the handle's epoch and calls its current body
+ */
+int sbasHandleCall(FunctionHandle* handle, int p1, int p2, int p3);
+
+/**
+ * Compiles a new body for the handle and atomically points its entry at it.
+ * Calls in flight finish on the old body, which is freed once they're over.
+ * If the source doesn't compile, the handle keeps its current body.
+ * @returns 0 on success, -1 on failure
+ */
+int sbasHandleSwap(FunctionHandle* handle, const char* src, size_t len);
+
+/**
+ * Destroys a handle. Its entry point must not be called anymore; its body and
+ * trampoline are freed once the calls in flight are over.
+ */
+void sbasHandleDestroy(FunctionHandle* handle);
+
+/**
+ * Marks the calling thread as possibly running handle code. Code that was
+ * reachable through a handle when the thread entered stays mapped until it
+ * calls `sbasEpochExit`. Calls nest.
+ */
+void sbasEpochEnter(void);
+
+/**
+ * Marks the calling thread as no longer running handle code
+ */
+void sbasEpochExit(void);
+
+/**
+ * Frees the replaced bodies no thread can be running anymore.
+ * Swaps and destroys do this too, but an idle program can call it directly.
+ * @returns the amount of bodies still waiting for threads to leave
+ */
+int sbasHandleReclaim(void);
+
+#endif
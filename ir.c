@@ -0,0 +1,220 @@
+#include "ir.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "config.h"
+#include "lexer.h"
+#include "utils.h"
+
+static int lower_statement(const Statement* stmt, IrOp* op);
+static int split_blocks(IrFunction* ir, const char* leaders);
+
+/**
+ * Lowers every command of the source to an operation, then cuts the
+ * operations into basic blocks at the first command, at jump targets and
+ * right after jumps and returns
+ */
+int irBuild(const char* src, size_t len, unsigned lines, IrFunction* ir) {
+  Lexer lexer;             // reads commands straight from `src`
+  Statement stmt;          // the command being lowered
+  int lexRet = 0;          // result of reading the next command
+  char retFound = 0;       // turns on when a `'ret'` is found
+  char startsBlock = 1;    // the next command begins a block
+  char* leaders = NULL;    // per line: a block starts there
+  int result = -1;
+
+  ir->ops = NULL;
+  ir->opCount = 0;
+  ir->blocks = NULL;
+  ir->blockCount = 0;
+  ir->lines = lines;
+
+  // a command per line at most, so neither array ever grows
+  ir->ops = malloc(lines * sizeof(IrOp));
+  leaders = calloc(lines, sizeof(char));
+  if (!ir->ops || !leaders) {
+    fprintf(stderr, "irBuild: failed to alloc operations.\n");
+    goto on_cleanup;
+  }
+
+  lexerInit(&lexer, src, len);
+  while ((lexRet = lexerNextStatement(&lexer, &stmt)) == 1) {
+    IrOp* op = &ir->ops[ir->opCount++];
+    if (lower_statement(&stmt, op) == -1) {
+      goto on_cleanup;
+    }
+
+    if (startsBlock) {
+      leaders[stmt.line] = 1;
+    }
+    startsBlock = op->opcode == IR_JLEZ || op->opcode == IR_RET;
+    retFound |= op->opcode == IR_RET;
+
+    // targets past the end are reported once blocks are known
+    if (op->opcode == IR_JLEZ && op->target < lines) {
+      leaders[op->target] = 1;
+    }
+  }
+
+  if (lexRet == -1) {
+    goto on_cleanup;
+  }
+
+  if (!retFound) {
+    fprintf(stderr, "sbasCompile: SBas function doesn't include 'ret'. Aborting!\n");
+    goto on_cleanup;
+  }
+
+  if (split_blocks(ir, leaders) == -1) {
+    goto on_cleanup;
+  }
+
+#ifdef DEBUG
+  irPrint(ir);
+#endif
+  result = 0;
+
+on_cleanup:
+  free(leaders);
+  if (result == -1) {
+    irFree(ir);
+  }
+
+  return result;
+}
+
+/**
+ * Follows the fall through and the final jump of block `block` of `ir`
+ */
+unsigned irSuccessors(const IrFunction* ir, unsigned block, unsigned successors[2]) {
+  const IrBlock* b = &ir->blocks[block];
+  const IrOp* last = b->count ? &ir->ops[b->first + b->count - 1] : NULL;
+  unsigned count = 0;
+
+  if (last && last->opcode == IR_RET) {
+    return 0;
+  }
+  if (last && last->opcode == IR_JMP) {
+    successors[count++] = last->target;
+    return count;
+  }
+  if (block + 1 < ir->blockCount) {
+    successors[count++] = block + 1;
+  }
+  if (last && last->opcode == IR_JLEZ && last->target != block + 1) {
+    successors[count++] = last->target;
+  }
+  return count;
+}
+
+/**
+ * Releases the operations and blocks of `ir`
+ */
+void irFree(IrFunction* ir) {
+  free(ir->ops);
+  free(ir->blocks);
+  ir->ops = NULL;
+  ir->opCount = 0;
+  ir->blocks = NULL;
+  ir->blockCount = 0;
+}
+
+#ifdef DEBUG
+/**
+ * Prints every block of `ir` with its operations
+ */
+void irPrint(const IrFunction* ir) {
+  static const char* names[] = {"mov", "add", "sub", "mul", "jlez", "jmp", "ret"};
+
+  for (unsigned b = 0; b < ir->blockCount; b++) {
+    const IrBlock* block = &ir->blocks[b];
+    printf("block %u (line %u):\n", b, block->line);
+
+    for (unsigned i = block->first; i < block->first + block->count; i++) {
+      const IrOp* op = &ir->ops[i];
+      printf("  %4u  %-4s", op->line, names[op->opcode]);
+      if (op->dest) printf(" v%d =", op->dest);
+      if (op->opcode != IR_JMP) printf(" %c%d", op->a.type, op->a.value);
+      if (op->opcode >= IR_ADD && op->opcode <= IR_MUL) printf(", %c%d", op->b.type, op->b.value);
+      if (op->opcode == IR_JLEZ || op->opcode == IR_JMP) printf(" -> block %u", op->target);
+      printf("\n");
+    }
+  }
+}
+#endif
+
+/**
+ * Turns a command read by the lexer into an operation. Jumps keep their
+ * target line in `target` until blocks are known
+ * @returns 0 on success, -1 on failure
+ */
+static int lower_statement(const Statement* stmt, IrOp* op) {
+  op->dest = 0;
+  op->line = stmt->line;
+  op->a = stmt->lhs;
+  op->b = (Operand){0};
+  op->target = 0;
+
+  switch (stmt->kind) {
+    case STMT_RET:
+      op->opcode = IR_RET;
+      break;
+    case STMT_ATTRIBUTION:
+      op->opcode = IR_MOV;
+      op->dest = stmt->dest.value;
+      break;
+    case STMT_ARITHMETIC:
+      op->opcode = stmt->op == '+' ? IR_ADD : stmt->op == '-' ? IR_SUB : IR_MUL;
+      op->dest = stmt->dest.value;
+      op->b = stmt->rhs;
+      break;
+    case STMT_IFLEZ:
+      op->opcode = IR_JLEZ;
+      op->target = stmt->targetLine;
+      break;
+    default:
+      fprintf(stderr, "lower_statement: unknown statement kind %d\n", stmt->kind);
+      return -1;
+  }
+  return 0;
+}
+
+/**
+ * Starts a block at every operation whose line is a leader and points
+ * jumps at the block of their target line
+ * @returns 0 on success, -1 on failure
+ */
+static int split_blocks(IrFunction* ir, const char* leaders) {
+  unsigned* blockOfLine = calloc(ir->lines, sizeof(unsigned));  // 1 + block starting at a line, 0 if none
+  ir->blocks = malloc(ir->opCount * sizeof(IrBlock));
+  if (!blockOfLine || !ir->blocks) {
+    fprintf(stderr, "irBuild: failed to alloc blocks.\n");
+    free(blockOfLine);
+    return -1;
+  }
+
+  for (unsigned i = 0; i < ir->opCount; i++) {
+    const unsigned line = ir->ops[i].line;
+    if (i == 0 || leaders[line]) {
+      ir->blocks[ir->blockCount] = (IrBlock){.first = i, .count = 0, .line = line};
+      blockOfLine[line] = ++ir->blockCount;
+    }
+    ir->blocks[ir->blockCount - 1].count++;
+  }
+
+  for (unsigned i = 0; i < ir->opCount; i++) {
+    IrOp* op = &ir->ops[i];
+    if (op->opcode != IR_JLEZ) continue;
+
+    if (op->target >= ir->lines || blockOfLine[op->target] == 0) {
+      compilationError("irBuild: jump target is not an executable line", op->target);
+      free(blockOfLine);
+      return -1;
+    }
+    op->target = blockOfLine[op->target] - 1;
+  }
+
+  free(blockOfLine);
+  return 0;
+}
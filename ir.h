@@ -0,0 +1,105 @@
+#ifndef IR_H
+#define IR_H
+#include <stddef.h>
+
+#include "types.h"
+
+#define IR_VAR_COUNT 5  // v1 through v5, operations index them from 1
+
+/**
+ * The three-address operations SBas commands lower to
+ */
+typedef enum {
+  IR_MOV,   // dest = a
+  IR_ADD,   // dest = a + b
+  IR_SUB,   // dest = a - b
+  IR_MUL,   // dest = a * b
+  IR_JLEZ,  // goto block `target` if a <= 0, else fall through to the next block
+  IR_JMP,   // goto block `target`, only made by passes
+  IR_RET,   // return a
+} IrOpcode;
+
+/**
+ * A single operation, packed so a block's operations share few cache lines
+ *
+ * Fields:
+ * - `opcode`: an `IrOpcode`
+ * - `dest`: variable written (1 through 5), 0 for jumps and returns
+ * - `line`: source line the operation comes from
+ * - `a`, `b`: operands, as read by the lexer (`v`, `p` or `$`)
+ * - `target`: block jumped to by `IR_JLEZ` and `IR_JMP`
+ */
+typedef struct {
+  unsigned char opcode;
+  unsigned char dest;
+  unsigned line;
+  Operand a;
+  Operand b;
+  unsigned target;
+} IrOp;
+
+/**
+ * A straight run of operations entered only at its first one.
+ * Only its last operation may be a jump or a return; otherwise, and when an
+ * `IR_JLEZ` isn't taken, control falls through to the next block.
+ *
+ * Fields:
+ * - `first`: index of its first operation in `IrFunction.ops`
+ * - `count`: amount of operations, may drop to 0 as passes delete them
+ * - `line`: source line it starts at, which jumps to it resolve to
+ */
+typedef struct {
+  unsigned first;
+  unsigned count;
+  unsigned line;
+} IrBlock;
+
+/**
+ * A SBas function as a list of basic blocks in source order, whose
+ * operations sit back to back in a single array
+ *
+ * Fields:
+ * - `ops`: every operation, block after block
+ * - `opCount`: amount of entries in `ops`
+ * - `blocks`: the basic blocks, the first one is the entry
+ * - `blockCount`: amount of entries in `blocks`
+ * - `lines`: amount of source lines plus one, as in `SbasObject.lines`
+ */
+typedef struct {
+  IrOp* ops;
+  unsigned opCount;
+  IrBlock* blocks;
+  unsigned blockCount;
+  unsigned lines;
+} IrFunction;
+
+/**
+ * Parses SBas source into basic blocks of three-address operations
+ * @param src SBas source, it doesn't need to be NUL-terminated
+ * @param len amount of bytes in `src`
+ * @param lines amount of source lines plus one
+ * @param ir function to fill in, release it with `irFree`
+ * @returns 0 on success, -1 on failure (already reported)
+ */
+int irBuild(const char* src, size_t len, unsigned lines, IrFunction* ir);
+
+/**
+ * Lists the blocks control may go to once a block is over: the next block
+ * unless it ends with a return or an `IR_JMP`, and the target of its final jump
+ * @param ir the function
+ * @param block index of the block
+ * @param successors receives up to two block indexes
+ * @returns the amount of successors
+ */
+unsigned irSuccessors(const IrFunction* ir, unsigned block, unsigned successors[2]);
+
+/**
+ * Releases the buffers of a function built by `irBuild`
+ */
+void irFree(IrFunction* ir);
+
+#ifdef DEBUG
+void irPrint(const IrFunction* ir);
+#endif
+
+#endif
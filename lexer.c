@@ -0,0 +1,329 @@
+#include "lexer.h"
+
+#include <limits.h>
+#include <stdio.h>
+
+#include "utils.h"
+
+#define BUFFER_SIZE 128  // length of a compilation error message
+
+static char peek(Lexer* lexer);
+static void skip_blanks(Lexer* lexer);
+static void skip_line(Lexer* lexer);
+static int match_keyword(Lexer* lexer, const char* keyword);
+static int read_int(Lexer* lexer, int* value);
+static int read_operand(Lexer* lexer, Operand* operand);
+static int check_index(Operand* operand, unsigned line);
+static int lex_return(Lexer* lexer, Statement* stmt);
+static int lex_variable(Lexer* lexer, Statement* stmt);
+static int lex_iflez(Lexer* lexer, Statement* stmt);
+
+/**
+ * Points `lexer` at the first line of the `len` bytes at `src`
+ */
+void lexerInit(Lexer* lexer, const char* src, size_t len) {
+  lexer->cursor = src;
+  lexer->end = src + len;
+  lexer->line = 1;
+}
+
+/**
+ * Reads the next SBas command, skipping blank lines and comments
+ *
+ * @param lexer lexer initialized with `lexerInit`
+ * @param stmt pointer to the statement to fill in
+ *
+ * @returns 1 when a statement was read, 0 at the end of the source,
+ * -1 on a syntax error (already reported)
+ */
+int lexerNextStatement(Lexer* lexer, Statement* stmt) {
+  while (lexer->cursor < lexer->end) {
+    while (lexer->cursor < lexer->end && *lexer->cursor == ' ') {
+      lexer->cursor++;
+    }
+
+    const char firstChar = peek(lexer);
+    if (firstChar == '\n' || firstChar == '\0' || firstChar == '/') {
+      skip_line(lexer);
+      continue;
+    }
+
+    stmt->line = lexer->line;
+
+    int lexRet;
+    switch (firstChar) {
+      case 'r':
+        lexRet = lex_return(lexer, stmt);
+        break;
+      case 'v':
+        lexRet = lex_variable(lexer, stmt);
+        break;
+      case 'i':
+        lexRet = lex_iflez(lexer, stmt);
+        break;
+      default:
+        compilationError("sbasCompile: unknown SBas command", lexer->line);
+        return -1;
+    }
+    if (lexRet == -1) {
+      return -1;
+    }
+
+    skip_line(lexer);
+    return 1;
+  }
+  return 0;
+}
+
+/**
+ * ret <vX|$num>
+ */
+static int lex_return(Lexer* lexer, Statement* stmt) {
+  stmt->kind = STMT_RET;
+
+  if (match_keyword(lexer, "ret") == -1 || read_operand(lexer, &stmt->lhs) == -1 || (stmt->lhs.type != 'v' && stmt->lhs.type != '$')) {
+    compilationError("sbasCompile: invalid 'ret' command: expected 'ret <var|$int>", stmt->line);
+    return -1;
+  }
+
+  return check_index(&stmt->lhs, stmt->line);
+}
+
+/**
+ * vX: <vX|pX|$num>
+ * vX = <vX|$num> op <vX|$num>
+ */
+static int lex_variable(Lexer* lexer, Statement* stmt) {
+  char errorMsgBuffer[BUFFER_SIZE] = {0};  // a compilation error message
+
+  lexer->cursor++;  // consume 'v'
+  stmt->dest.type = 'v';
+
+  if (read_int(lexer, &stmt->dest.value) == -1) {
+    compilationError("sbasCompile: invalid command: expected attribution (vX: varpc) or arithmetic operation (vX = varc op varc)", stmt->line);
+    return -1;
+  }
+
+  skip_blanks(lexer);
+  const char separator = peek(lexer);
+  if (separator == '\n') {
+    compilationError("sbasCompile: invalid command: expected attribution (vX: varpc) or arithmetic operation (vX = varc op varc)", stmt->line);
+    return -1;
+  }
+  lexer->cursor++;
+
+  if (stmt->dest.value < 1 || stmt->dest.value > 5) {
+    snprintf(errorMsgBuffer, BUFFER_SIZE, "sbasCompile: invalid local variable index %d. Only v1 through v5 are allowed.", stmt->dest.value);
+    compilationError(errorMsgBuffer, stmt->line);
+    return -1;
+  }
+
+  // attribution
+  if (separator == ':') {
+    stmt->kind = STMT_ATTRIBUTION;
+
+    if (read_operand(lexer, &stmt->lhs) == -1 || (stmt->lhs.type != 'v' && stmt->lhs.type != 'p' && stmt->lhs.type != '$')) {
+      compilationError("sbasCompile: invalid attribution: expected 'vX: <vX|pX|$num>'", stmt->line);
+      return -1;
+    }
+
+    return check_index(&stmt->lhs, stmt->line);
+  }
+
+  // arithmetic operation
+  if (separator == '=') {
+    stmt->kind = STMT_ARITHMETIC;
+
+    char validOperation = read_operand(lexer, &stmt->lhs) == 0;
+    if (validOperation) {
+      skip_blanks(lexer);
+      stmt->op = peek(lexer);
+      validOperation = stmt->op != '\n';
+    }
+    if (validOperation) {
+      lexer->cursor++;
+      validOperation = read_operand(lexer, &stmt->rhs) == 0;
+    }
+    if (validOperation) {
+      // extra operands or operators
+      skip_blanks(lexer);
+      validOperation = peek(lexer) == '\n';
+    }
+    if (!validOperation) {
+      compilationError("sbasCompile: invalid arithmetic operation: expected 'vX = <vX|$num> op <vX|$num>'", stmt->line);
+      return -1;
+    }
+
+    if (stmt->op != '+' && stmt->op != '-' && stmt->op != '*') {
+      snprintf(errorMsgBuffer, BUFFER_SIZE, "sbasCompile: invalid arithmetic operation %c. Only addition (+), subtraction (-), and multiplication (*) allowed.", stmt->op);
+      compilationError(errorMsgBuffer, stmt->line);
+      return -1;
+    }
+
+    if ((stmt->lhs.type != 'v' && stmt->lhs.type != '$') || (stmt->rhs.type != 'v' && stmt->rhs.type != '$')) {
+      compilationError("sbasCompile: invalid arithmetic operation: expected 'vX = <vX|$num> op <vX|$num>'", stmt->line);
+      return -1;
+    }
+
+    if (check_index(&stmt->lhs, stmt->line) == -1) return -1;
+    return check_index(&stmt->rhs, stmt->line);
+  }
+
+  snprintf(errorMsgBuffer, BUFFER_SIZE, "sbasCompile: invalid operator %c. Only attribution (:) and arithmetic operation (=) are supported.", separator);
+  compilationError(errorMsgBuffer, stmt->line);
+  return -1;
+}
+
+/**
+ * iflez vX line
+ */
+static int lex_iflez(Lexer* lexer, Statement* stmt) {
+  int targetLine = 0;
+
+  stmt->kind = STMT_IFLEZ;
+  stmt->lhs.type = 'v';
+
+  char validJump = match_keyword(lexer, "iflez") == 0;
+  if (validJump) {
+    skip_blanks(lexer);
+    validJump = peek(lexer) == 'v';
+  }
+  if (validJump) {
+    lexer->cursor++;
+    validJump = read_int(lexer, &stmt->lhs.value) == 0 && read_int(lexer, &targetLine) == 0 && targetLine >= 0;
+  }
+  if (!validJump) {
+    compilationError("sbasCompile: invalid 'iflez' command: expected 'iflez vX line'", stmt->line);
+    return -1;
+  }
+
+  stmt->targetLine = targetLine;
+  return check_index(&stmt->lhs, stmt->line);
+}
+
+/**
+ * Returns the byte under the cursor, reporting the end of the source
+ * as the end of a line
+ */
+static char peek(Lexer* lexer) { return lexer->cursor < lexer->end ? *lexer->cursor : '\n'; }
+
+/**
+ * Moves the cursor past whitespace, stopping at line ends
+ */
+static void skip_blanks(Lexer* lexer) {
+  while (lexer->cursor < lexer->end) {
+    const char c = *lexer->cursor;
+    if (c != ' ' && c != '\t' && c != '\r' && c != '\v' && c != '\f') {
+      return;
+    }
+    lexer->cursor++;
+  }
+}
+
+/**
+ * Moves the cursor to the start of the next line
+ */
+static void skip_line(Lexer* lexer) {
+  while (lexer->cursor < lexer->end && *lexer->cursor != '\n') {
+    lexer->cursor++;
+  }
+
+  if (lexer->cursor < lexer->end) {
+    lexer->cursor++;
+    lexer->line++;
+  }
+}
+
+/**
+ * Consumes `keyword` if the cursor is at it
+ * @returns 0 on a match, -1 otherwise
+ */
+static int match_keyword(Lexer* lexer, const char* keyword) {
+  const char* p = lexer->cursor;
+
+  while (*keyword) {
+    if (p == lexer->end || *p != *keyword) {
+      return -1;
+    }
+    p++;
+    keyword++;
+  }
+
+  lexer->cursor = p;
+  return 0;
+}
+
+/**
+ * Reads a base 10 signed integer, skipping any whitespace before it
+ * @returns 0 on success, -1 if there's no integer or it doesn't fit in 32 bits
+ */
+static int read_int(Lexer* lexer, int* value) {
+  long long num = 0;
+  char isNegative = 0;
+
+  skip_blanks(lexer);
+  if (lexer->cursor < lexer->end && (*lexer->cursor == '-' || *lexer->cursor == '+')) {
+    isNegative = *lexer->cursor == '-';
+    lexer->cursor++;
+  }
+
+  const char* digits = lexer->cursor;
+  while (lexer->cursor < lexer->end && *lexer->cursor >= '0' && *lexer->cursor <= '9') {
+    num = num * 10 + (*lexer->cursor - '0');
+    if (num > (long long)INT_MAX + 1) {
+      return -1;
+    }
+    lexer->cursor++;
+  }
+
+  if (lexer->cursor == digits) {
+    return -1;
+  }
+
+  if (isNegative) {
+    num = -num;
+  }
+  if (num > INT_MAX) {
+    return -1;
+  }
+
+  *value = (int)num;
+  return 0;
+}
+
+/**
+ * Reads an operand: its type character followed by an integer
+ * @returns 0 on success, -1 on failure
+ */
+static int read_operand(Lexer* lexer, Operand* operand) {
+  skip_blanks(lexer);
+  if (peek(lexer) == '\n') {
+    return -1;
+  }
+
+  operand->type = *lexer->cursor;
+  lexer->cursor++;
+  return read_int(lexer, &operand->value);
+}
+
+/**
+ * Checks that variables and parameters refer to existing registers
+ * @returns 0 on success, -1 on failure
+ */
+static int check_index(Operand* operand, unsigned line) {
+  char errorMsgBuffer[BUFFER_SIZE] = {0};  // a compilation error message
+
+  if (operand->type == 'v' && (operand->value < 1 || operand->value > 5)) {
+    snprintf(errorMsgBuffer, BUFFER_SIZE, "sbasCompile: invalid local variable index %d. Only v1 through v5 are allowed.", operand->value);
+    compilationError(errorMsgBuffer, line);
+    return -1;
+  }
+
+  if (operand->type == 'p' && (operand->value < 1 || operand->value > 3)) {
+    snprintf(errorMsgBuffer, BUFFER_SIZE, "sbasCompile: invalid parameter index %d. Only p1 through p3 are allowed.", operand->value);
+    compilationError(errorMsgBuffer, line);
+    return -1;
+  }
+
+  return 0;
+}
@@ -0,0 +1,26 @@
+#ifndef LEXER_H
+#define LEXER_H
+#include <stddef.h>
+
+#include "types.h"
+
+/**
+ * Reads SBas commands straight out of a source buffer.
+ * The buffer is never copied nor written to, and doesn't have to end with a
+ * NUL byte, so it can be a mmap'd file.
+ *
+ * Fields:
+ * - `cursor`: next byte to read
+ * - `end`: one past the last byte of the source
+ * - `line`: line the cursor is at (1-indexed)
+ */
+typedef struct {
+  const char* cursor;
+  const char* end;
+  unsigned line;
+} Lexer;
+
+void lexerInit(Lexer* lexer, const char* src, size_t len);
+int lexerNextStatement(Lexer* lexer, Statement* stmt);
+
+#endif
@@ -1,30 +1,221 @@
 #include "linker.h"
 
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
 #include "utils.h"
 
+/**
+ * A change of the code size at a point of the unrelaxed code: a jump made short
+ * or NOPs put in
+ *
+ * Fields:
+ * - `trigger`: the change applies to the code past this offset
+ * - `reloc`: index of a jump in the relocation table, -1 for padding
+ * - `point`: index of an alignment point, -1 for a jump
+ * - `delta`: bytes added, negative for those a short jump saves
+ */
+typedef struct {
+  int trigger;
+  int reloc;
+  int point;
+  int delta;
+} LayoutEvent;
+
+static int jump_length(const unsigned char* code, const RelocationTable* reloc);
+static int jump_target(const LineTable* lt, unsigned lines, const RelocationTable* reloc);
+static int padding(const AlignPoint* point, int position, int jumpSize, const unsigned char* code,
+                   const RelocationTable* rt, const Alignment* alignment);
+static int relaxed_position(const LayoutEvent* events, const int* shiftBefore, int eventCount, int position);
+
+/**
+ * Picks the padding that suits the CPU running the compiler:
+ * - Skylake-derived cores run a jump that crosses or ends a 32-byte chunk from
+ *   the legacy decoders (the JCC erratum), and fetch loops by 32-byte chunks
+ * - Zen cores fetch 32-byte chunks too
+ * - anything else gets 16-byte loop heads, as the fetch unit of most x86-64 cores
+ */
+void hostAlignment(Alignment* alignment) {
+  __builtin_cpu_init();
+  alignment->loopBoundary = 16;
+  alignment->maxLoopPadding = 15;
+  alignment->jccErratum = 0;
+
+  if (__builtin_cpu_is("skylake") || __builtin_cpu_is("skylake-avx512") || __builtin_cpu_is("cascadelake") ||
+      __builtin_cpu_is("cooperlake")) {
+    alignment->loopBoundary = 32;
+    alignment->jccErratum = 1;
+  } else if (__builtin_cpu_is("amdfam17h") || __builtin_cpu_is("amdfam19h")) {
+    alignment->loopBoundary = 32;
+  }
+}
+
+/**
+ * Lays the code out again with short jumps and padding.
+ *
+ * Every `jle rel32` (`0F 8E`) and `jmp rel32` (`E9`) whose target lies within a
+ * signed byte becomes a 2-byte `jle rel8` (`7E`) or `jmp rel8` (`EB`). When an
+ * `alignment` is given, NOPs also go before the alignment points it asks for.
+ * Jumps start short and only grow when their target is out of reach, round
+ * after round as padding moves along, so the layout settles once none grows.
+ * Line offsets, relocation offsets and stack cleanup targets then move with the
+ * code. Shortened jumps become `RELOC_SHORT_JUMP`s.
+ *
+ * @param obj assembled function, whose code is replaced by the new layout
+ * @param rt pointer to a relocation table struct, in ascending offset order
+ * @param relocCount amount of entries in `rt`
+ * @param points spots for padding, in ascending offset order
+ * @param pointCount amount of entries in `points`
+ * @param alignment padding to put in, `NULL` for none
+ *
+ * @returns 0 on success, -1 on failure
+ */
+char sbasRelax(SbasObject* obj, RelocationTable* rt, int relocCount, const AlignPoint* points, int pointCount,
+               const Alignment* alignment) {
+  const int eventCount = relocCount + (alignment ? pointCount : 0);
+  LayoutEvent* events = malloc((eventCount + 1) * sizeof(LayoutEvent));
+  int* shiftBefore = malloc((eventCount + 1) * sizeof(int));  // bytes added by the events before each one
+  char* isShort = calloc(relocCount + 1, sizeof(char));    // per relocation: its jump is short in the current layout
+  unsigned char* code = NULL;
+  char changed = 1;
+  char result = -1;
+  int read = 0;
+  int write = 0;
+
+  if (!events || !shiftBefore || !isShort) {
+    fprintf(stderr, "sbasRelax: failed to alloc layout tables.\n");
+    goto on_cleanup;
+  }
+
+  // jumps and padding by offset, padding going before the code at its offset
+  for (int r = 0, p = 0, k = 0; k < eventCount; k++) {
+    const char takePoint = p < eventCount - relocCount && (r == relocCount || points[p].offset - 1 < rt[r].offset);
+    events[k] = takePoint ? (LayoutEvent){points[p].offset - 1, -1, p++, 0} : (LayoutEvent){rt[r].offset, r++, -1, 0};
+    if (!takePoint) isShort[events[k].reloc] = jump_length(obj->code, &rt[events[k].reloc]) != 0;
+  }
+
+  while (changed) {
+    int shift = 0;
+    changed = 0;
+
+    for (int k = 0; k < eventCount; k++) {
+      LayoutEvent* event = &events[k];
+      shiftBefore[k] = shift;
+
+      if (event->reloc != -1) {
+        event->delta = isShort[event->reloc] ? SHORT_JUMP_SIZE - jump_length(obj->code, &rt[event->reloc]) : 0;
+      } else {
+        const AlignPoint* point = &points[event->point];
+        int jumpSize = 0;
+        if (point->kind == ALIGN_BRANCH) {
+          jumpSize = isShort[point->jump] ? SHORT_JUMP_SIZE : jump_length(obj->code, &rt[point->jump]);
+        }
+        event->delta = padding(point, point->offset + shift, jumpSize, obj->code, rt, alignment);
+      }
+      shift += event->delta;
+    }
+    shiftBefore[eventCount] = shift;
+
+    for (int k = 0; k < eventCount; k++) {
+      const int r = events[k].reloc;
+      if (r == -1 || !isShort[r]) continue;
+
+      const int start = rt[r].offset - (jump_length(obj->code, &rt[r]) - 4);
+      const int target = jump_target(obj->lt, obj->lines, &rt[r]);
+      const int rel8 = relaxed_position(events, shiftBefore, eventCount, target) -
+                       (relaxed_position(events, shiftBefore, eventCount, start) + SHORT_JUMP_SIZE);
+      if (target == -1 || rel8 < -128 || rel8 > 127) {
+        isShort[r] = 0;
+        changed = 1;
+      }
+    }
+  }
+
+  code = malloc(obj->size + shiftBefore[eventCount] + 1);
+  if (!code) {
+    fprintf(stderr, "sbasRelax: failed to alloc code buffer.\n");
+    goto on_cleanup;
+  }
+
+  // every target moves by what changed before it, as seen from the code before any moved
+  for (unsigned line = 1; line < obj->lines; line++) {
+    if (obj->lt[line].line) {
+      obj->lt[line].offset = relaxed_position(events, shiftBefore, eventCount, obj->lt[line].offset);
+    }
+  }
+  for (int r = 0; r < relocCount; r++) {
+    if (rt[r].kind == RELOC_JUMP && !rt[r].targetLine) {
+      rt[r].targetOffset = relaxed_position(events, shiftBefore, eventCount, rt[r].targetOffset);
+    }
+  }
+
+  for (int k = 0; k < eventCount; k++) {
+    const LayoutEvent* event = &events[k];
+    const int r = event->reloc;
+
+    if (r == -1) {
+      memcpy(code + write, obj->code + read, event->trigger + 1 - read);
+      write += event->trigger + 1 - read;
+      read = event->trigger + 1;
+      emitNops(code, &write, event->delta);
+      continue;
+    }
+    if (!isShort[r]) {
+      rt[r].offset += shiftBefore[k];
+      continue;
+    }
+
+    const int length = jump_length(obj->code, &rt[r]);
+    const int start = rt[r].offset - (length - 4);
+    memcpy(code + write, obj->code + read, start - read);
+    write += start - read;
+    code[write++] = length == 6 ? 0x7E : 0xEB;
+    rt[r].offset = write;
+    rt[r].kind = RELOC_SHORT_JUMP;
+    code[write++] = 0;
+    read = start + length;
+  }
+  memcpy(code + write, obj->code + read, obj->size - read);
+  write += obj->size - read;
+
+  free(obj->code);
+  obj->code = code;
+  obj->size = write;
+  result = 0;
+
+on_cleanup:
+  free(events);
+  free(shiftBefore);
+  free(isShort);
+  return result;
+}
+
 /**
  * Receives a buffer written with machine code and patches jump offsets to
  * correct locations
  *
  * @param code writable buffer
  * @param lt pointer to a line table struct
+ * @param lines amount of entries in `lt`
  * @param rt pointer to a relocation table struct
  * @param relocCount pointer to a counter for tracking lines with jumps
  *
  * @returns 0 on success, -1 on failure
  */
-char sbasLink(unsigned char* code, LineTable* lt, RelocationTable* rt, int* relocCount) {
+char sbasLink(unsigned char* code, LineTable* lt, unsigned lines, RelocationTable* rt, int* relocCount) {
   for (int i = 0; i < *relocCount; i++) {
     /**
      * The current plead for writing a jump at `offsetToPatch` to `targetLine`
      */
     RelocationTable relocationRequest = rt[i];
     int offsetToPatch = relocationRequest.offset;
-    const unsigned targetLine = relocationRequest.targetLine;
+    const unsigned targetLine = relocationRequest.kind != RELOC_COUNTER ? relocationRequest.targetLine : 0;
+    const int placeholderSize = relocationRequest.kind == RELOC_SHORT_JUMP ? 1 : 4;
     const unsigned targetOffset = relocationRequest.targetOffset;
 
-    // Look up the target in the LineTable
-    LineTable relocationTarget = lt[targetLine];
+    // Look up the target in the LineTable, lines past the end of the source don't exist
+    LineTable relocationTarget = targetLine < lines ? lt[targetLine] : (LineTable){0};
     const char lineExists = relocationTarget.line == 0 ? 0 : 1;
     if (!lineExists && !targetOffset) {
       compilationError("sbasLink: jump target is not an executable line", targetLine);
@@ -54,7 +245,7 @@ char sbasLink(unsigned char* code, LineTable* lt, RelocationTable* rt, int* relo
      * In particular, we reach at the "formula":
      * `nextInstructionAddress = offsetToPatch + 4`
      */
-    const int nextInstructionAddress = offsetToPatch + 4;
+    const int nextInstructionAddress = offsetToPatch + placeholderSize;
 
     /**
      * Suppose your code "wants to" jump to a `targetAddress` - here, the
@@ -113,7 +304,73 @@ char sbasLink(unsigned char* code, LineTable* lt, RelocationTable* rt, int* relo
      */
     const int rel32 = targetAddress - nextInstructionAddress;
 
+    // `sbasRelax` only shortens jumps whose offset fits in `rel8`
+    if (placeholderSize == 1) {
+      code[offsetToPatch] = (unsigned char)rel32;
+      continue;
+    }
     emitIntegerInHex(code, &offsetToPatch, rel32);
   }
   return 0;
 }
+
+/**
+ * Length of the `jle rel32` (`0F 8E`) or `jmp rel32` (`E9`) whose offset
+ * `reloc` fills in
+ * @returns 6 or 5, 0 when it's neither and can't be shortened
+ */
+static int jump_length(const unsigned char* code, const RelocationTable* reloc) {
+  if (reloc->kind != RELOC_JUMP || reloc->offset < 1) return 0;
+  if (code[reloc->offset - 1] == 0xE9) return 5;
+  if (reloc->offset >= 2 && code[reloc->offset - 2] == 0x0F && code[reloc->offset - 1] == 0x8E) return 6;
+  return 0;
+}
+
+/**
+ * Offset a jump lands on, as `sbasLink` resolves it
+ * @returns the offset, -1 when the target line doesn't exist (`sbasLink` reports it)
+ */
+static int jump_target(const LineTable* lt, unsigned lines, const RelocationTable* reloc) {
+  if (!reloc->targetLine) return reloc->targetOffset;
+  if (reloc->targetLine >= lines || lt[reloc->targetLine].line == 0) return -1;
+  return lt[reloc->targetLine].offset;
+}
+
+/**
+ * NOP bytes to put before `point` so the code after it is placed as `alignment` asks
+ * @param position where `point` is in the current layout, before any padding of its own
+ * @param jumpSize for `ALIGN_BRANCH`, size of its `jle` in the current layout
+ */
+static int padding(const AlignPoint* point, int position, int jumpSize, const unsigned char* code,
+                   const RelocationTable* rt, const Alignment* alignment) {
+  if (point->kind == ALIGN_LOOP_HEAD) {
+    const int bytes = (alignment->loopBoundary - position % alignment->loopBoundary) % alignment->loopBoundary;
+    return bytes <= alignment->maxLoopPadding ? bytes : 0;
+  }
+
+  // the compare and the `jle` fuse, so they're a single jump to the decoders
+  const RelocationTable* jump = &rt[point->jump];
+  const int end = position + (jump->offset - (jump_length(code, jump) - 4) - point->offset) + jumpSize;
+  if (!alignment->jccErratum || position / 32 == end / 32) return 0;
+  return 32 - position % 32;
+}
+
+/**
+ * Where `position` of the unrelaxed code ends up once the code before it changes
+ * @param shiftBefore bytes added by the events before each one, plus their total
+ */
+static int relaxed_position(const LayoutEvent* events, const int* shiftBefore, int eventCount, int position) {
+  int low = 0;
+  int high = eventCount;
+
+  // the amount of events before `position`
+  while (low < high) {
+    const int middle = (low + high) / 2;
+    if (events[middle].trigger < position) {
+      low = middle + 1;
+    } else {
+      high = middle;
+    }
+  }
+  return position + shiftBefore[low];
+}
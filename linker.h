@@ -3,6 +3,25 @@
 
 #include "types.h"
 
-char sbasLink(unsigned char* code, LineTable* lt, RelocationTable* rt, int* relocCount);
+#define SHORT_JUMP_SIZE 2  // opcode and rel8 of `jle` and `jmp`, once `sbasRelax` shortened them
+
+/**
+ * Where NOPs go in optimized code, see `hostAlignment`
+ *
+ * Fields:
+ * - `loopBoundary`: loop heads start a chunk of this many bytes, a power of two
+ * - `maxLoopPadding`: most NOP bytes a loop head may take, it's left as it is past that
+ * - `jccErratum`: keep compares and their `jle` from crossing or ending a 32-byte chunk
+ */
+typedef struct {
+  int loopBoundary;
+  int maxLoopPadding;
+  char jccErratum;
+} Alignment;
+
+void hostAlignment(Alignment* alignment);
+char sbasRelax(SbasObject* obj, RelocationTable* rt, int relocCount, const AlignPoint* points, int pointCount,
+               const Alignment* alignment);
+char sbasLink(unsigned char* code, LineTable* lt, unsigned lines, RelocationTable* rt, int* relocCount);
 
 #endif
\ No newline at end of file
@@ -1,11 +1,184 @@
+#include <ctype.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 
+#include "aot.h"
+#include "object.h"
+#include "passes.h"
+#include "perf.h"
+#include "profile.h"
 #include "sbas.h"
 #include "utils.h"
 
+static void usage(void) {
+  fprintf(stderr,
+          "usage: ./sbas [-O level] [-a] [-C cachedir] [-i] [-p] [-P folded] <file.sbas> <param1> <param2> <param3>\n");
+  fprintf(stderr, "       ./sbas [-O level] [-a] -c <out.o> [-s symbol] <file.sbas>\n");
+}
+
+/**
+ * Turns the base name of `filename`, minus its extension, into a C identifier:
+ * `dir/add-one.sbas` becomes `add_one`
+ * @returns a heap string, `NULL` on failure
+ */
+static char* symbol_from_filename(const char* filename) {
+  const char* base = strrchr(filename, '/');
+  base = base ? base + 1 : filename;
+  const char* dot = strrchr(base, '.');
+  size_t len = dot && dot != base ? (size_t)(dot - base) : strlen(base);
+
+  char* symbol = malloc(len + 2);
+  if (!symbol) return NULL;
+
+  char* out = symbol;
+  if (len == 0 || isdigit((unsigned char)base[0])) {
+    *out++ = '_';
+  }
+  for (size_t i = 0; i < len; i++) {
+    *out++ = isalnum((unsigned char)base[i]) ? base[i] : '_';
+  }
+  *out = '\0';
+  return symbol;
+}
+
+/**
+ * Translates the SBas file at `fp` and writes it to the ELF object `objectPath`
+ * @returns 0 on success, -1 on failure
+ */
+static int write_object(FILE* fp, const char* filename, const char* objectPath, const char* symbolName,
+                        const CompileOptions* options) {
+  SbasObject obj = {0};
+  size_t len = 0;
+  int result = -1;
+
+  char* symbol = symbolName ? strdup(symbolName) : symbol_from_filename(filename);
+  char* src = readSource(fp, &len);
+  if (!symbol || !src || sbasTranslateWithOptions(src, len, options, &obj) == -1) {
+    goto on_cleanup;
+  }
+  result = sbasWriteObject(objectPath, symbol, &obj);
+
+on_cleanup:
+  sbasFreeObject(&obj);
+  free(src);
+  free(symbol);
+  return result;
+}
+
+/**
+ * Prints how many times each line of an instrumented function ran,
+ * skipping the lines that never did
+ */
+static void print_line_counts(funcp sbasFunction) {
+  unsigned lines = sbasReadLineCounters(sbasFunction, NULL, 0);
+  unsigned long long* counts = malloc(lines * sizeof(unsigned long long));
+  if (!counts) return;
+
+  sbasReadLineCounters(sbasFunction, counts, lines);
+  for (unsigned line = 1; line < lines; line++) {
+    if (counts[line]) {
+      printf("line %u: %llu\n", line, counts[line]);
+    }
+  }
+  free(counts);
+}
+
+/**
+ * Prints the flat profile of the run and writes its folded stacks to `foldedPath`
+ * @returns 0 on success, -1 on failure
+ */
+static int write_profile(const char* foldedPath) {
+  FILE* folded = fopen(foldedPath, "w");
+  if (!folded) {
+    fprintf(stderr, "failed to open profile file: %s\n", foldedPath);
+    return -1;
+  }
+
+  int result = sbasProfileWrite(stdout, folded);
+  fclose(folded);
+  sbasProfileDiscard();
+  return result;
+}
+
+/**
+ * Compiles the SBas file at `fp` as told by `options`, going through a code
+ * cache file in `cacheDir` named after the source hash when one is given
+ */
+static funcp compile(FILE* fp, const char* cacheDir, const CompileOptions* options) {
+  if (!cacheDir && !options->instrument && options->optLevel == 0) {
+    return sbasCompile(fp);
+  }
+
+  size_t len = 0;
+  char* src = readSource(fp, &len);
+  if (!src) {
+    return NULL;
+  }
+
+  funcp sbasFunction;
+  if (cacheDir) {
+    char path[4096];
+    const char* padding = optionsKey(options->optLevel, options->noAlign) != options->optLevel ? "-a" : "";
+    snprintf(path, sizeof(path), "%s/%016llx-O%d%s.sbasc", cacheDir, hashBytes(src, len), options->optLevel, padding);
+    sbasFunction = sbasCompileCached(path, src, len, options);
+  } else {
+    sbasFunction = sbasCompileWithOptions(src, len, options);
+  }
+  free(src);
+  return sbasFunction;
+}
+
 int main(int argc, char* argv[]) {
-  if (argc < 2 || argc > 5) {
-    fprintf(stderr, "usage: ./sbas <file.sbas> <param1> <param2> <param3>\n");
+  const char* cacheDir = NULL;
+  const char* objectPath = NULL;
+  const char* symbolName = NULL;
+  const char* profilePath = NULL;
+  CompileOptions options = {0};
+  int opt;
+
+  // stop at the file name so negative parameters aren't taken for options
+  while ((opt = getopt(argc, argv, "+aC:c:iO:pP:s:")) != -1) {
+    switch (opt) {
+      case 'a':
+        options.noAlign = 1;
+        break;
+      case 'C':
+        cacheDir = optarg;
+        break;
+      case 'c':
+        objectPath = optarg;
+        break;
+      case 'i':
+        options.instrument = 1;
+        break;
+      case 'O':
+        options.optLevel = atoi(optarg);
+        if (options.optLevel < 0 || options.optLevel > OPT_MAX_LEVEL) {
+          usage();
+          return -1;
+        }
+        break;
+      case 'p':
+        sbasPerfEnable(PERF_MAP | PERF_JITDUMP);
+        break;
+      case 'P':
+        profilePath = optarg;
+        break;
+      case 's':
+        symbolName = optarg;
+        break;
+      default:
+        usage();
+        return -1;
+    }
+  }
+  argc -= optind - 1;
+  argv += optind - 1;
+
+  if (argc < 2 || argc > 5 || (objectPath && argc != 2)) {
+    usage();
     return -1;
   }
 
@@ -22,7 +195,22 @@ int main(int argc, char* argv[]) {
     return -1;
   }
 
-  sbasFunction = sbasCompile(fp);
+  if (objectPath) {
+    res = write_object(fp, filename, objectPath, symbolName, &options);
+    if (res == -1) {
+      fprintf(stderr, "failed to compile sbas file: %s\n", filename);
+    }
+    fclose(fp);
+    return res;
+  }
+
+  // functions are only mapped back to lines if compiled while sampling
+  if (profilePath && sbasProfileStart(0) == -1) {
+    fclose(fp);
+    return -1;
+  }
+
+  sbasFunction = compile(fp, cacheDir, &options);
   if (!sbasFunction) {
     fprintf(stderr, "failed to compile sbas file: %s\n", filename);
     fclose(fp);
@@ -51,8 +239,16 @@ int main(int argc, char* argv[]) {
   }
 
   printf("SBas function at %s returned %d\n", filename, res);
+  if (options.instrument) {
+    print_line_counts(sbasFunction);
+  }
+  if (profilePath) {
+    sbasProfileStop();
+    write_profile(profilePath);
+  }
 
   sbasCleanup(sbasFunction);
+  sbasPerfDisable();
   fclose(fp);
   return 0;
 }
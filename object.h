@@ -0,0 +1,22 @@
+#ifndef OBJECT_H
+#define OBJECT_H
+
+#include "types.h"
+
+/**
+ * Writes a translated SBas function as an ELF64 relocatable object, so it can
+ * be linked into a C program ahead of time, e.g. with
+ * `gcc main.c foo.o` and declared there as `int foo(int, int, int);`.
+ *
+ * The object holds a single `.text` section with a global function symbol and
+ * an empty `.note.GNU-stack`, keeping the stack of the final binary
+ * non-executable. SBas jumps never leave the function and are already resolved
+ * by `sbasLink`, so no relocations are needed.
+ * @param path the object file to write
+ * @param symbol name of the function symbol
+ * @param obj the object filled in by `sbasTranslate`
+ * @returns 0 on success, -1 on failure
+ */
+int sbasWriteObject(const char* path, const char* symbol, const SbasObject* obj);
+
+#endif
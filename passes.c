@@ -0,0 +1,456 @@
+#include "passes.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "config.h"
+
+/**
+ * An optimization pass
+ *
+ * Fields:
+ * - `name`: what debug builds report it as
+ * - `level`: lowest optimization level running it
+ * - `run`: rewrites the function, returning 1 if it changed anything,
+ *   0 if not and -1 on failure
+ */
+typedef struct {
+  const char* name;
+  int level;
+  int (*run)(IrFunction* ir);
+} Pass;
+
+/**
+ * What a pass knows about a variable at some point of the function
+ */
+typedef enum {
+  VALUE_VARYING,  // depends on the parameters, on the path taken or on the caller
+  VALUE_CONST,    // holds `Value.constant` on every path
+} ValueKind;
+
+typedef struct {
+  unsigned char kind;
+  int constant;
+} Value;
+
+static int propagate_constants(IrFunction* ir);
+static int remove_unreachable_blocks(IrFunction* ir);
+static int remove_dead_stores(IrFunction* ir);
+static unsigned char live_out(const IrFunction* ir, unsigned block, const unsigned char* liveIn);
+static unsigned char live_before(const IrOp* op, unsigned char live);
+static Value value_of(const Value vars[IR_VAR_COUNT + 1], Operand operand);
+static int is_constant(Operand operand, int constant);
+static Value evaluate(const Value vars[IR_VAR_COUNT + 1], const IrOp* op);
+static int merge_values(Value into[IR_VAR_COUNT + 1], const Value from[IR_VAR_COUNT + 1]);
+
+// the pipeline, in the order passes run
+static const Pass PASSES[] = {
+    {"constants", 1, propagate_constants},
+    {"unreachable-blocks", 1, remove_unreachable_blocks},
+    {"dead-stores", 1, remove_dead_stores},
+};
+
+/**
+ * Runs every pass of `level` in pipeline order; -O2 reruns the pipeline as
+ * long as a pass keeps finding something, up to `OPT_MAX_ROUNDS` times
+ */
+int irOptimize(IrFunction* ir, int level) {
+  const int passCount = sizeof(PASSES) / sizeof(PASSES[0]);
+  const int rounds = level >= 2 ? OPT_MAX_ROUNDS : 1;
+
+  for (int round = 0; round < rounds; round++) {
+    int changed = 0;
+
+    for (int i = 0; i < passCount; i++) {
+      if (PASSES[i].level > level) continue;
+
+      int passRet = PASSES[i].run(ir);
+      if (passRet == -1) {
+        fprintf(stderr, "irOptimize: pass %s failed.\n", PASSES[i].name);
+        return -1;
+      }
+      changed |= passRet;
+
+#ifdef DEBUG
+      if (passRet) {
+        printf("irOptimize: %s changed the function\n", PASSES[i].name);
+        irPrint(ir);
+      }
+#endif
+    }
+
+    if (!changed) break;
+  }
+  return 0;
+}
+
+/**
+ * Finds the variables holding a known constant wherever they're read, following
+ * only the edges of `iflez` whose outcome isn't known, and rewrites the function
+ * with them: reads become immediates, operations on constants or leaving an
+ * operand as is become a single move, and a known `iflez` becomes a jump or disappears
+ */
+static int propagate_constants(IrFunction* ir) {
+  const unsigned stride = IR_VAR_COUNT + 1;  // variables are indexed from 1
+  Value* in = calloc((size_t)ir->blockCount * stride, sizeof(Value));  // variables when each block starts
+  char* reached = calloc(ir->blockCount, sizeof(char));
+  char* queued = calloc(ir->blockCount, sizeof(char));
+  unsigned* work = malloc(ir->blockCount * sizeof(unsigned));
+  unsigned depth = 0;
+  int result = -1;
+
+  if (!in || !reached || !queued || !work) {
+    fprintf(stderr, "propagate_constants: failed to alloc work lists.\n");
+    goto on_cleanup;
+  }
+
+  // zeroed values are varying, as variables nothing wrote yet hold whatever
+  // the caller left in their registers
+  reached[0] = queued[0] = 1;
+  work[depth++] = 0;
+
+  while (depth > 0) {
+    const unsigned b = work[--depth];
+    const IrBlock* block = &ir->blocks[b];
+    Value vars[IR_VAR_COUNT + 1];
+    unsigned successors[2];
+    unsigned count;
+
+    queued[b] = 0;
+    memcpy(vars, &in[b * stride], sizeof(vars));
+    for (unsigned i = block->first; i < block->first + block->count; i++) {
+      const IrOp* op = &ir->ops[i];
+      if (op->dest) {
+        vars[op->dest] = evaluate(vars, op);
+      }
+    }
+
+    const IrOp* last = block->count ? &ir->ops[block->first + block->count - 1] : NULL;
+    const Value condition = last && last->opcode == IR_JLEZ ? value_of(vars, last->a) : (Value){VALUE_VARYING, 0};
+    if (condition.kind == VALUE_CONST) {
+      // a single way out: the jump or the fall through
+      successors[0] = condition.constant <= 0 ? last->target : b + 1;
+      count = successors[0] < ir->blockCount;
+    } else {
+      count = irSuccessors(ir, b, successors);
+    }
+
+    for (unsigned i = 0; i < count; i++) {
+      const unsigned s = successors[i];
+      int changed = 1;
+      if (!reached[s]) {
+        memcpy(&in[s * stride], vars, sizeof(vars));
+        reached[s] = 1;
+      } else {
+        changed = merge_values(&in[s * stride], vars);
+      }
+      if (changed && !queued[s]) {
+        queued[s] = 1;
+        work[depth++] = s;
+      }
+    }
+  }
+
+  result = 0;
+  for (unsigned b = 0; b < ir->blockCount; b++) {
+    IrBlock* block = &ir->blocks[b];
+    Value vars[IR_VAR_COUNT + 1];
+
+    // never reached: left for unreachable-blocks to delete
+    if (!reached[b]) continue;
+
+    memcpy(vars, &in[b * stride], sizeof(vars));
+    for (unsigned i = block->first; i < block->first + block->count; i++) {
+      IrOp* op = &ir->ops[i];
+      const Value lhs = value_of(vars, op->a);
+      const Value rhs = value_of(vars, op->b);
+
+      if (op->opcode == IR_JLEZ && lhs.kind == VALUE_CONST) {
+        // jumps only end blocks, so dropping one just shortens its block
+        if (lhs.constant > 0 || op->target == b + 1) {
+          block->count--;
+        } else {
+          op->opcode = IR_JMP;
+          op->a = (Operand){0};
+        }
+        result = 1;
+        break;
+      }
+
+      if (op->dest) {
+        const Value folded = evaluate(vars, op);
+        vars[op->dest] = folded;
+
+        if (folded.kind == VALUE_CONST) {
+          if (op->opcode != IR_MOV || op->a.type != '$') {
+            op->opcode = IR_MOV;
+            op->a = (Operand){'$', folded.constant};
+            op->b = (Operand){0};
+            result = 1;
+          }
+          continue;
+        }
+      }
+
+      if (op->a.type == 'v' && lhs.kind == VALUE_CONST) {
+        op->a = (Operand){'$', lhs.constant};
+        result = 1;
+      }
+      if (op->b.type == 'v' && rhs.kind == VALUE_CONST) {
+        op->b = (Operand){'$', rhs.constant};
+        result = 1;
+      }
+
+      // x + 0, 0 + x, x - 0, x * 1 and 1 * x are plain moves
+      const char keepsA = ((op->opcode == IR_ADD || op->opcode == IR_SUB) && is_constant(op->b, 0)) ||
+                          (op->opcode == IR_MUL && is_constant(op->b, 1));
+      const char keepsB = (op->opcode == IR_ADD && is_constant(op->a, 0)) || (op->opcode == IR_MUL && is_constant(op->a, 1));
+      if (keepsA || keepsB) {
+        op->a = keepsA ? op->a : op->b;
+        op->opcode = IR_MOV;
+        op->b = (Operand){0};
+        result = 1;
+      }
+    }
+  }
+
+on_cleanup:
+  free(in);
+  free(reached);
+  free(queued);
+  free(work);
+  return result;
+}
+
+/**
+ * Deletes the blocks no path from the entry reaches, such as code right
+ * after a `ret` that no `iflez` jumps to, or skipped by a known `iflez`
+ */
+static int remove_unreachable_blocks(IrFunction* ir) {
+  char* reachable = calloc(ir->blockCount, sizeof(char));
+  unsigned* stack = malloc(ir->blockCount * sizeof(unsigned));
+  unsigned* newIndex = malloc(ir->blockCount * sizeof(unsigned));
+  unsigned depth = 0;
+  unsigned kept = 0;
+  unsigned opCount = 0;
+  int result = -1;
+
+  if (!reachable || !stack || !newIndex) {
+    fprintf(stderr, "remove_unreachable_blocks: failed to alloc work lists.\n");
+    goto on_cleanup;
+  }
+
+  reachable[0] = 1;
+  stack[depth++] = 0;
+  while (depth > 0) {
+    unsigned successors[2];
+    unsigned count = irSuccessors(ir, stack[--depth], successors);
+
+    for (unsigned i = 0; i < count; i++) {
+      if (!reachable[successors[i]]) {
+        reachable[successors[i]] = 1;
+        stack[depth++] = successors[i];
+      }
+    }
+  }
+
+  // slide the kept blocks and their operations down over the deleted ones
+  for (unsigned b = 0; b < ir->blockCount; b++) {
+    if (!reachable[b]) continue;
+
+    IrBlock block = ir->blocks[b];
+    memmove(&ir->ops[opCount], &ir->ops[block.first], block.count * sizeof(IrOp));
+    block.first = opCount;
+    opCount += block.count;
+
+    newIndex[b] = kept;
+    ir->blocks[kept++] = block;
+  }
+
+  // only reachable blocks jump, and only to reachable blocks
+  result = kept != ir->blockCount;
+  for (unsigned i = 0; result && i < opCount; i++) {
+    if (ir->ops[i].opcode == IR_JLEZ || ir->ops[i].opcode == IR_JMP) {
+      ir->ops[i].target = newIndex[ir->ops[i].target];
+    }
+  }
+  ir->blockCount = kept;
+  ir->opCount = opCount;
+
+  // deleting the blocks in between may leave a jump right before its target
+  for (unsigned b = 0; result && b + 1 < kept; b++) {
+    IrBlock* block = &ir->blocks[b];
+    if (block->count && ir->ops[block->first + block->count - 1].opcode == IR_JMP &&
+        ir->ops[block->first + block->count - 1].target == b + 1) {
+      block->count--;
+    }
+  }
+
+on_cleanup:
+  free(reachable);
+  free(stack);
+  free(newIndex);
+  return result;
+}
+
+/**
+ * Deletes the operations writing a variable no path reads before it's written
+ * again or the function returns, found with a backwards liveness analysis
+ */
+static int remove_dead_stores(IrFunction* ir) {
+  unsigned char* liveIn = calloc(ir->blockCount, sizeof(unsigned char));  // bit v: vX is read before written
+  char* dead = calloc(ir->opCount, sizeof(char));
+  int changed = 1;
+  int result = -1;
+
+  if (!liveIn || !dead) {
+    fprintf(stderr, "remove_dead_stores: failed to alloc liveness sets.\n");
+    goto on_cleanup;
+  }
+
+  // blocks mostly flow forward, so walking them backwards settles quickly
+  while (changed) {
+    changed = 0;
+    for (unsigned b = ir->blockCount; b-- > 0;) {
+      unsigned char live = live_out(ir, b, liveIn);
+      for (unsigned i = ir->blocks[b].first + ir->blocks[b].count; i-- > ir->blocks[b].first;) {
+        live = live_before(&ir->ops[i], live);
+      }
+      changed |= live != liveIn[b];
+      liveIn[b] = live;
+    }
+  }
+
+  result = 0;
+  for (unsigned b = 0; b < ir->blockCount; b++) {
+    IrBlock* block = &ir->blocks[b];
+    unsigned char live = live_out(ir, b, liveIn);
+    unsigned kept = 0;
+
+    for (unsigned i = block->first + block->count; i-- > block->first;) {
+      const IrOp* op = &ir->ops[i];
+      const char isSelfMove = op->opcode == IR_MOV && op->a.type == 'v' && op->a.value == op->dest;
+
+      dead[i] = op->dest && (isSelfMove || !(live & (1u << op->dest)));
+      if (!dead[i]) {
+        live = live_before(op, live);
+      }
+    }
+
+    for (unsigned i = block->first; i < block->first + block->count; i++) {
+      if (!dead[i]) {
+        ir->ops[block->first + kept++] = ir->ops[i];
+      }
+    }
+    result |= kept != block->count;
+    block->count = kept;
+  }
+
+on_cleanup:
+  free(liveIn);
+  free(dead);
+  return result;
+}
+
+/**
+ * Gathers the variables read before being written on some path out of block
+ * `block`, as bit `v` for `vX`
+ */
+static unsigned char live_out(const IrFunction* ir, unsigned block, const unsigned char* liveIn) {
+  unsigned successors[2];
+  unsigned count = irSuccessors(ir, block, successors);
+  unsigned char live = 0;
+
+  for (unsigned i = 0; i < count; i++) {
+    live |= liveIn[successors[i]];
+  }
+  return live;
+}
+
+/**
+ * Works out the variables live right before `op` from those live after it
+ */
+static unsigned char live_before(const IrOp* op, unsigned char live) {
+  if (op->dest) {
+    live &= ~(1u << op->dest);
+  }
+  if (op->a.type == 'v') {
+    live |= 1u << op->a.value;
+  }
+  if (op->b.type == 'v') {
+    live |= 1u << op->b.value;
+  }
+  return live;
+}
+
+/**
+ * Looks up what's known about an operand
+ */
+static Value value_of(const Value vars[IR_VAR_COUNT + 1], Operand operand) {
+  switch (operand.type) {
+    case '$':
+      return (Value){VALUE_CONST, operand.value};
+    case 'v':
+      return vars[operand.value];
+    default:
+      return (Value){VALUE_VARYING, 0};
+  }
+}
+
+/**
+ * Tells whether an operand is the immediate `constant`
+ */
+static int is_constant(Operand operand, int constant) { return operand.type == '$' && operand.value == constant; }
+
+/**
+ * Works out what an operation writes to its destination. Arithmetic wraps
+ * around like the 32-bit instructions it's emitted as
+ */
+static Value evaluate(const Value vars[IR_VAR_COUNT + 1], const IrOp* op) {
+  const Value a = value_of(vars, op->a);
+  const Value b = value_of(vars, op->b);
+
+  if (op->opcode == IR_MOV) {
+    return a;
+  }
+  // x - x and x * 0 don't depend on x
+  if (op->opcode == IR_SUB && op->a.type == 'v' && op->b.type == 'v' && op->a.value == op->b.value) {
+    return (Value){VALUE_CONST, 0};
+  }
+  if (op->opcode == IR_MUL && ((a.kind == VALUE_CONST && a.constant == 0) || (b.kind == VALUE_CONST && b.constant == 0))) {
+    return (Value){VALUE_CONST, 0};
+  }
+  if (a.kind != VALUE_CONST || b.kind != VALUE_CONST) {
+    return (Value){VALUE_VARYING, 0};
+  }
+
+  const unsigned x = (unsigned)a.constant;
+  const unsigned y = (unsigned)b.constant;
+  switch (op->opcode) {
+    case IR_ADD:
+      return (Value){VALUE_CONST, (int)(x + y)};
+    case IR_SUB:
+      return (Value){VALUE_CONST, (int)(x - y)};
+    default:
+      return (Value){VALUE_CONST, (int)(x * y)};
+  }
+}
+
+/**
+ * Meets the variables of one more path into a block's: a variable stays
+ * constant only if it holds the same constant on both
+ * @returns 1 if what's known at the block got less precise, 0 if not
+ */
+static int merge_values(Value into[IR_VAR_COUNT + 1], const Value from[IR_VAR_COUNT + 1]) {
+  int changed = 0;
+
+  for (unsigned v = 1; v <= IR_VAR_COUNT; v++) {
+    if (into[v].kind == VALUE_VARYING) continue;
+    if (from[v].kind == VALUE_CONST && from[v].constant == into[v].constant) continue;
+
+    into[v].kind = VALUE_VARYING;
+    changed = 1;
+  }
+  return changed;
+}
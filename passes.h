@@ -0,0 +1,19 @@
+#ifndef PASSES_H
+#define PASSES_H
+
+#include "ir.h"
+
+#define OPT_MAX_LEVEL 2     // highest optimization level, -O2
+#define OPT_MAX_ROUNDS 8    // times -O2 reruns the pipeline looking for more to improve
+#define OPT_ALIGN_LEVEL 2   // lowest level padding loop heads and branches, see `CompileOptions.noAlign`
+
+/**
+ * Runs the optimization passes of a level over a function
+ * @param ir function built by `irBuild`
+ * @param level 1 runs every pass once, 2 reruns them while any of them
+ * still improves the function
+ * @returns 0 on success, -1 on failure
+ */
+int irOptimize(IrFunction* ir, int level);
+
+#endif
@@ -0,0 +1,303 @@
+#include "perf.h"
+
+#include <elf.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "profile.h"
+#include "utils.h"
+
+#define JITDUMP_MAGIC 0x4A695444  // "JiTD" read as a little endian integer
+#define JITDUMP_VERSION 1
+#define JIT_CODE_LOAD 0
+#define JIT_CODE_DEBUG_INFO 2
+
+/**
+ * Layouts of the jitdump format, see tools/perf/Documentation/jitdump-specification.txt
+ * in the Linux sources
+ */
+typedef struct {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t totalSize;  // size of this header
+  uint32_t elfMach;
+  uint32_t pad1;
+  uint32_t pid;
+  uint64_t timestamp;
+  uint64_t flags;
+} JitdumpHeader;
+
+typedef struct {
+  uint32_t id;
+  uint32_t totalSize;  // size of the record, header included
+  uint64_t timestamp;
+} JitdumpRecord;
+
+// followed by the NUL-terminated function name and the code
+typedef struct {
+  JitdumpRecord record;
+  uint32_t pid;
+  uint32_t tid;
+  uint64_t vma;
+  uint64_t codeAddr;
+  uint64_t codeSize;
+  uint64_t codeIndex;
+} JitdumpCodeLoad;
+
+// followed by `entryCount` entries
+typedef struct {
+  JitdumpRecord record;
+  uint64_t codeAddr;
+  uint64_t entryCount;
+} JitdumpDebugInfo;
+
+// followed by the NUL-terminated source file name
+typedef struct {
+  uint64_t codeAddr;
+  uint32_t line;
+  uint32_t discriminator;
+} JitdumpDebugEntry;
+
+static struct {
+  pthread_mutex_t lock;
+  atomic_uint modes;  // modes being written, read without the lock on every compile
+  FILE* map;
+  FILE* jitdump;
+  void* marker;  // executable mapping of the jitdump, how perf finds the file
+  size_t markerSize;
+  uint64_t codeIndex;
+  atomic_uint files;  // perf files opened so far, each of which needs functions described anew
+} perf = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+static int open_jitdump(void);
+static void write_debug_info(funcp code, const LineTable* lt, unsigned lines, const char* sourcePath);
+static void write_code_load(funcp code, int size, const char* name);
+static void save_source(const char* path, const char* src, size_t len);
+static uint64_t timestamp(void);
+
+/**
+ * Opens the files of the requested modes
+ */
+int sbasPerfEnable(unsigned modes) {
+  char path[64];
+  int result = 0;
+
+  pthread_mutex_lock(&perf.lock);
+
+  if ((modes & PERF_MAP) && !perf.map) {
+    snprintf(path, sizeof(path), "%s/perf-%d.map", PERF_DIR, (int)getpid());
+    perf.map = fopen(path, "a");
+    if (!perf.map) {
+      fprintf(stderr, "sbasPerfEnable: failed to open %s.\n", path);
+      modes &= ~PERF_MAP;
+      result = -1;
+    } else {
+      atomic_fetch_add(&perf.files, 1);
+    }
+  }
+
+  if ((modes & PERF_JITDUMP) && !perf.jitdump) {
+    if (open_jitdump() == -1) {
+      modes &= ~PERF_JITDUMP;
+      result = -1;
+    } else {
+      atomic_fetch_add(&perf.files, 1);
+    }
+  }
+
+  atomic_store(&perf.modes, atomic_load(&perf.modes) | modes);
+  pthread_mutex_unlock(&perf.lock);
+  return result;
+}
+
+/**
+ * Closes every perf file
+ */
+void sbasPerfDisable(void) {
+  pthread_mutex_lock(&perf.lock);
+
+  atomic_store(&perf.modes, 0);
+  if (perf.map) {
+    fclose(perf.map);
+    perf.map = NULL;
+  }
+  if (perf.jitdump) {
+    munmap(perf.marker, perf.markerSize);
+    fclose(perf.jitdump);
+    perf.jitdump = NULL;
+  }
+
+  pthread_mutex_unlock(&perf.lock);
+}
+
+/**
+ * Tells whether compiled functions are being described to perf or the profiler
+ */
+int perfEnabled(void) { return atomic_load_explicit(&perf.modes, memory_order_relaxed) != 0 || profileRunning(); }
+
+/**
+ * Changes whenever a perf file is opened or the profiler starts, so a function
+ * described under an older value has to be described again to show up
+ */
+unsigned perfGeneration(void) { return atomic_load(&perf.files) + profileRuns(); }
+
+/**
+ * Describes a compiled function to perf and to the profiler, when enabled
+ * @param code entry point of the function
+ * @param size bytes of machine code at `code`
+ * @param lt line table of the function, `NULL` if unknown
+ * @param lines entries in `lt`
+ * @param src source the function was compiled from
+ * @param len bytes in `src`
+ */
+void perfRecordCode(funcp code, int size, const LineTable* lt, unsigned lines, const char* src, size_t len) {
+  profileRecordCode(code, size, lt, lines, src, len);
+  if (!atomic_load_explicit(&perf.modes, memory_order_relaxed)) return;
+
+  char name[32];
+  char sourcePath[64];
+  unsigned long long hash = hashBytes(src, len);
+  snprintf(name, sizeof(name), "sbas_%016llx", hash);
+  snprintf(sourcePath, sizeof(sourcePath), "%s/sbas-%016llx.sbas", PERF_DIR, hash);
+
+  pthread_mutex_lock(&perf.lock);
+
+  if (perf.map) {
+    fprintf(perf.map, "%lx %x %s\n", (unsigned long)code, size, name);
+    fflush(perf.map);
+  }
+
+  if (perf.jitdump) {
+    // perf wants the line table of a function before its code
+    if (lt) {
+      save_source(sourcePath, src, len);
+      write_debug_info(code, lt, lines, sourcePath);
+    }
+    write_code_load(code, size, name);
+    fflush(perf.jitdump);
+  }
+
+  pthread_mutex_unlock(&perf.lock);
+}
+
+/**
+ * Creates the jitdump, writes its header and maps it executable: perf only
+ * picks up jitdumps it saw being mmap'd with PROT_EXEC
+ * @returns 0 on success, -1 on failure
+ */
+static int open_jitdump(void) {
+  char path[64];
+  snprintf(path, sizeof(path), "%s/jit-%d.dump", PERF_DIR, (int)getpid());
+
+  int fd = open(path, O_CREAT | O_TRUNC | O_RDWR | O_CLOEXEC, 0666);
+  if (fd == -1) {
+    fprintf(stderr, "open_jitdump: failed to create %s.\n", path);
+    return -1;
+  }
+
+  perf.markerSize = sysconf(_SC_PAGESIZE);
+  perf.marker = mmap(NULL, perf.markerSize, PROT_READ | PROT_EXEC, MAP_PRIVATE, fd, 0);
+  perf.jitdump = perf.marker != MAP_FAILED ? fdopen(fd, "w") : NULL;
+  if (!perf.jitdump) {
+    fprintf(stderr, "open_jitdump: failed to map %s.\n", path);
+    if (perf.marker != MAP_FAILED) munmap(perf.marker, perf.markerSize);
+    close(fd);
+    return -1;
+  }
+
+  JitdumpHeader header = {0};
+  header.magic = JITDUMP_MAGIC;
+  header.version = JITDUMP_VERSION;
+  header.totalSize = sizeof(header);
+  header.elfMach = EM_X86_64;
+  header.pid = getpid();
+  header.timestamp = timestamp();
+  fwrite(&header, sizeof(header), 1, perf.jitdump);
+  fflush(perf.jitdump);
+  return 0;
+}
+
+/**
+ * Writes a debug info record mapping the start of every executable line of
+ * the function to its source line
+ */
+static void write_debug_info(funcp code, const LineTable* lt, unsigned lines, const char* sourcePath) {
+  size_t pathSize = strlen(sourcePath) + 1;
+  uint64_t entryCount = 0;
+  for (unsigned line = 1; line < lines; line++) {
+    if (lt[line].line == line) entryCount++;
+  }
+  if (entryCount == 0) return;
+
+  JitdumpDebugInfo info = {0};
+  info.record.id = JIT_CODE_DEBUG_INFO;
+  info.record.totalSize = sizeof(info) + entryCount * (sizeof(JitdumpDebugEntry) + pathSize);
+  info.record.timestamp = timestamp();
+  info.codeAddr = (uint64_t)code;
+  info.entryCount = entryCount;
+  fwrite(&info, sizeof(info), 1, perf.jitdump);
+
+  // offsets grow with line numbers, so entries come out sorted by address as perf expects
+  for (unsigned line = 1; line < lines; line++) {
+    if (lt[line].line != line) continue;
+
+    JitdumpDebugEntry entry = {0};
+    entry.codeAddr = (uint64_t)code + lt[line].offset;
+    entry.line = line;
+    fwrite(&entry, sizeof(entry), 1, perf.jitdump);
+    fwrite(sourcePath, pathSize, 1, perf.jitdump);
+  }
+}
+
+/**
+ * Writes a code load record holding a copy of the function's machine code
+ */
+static void write_code_load(funcp code, int size, const char* name) {
+  size_t nameSize = strlen(name) + 1;
+
+  JitdumpCodeLoad load = {0};
+  load.record.id = JIT_CODE_LOAD;
+  load.record.totalSize = sizeof(load) + nameSize + size;
+  load.record.timestamp = timestamp();
+  load.pid = getpid();
+  load.tid = syscall(SYS_gettid);
+  load.vma = (uint64_t)code;
+  load.codeAddr = (uint64_t)code;
+  load.codeSize = size;
+  load.codeIndex = perf.codeIndex++;
+
+  fwrite(&load, sizeof(load), 1, perf.jitdump);
+  fwrite(name, nameSize, 1, perf.jitdump);
+  fwrite((const void*)code, size, 1, perf.jitdump);
+}
+
+/**
+ * Saves the source a function was compiled from for perf to show next to its
+ * samples. Sources are named after their hash, so each is written once.
+ */
+static void save_source(const char* path, const char* src, size_t len) {
+  int fd = open(path, O_CREAT | O_EXCL | O_WRONLY | O_CLOEXEC, 0644);
+  if (fd == -1) return;  // already saved, or nowhere to save it: perf just shows no source
+
+  if (write(fd, src, len) != (ssize_t)len) {
+    fprintf(stderr, "save_source: failed to write %s.\n", path);
+  }
+  close(fd);
+}
+
+/**
+ * Reads the clock `perf record -k mono` stamps samples with
+ */
+static uint64_t timestamp(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
@@ -0,0 +1,35 @@
+#ifndef PERF_H
+#define PERF_H
+#include <stddef.h>
+
+#include "types.h"
+
+#define PERF_DIR "/tmp"  // where perf looks for perf-<pid>.map, and where jit-<pid>.dump goes
+
+#define PERF_MAP 1      // write `/tmp/perf-<pid>.map`, read by `perf top` and `perf report`
+#define PERF_JITDUMP 2  // write `/tmp/jit-<pid>.dump`, merged into a recording by `perf inject --jit`
+
+/**
+ * Starts describing every function compiled from now on to perf, so samples
+ * in SBas code are attributed to a `sbas_<source hash>` symbol instead of an
+ * anonymous address.
+ *
+ * The jitdump also carries the line table of each function, pointing at a copy
+ * of its source saved as `/tmp/sbas-<source hash>.sbas`, so `perf report` and
+ * `perf annotate` can attribute samples to single SBas lines. Record with
+ * `perf record -k mono` for its timestamps to line up.
+ * @param modes `PERF_MAP`, `PERF_JITDUMP` or both
+ * @returns 0 on success, -1 if a file couldn't be created
+ */
+int sbasPerfEnable(unsigned modes);
+
+/**
+ * Stops describing new functions and closes the perf files
+ */
+void sbasPerfDisable(void);
+
+int perfEnabled(void);
+unsigned perfGeneration(void);
+void perfRecordCode(funcp code, int size, const LineTable* lt, unsigned lines, const char* src, size_t len);
+
+#endif
@@ -0,0 +1,565 @@
+#define _GNU_SOURCE
+#include "profile.h"
+
+#include <dlfcn.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <ucontext.h>
+
+#include "utils.h"
+
+#define FUNCTION_CHUNK 1024  // functions per registry chunk, chunks never move once allocated
+#define FRAME_SETUP 4        // bytes of the `push %rbp; mov %rsp, %rbp` opening every -O0 SBas function
+#define OP_PUSH_RBP 0x55
+#define OP_PUSH_RD 0x50      // plus the register id
+#define OP_POP_RD 0x58       // plus the register id
+#define OP_RET 0xC3
+#define MAX_STACK_NAME 256  // longest row of the folded stacks
+#define MAX_LINE_NAME 64    // longest row of the flat profile, `function:line`
+
+/**
+ * A SBas function samples can land in
+ *
+ * Fields:
+ * - `start`, `end`: bounds of its machine code
+ * - `lines`: copy of its executable lines, ordered by offset
+ * - `lineCount`: amount of entries in `lines`
+ * - `name`: the symbol perf knows it by, `sbas_<source hash>`
+ */
+typedef struct {
+  uintptr_t start;
+  uintptr_t end;
+  LineTable* lines;
+  unsigned lineCount;
+  char name[32];
+} ProfiledFunction;
+
+/**
+ * A slot of the sample ring, written by the signal handler and read
+ * concurrently by `sbasProfileWrite`, which skips slots being rewritten
+ */
+typedef struct {
+  atomic_uint_fast64_t seq;  // 1 + number of the sample held, 0 while being written
+  atomic_uintptr_t rip;
+  atomic_uintptr_t caller;  // return address of the SBas function, 0 if unknown
+  atomic_int function;      // registry index, -1 outside SBas code
+} Sample;
+
+/**
+ * A sample as read back from the ring
+ */
+typedef struct {
+  uintptr_t rip;
+  uintptr_t caller;
+  int function;
+} SampleCopy;
+
+/**
+ * A distinct line of a report and the samples behind it
+ */
+typedef struct {
+  const char* key;
+  size_t samples;
+} Row;
+
+static struct {
+  pthread_mutex_t lock;  // serializes registrations, starting, stopping and discarding
+  atomic_int running;
+  atomic_uint runs;  // times the profiler started, functions registered in earlier runs were dropped
+  ProfiledFunction* _Atomic chunks[PROFILE_MAX_FUNCTIONS / FUNCTION_CHUNK];
+  atomic_int functionCount;
+  atomic_uintptr_t low;  // bounds of every registered function, rejects host samples cheaply
+  atomic_uintptr_t high;
+  Sample* samples;
+  atomic_uint_fast64_t sampleCount;  // samples ever taken
+  struct sigaction previous;
+} profile = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+static void on_sigprof(int sig, siginfo_t* info, void* context);
+static int find_function(uintptr_t rip);
+static uintptr_t return_address(const ProfiledFunction* function, uintptr_t rip, const ucontext_t* uc);
+static int push_pop_size(const unsigned char* at, unsigned char opcode);
+static ProfiledFunction* function_at(int index);
+static unsigned line_at(const ProfiledFunction* function, uintptr_t rip);
+static void symbol_name(uintptr_t address, char* name, size_t size);
+static int write_rows(FILE* out, char** keys, size_t count, char byCount);
+static int compare_keys(const void* a, const void* b);
+static int compare_rows(const void* a, const void* b);
+static void free_functions(void);
+
+/**
+ * Drops the previous run, installs the `SIGPROF` handler and arms the timer
+ */
+int sbasProfileStart(unsigned hz) {
+  struct sigaction action = {0};
+  struct itimerval timer = {0};
+  int result = -1;
+
+  if (hz == 0) {
+    hz = PROFILE_DEFAULT_HZ;
+  }
+
+  pthread_mutex_lock(&profile.lock);
+
+  if (atomic_load(&profile.running)) {
+    fprintf(stderr, "sbasProfileStart: the profiler is already running.\n");
+    goto on_cleanup;
+  }
+
+  free_functions();
+  free(profile.samples);
+  profile.samples = calloc(PROFILE_MAX_SAMPLES, sizeof(Sample));
+  if (!profile.samples) {
+    fprintf(stderr, "sbasProfileStart: failed to alloc samples.\n");
+    goto on_cleanup;
+  }
+  atomic_store(&profile.sampleCount, 0);
+
+  action.sa_sigaction = on_sigprof;
+  action.sa_flags = SA_SIGINFO | SA_RESTART;
+  sigemptyset(&action.sa_mask);
+  if (sigaction(SIGPROF, &action, &profile.previous) != 0) {
+    fprintf(stderr, "sbasProfileStart: failed to install the SIGPROF handler.\n");
+    goto on_cleanup;
+  }
+
+  // functions compiled from now on register themselves
+  atomic_store(&profile.running, 1);
+  atomic_fetch_add(&profile.runs, 1);
+
+  // setitimer wants the microseconds below a second
+  timer.it_interval.tv_sec = hz == 1 ? 1 : 0;
+  timer.it_interval.tv_usec = hz == 1 ? 0 : hz > 1000000 ? 1 : 1000000 / hz;
+  timer.it_value = timer.it_interval;
+  if (setitimer(ITIMER_PROF, &timer, NULL) != 0) {
+    fprintf(stderr, "sbasProfileStart: failed to arm the profiling timer.\n");
+    atomic_store(&profile.running, 0);
+    sigaction(SIGPROF, &profile.previous, NULL);
+    goto on_cleanup;
+  }
+  result = 0;
+
+on_cleanup:
+  pthread_mutex_unlock(&profile.lock);
+  return result;
+}
+
+/**
+ * Disarms the timer and restores the previous `SIGPROF` action
+ */
+void sbasProfileStop(void) {
+  struct itimerval timer = {0};
+
+  pthread_mutex_lock(&profile.lock);
+
+  if (atomic_load(&profile.running)) {
+    setitimer(ITIMER_PROF, &timer, NULL);
+    atomic_store(&profile.running, 0);
+
+    // a signal still in flight must not terminate the process
+    if (!(profile.previous.sa_flags & SA_SIGINFO) && profile.previous.sa_handler == SIG_DFL) {
+      profile.previous.sa_handler = SIG_IGN;
+    }
+    sigaction(SIGPROF, &profile.previous, NULL);
+  }
+
+  pthread_mutex_unlock(&profile.lock);
+}
+
+/**
+ * Copies the kept samples out of the ring, names them and writes both reports
+ */
+int sbasProfileWrite(FILE* flat, FILE* folded) {
+  SampleCopy* copies = NULL;
+  char** flatKeys = NULL;
+  char** foldedKeys = NULL;
+  size_t count = 0;
+  size_t inSbas = 0;
+  int result = -1;
+
+  pthread_mutex_lock(&profile.lock);
+
+  const uint_fast64_t taken = atomic_load(&profile.sampleCount);
+  const uint_fast64_t first = taken > PROFILE_MAX_SAMPLES ? taken - PROFILE_MAX_SAMPLES : 0;
+
+  copies = calloc(taken - first + 1, sizeof(SampleCopy));
+  flatKeys = calloc(taken - first + 1, sizeof(char*));
+  foldedKeys = calloc(taken - first + 1, sizeof(char*));
+  if (!copies || !flatKeys || !foldedKeys) {
+    fprintf(stderr, "sbasProfileWrite: failed to alloc samples.\n");
+    goto on_cleanup;
+  }
+
+  // a slot whose number changed while being copied was overwritten meanwhile
+  for (uint_fast64_t n = first; n < taken && profile.samples; n++) {
+    Sample* sample = &profile.samples[n % PROFILE_MAX_SAMPLES];
+    if (atomic_load_explicit(&sample->seq, memory_order_acquire) != n + 1) continue;
+
+    SampleCopy copy;
+    copy.rip = atomic_load_explicit(&sample->rip, memory_order_relaxed);
+    copy.caller = atomic_load_explicit(&sample->caller, memory_order_relaxed);
+    copy.function = atomic_load_explicit(&sample->function, memory_order_relaxed);
+    atomic_thread_fence(memory_order_acquire);
+    if (atomic_load_explicit(&sample->seq, memory_order_relaxed) != n + 1) continue;
+
+    copies[count++] = copy;
+  }
+
+  for (size_t i = 0; i < count; i++) {
+    char flatKey[MAX_LINE_NAME];
+    char foldedKey[MAX_STACK_NAME];
+    char symbol[MAX_STACK_NAME / 2];
+
+    if (copies[i].function == -1) {
+      symbol_name(copies[i].rip, symbol, sizeof(symbol));
+      snprintf(flatKey, sizeof(flatKey), "[host]");
+      snprintf(foldedKey, sizeof(foldedKey), "%s", symbol);
+    } else {
+      const ProfiledFunction* function = function_at(copies[i].function);
+      const unsigned line = line_at(function, copies[i].rip);
+      symbol_name(copies[i].caller, symbol, sizeof(symbol));
+      snprintf(flatKey, sizeof(flatKey), "%s:%u", function->name, line);
+      snprintf(foldedKey, sizeof(foldedKey), "%s;%s;%s", symbol, function->name, flatKey);
+      inSbas++;
+    }
+
+    flatKeys[i] = strdup(flatKey);
+    foldedKeys[i] = strdup(foldedKey);
+    if (!flatKeys[i] || !foldedKeys[i]) {
+      fprintf(stderr, "sbasProfileWrite: failed to name samples.\n");
+      goto on_cleanup;
+    }
+  }
+
+  if (flat) {
+    fprintf(flat, "# %llu samples taken, %zu kept, %zu in SBas code\n", (unsigned long long)taken, count, inSbas);
+    if (write_rows(flat, flatKeys, count, 1) == -1) {
+      goto on_cleanup;
+    }
+    fflush(flat);
+  }
+  if (folded) {
+    if (write_rows(folded, foldedKeys, count, 0) == -1) {
+      goto on_cleanup;
+    }
+    fflush(folded);
+  }
+  result = 0;
+
+on_cleanup:
+  pthread_mutex_unlock(&profile.lock);
+
+  for (size_t i = 0; i < count && flatKeys && foldedKeys; i++) {
+    free(flatKeys[i]);
+    free(foldedKeys[i]);
+  }
+  free(flatKeys);
+  free(foldedKeys);
+  free(copies);
+  return result;
+}
+
+/**
+ * Frees everything a stopped profiler kept
+ */
+void sbasProfileDiscard(void) {
+  pthread_mutex_lock(&profile.lock);
+
+  if (!atomic_load(&profile.running)) {
+    free_functions();
+    free(profile.samples);
+    profile.samples = NULL;
+    atomic_store(&profile.sampleCount, 0);
+  }
+
+  pthread_mutex_unlock(&profile.lock);
+}
+
+/**
+ * Tells whether compiled functions should be registered with the profiler
+ */
+int profileRunning(void) { return atomic_load_explicit(&profile.running, memory_order_relaxed); }
+
+/**
+ * Counts the runs of the profiler, each of which needs functions registered anew
+ */
+unsigned profileRuns(void) { return atomic_load(&profile.runs); }
+
+/**
+ * Registers a freshly compiled function, keeping a copy of its executable lines
+ * so samples can be named after the function is gone
+ * @param code entry point of the function
+ * @param size bytes of machine code at `code`
+ * @param lt line table of the function, `NULL` if unknown
+ * @param lines entries in `lt`
+ * @param src source the function was compiled from
+ * @param len bytes in `src`
+ */
+void profileRecordCode(funcp code, int size, const LineTable* lt, unsigned lines, const char* src, size_t len) {
+  if (!profileRunning()) return;
+
+  pthread_mutex_lock(&profile.lock);
+
+  const int index = atomic_load(&profile.functionCount);
+  if (index == PROFILE_MAX_FUNCTIONS) {
+    goto on_cleanup;
+  }
+
+  ProfiledFunction* chunk = atomic_load(&profile.chunks[index / FUNCTION_CHUNK]);
+  if (!chunk) {
+    chunk = calloc(FUNCTION_CHUNK, sizeof(ProfiledFunction));
+    if (!chunk) {
+      fprintf(stderr, "profileRecordCode: failed to alloc functions.\n");
+      goto on_cleanup;
+    }
+    atomic_store(&profile.chunks[index / FUNCTION_CHUNK], chunk);
+  }
+
+  ProfiledFunction* function = &chunk[index % FUNCTION_CHUNK];
+  function->start = (uintptr_t)code;
+  function->end = (uintptr_t)code + size;
+  function->lineCount = 0;
+  function->lines = lt ? malloc(lines * sizeof(LineTable)) : NULL;
+  snprintf(function->name, sizeof(function->name), "sbas_%016llx", hashBytes(src, len));
+
+  // offsets grow with line numbers, so the copy comes out ordered by offset
+  for (unsigned line = 1; function->lines && line < lines; line++) {
+    if (lt[line].line == line) {
+      function->lines[function->lineCount++] = lt[line];
+    }
+  }
+
+  const uintptr_t low = atomic_load(&profile.low);
+  const uintptr_t high = atomic_load(&profile.high);
+  if (low == 0 || function->start < low) {
+    atomic_store(&profile.low, function->start);
+  }
+  if (function->end > high) {
+    atomic_store(&profile.high, function->end);
+  }
+
+  // publish the function to the signal handler only once it's complete
+  atomic_store_explicit(&profile.functionCount, index + 1, memory_order_release);
+
+on_cleanup:
+  pthread_mutex_unlock(&profile.lock);
+}
+
+/**
+ * Records the interrupted instruction and, in SBas code, the return address.
+ * Only touches preallocated memory and atomics, so it's async-signal-safe
+ */
+static void on_sigprof(int sig, siginfo_t* info, void* context) {
+  (void)sig;
+  (void)info;
+
+  Sample* samples = profile.samples;
+  if (!samples) return;
+
+  const ucontext_t* uc = context;
+  const uintptr_t rip = uc->uc_mcontext.gregs[REG_RIP];
+  const int function = find_function(rip);
+  const uintptr_t caller = function == -1 ? 0 : return_address(function_at(function), rip, uc);
+
+  const uint_fast64_t n = atomic_fetch_add_explicit(&profile.sampleCount, 1, memory_order_relaxed);
+  Sample* sample = &samples[n % PROFILE_MAX_SAMPLES];
+
+  atomic_store_explicit(&sample->seq, 0, memory_order_relaxed);
+  atomic_thread_fence(memory_order_release);
+  atomic_store_explicit(&sample->rip, rip, memory_order_relaxed);
+  atomic_store_explicit(&sample->caller, caller, memory_order_relaxed);
+  atomic_store_explicit(&sample->function, function, memory_order_relaxed);
+  atomic_store_explicit(&sample->seq, n + 1, memory_order_release);
+}
+
+/**
+ * Finds the registered function holding `rip`. Searches newest first,
+ * so a function placed where a freed one used to be takes precedence
+ * @returns its registry index, -1 outside SBas code
+ */
+static int find_function(uintptr_t rip) {
+  if (rip < atomic_load_explicit(&profile.low, memory_order_relaxed) ||
+      rip >= atomic_load_explicit(&profile.high, memory_order_relaxed)) {
+    return -1;
+  }
+
+  for (int i = atomic_load_explicit(&profile.functionCount, memory_order_acquire) - 1; i >= 0; i--) {
+    const ProfiledFunction* function = function_at(i);
+    if (rip >= function->start && rip < function->end) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+/**
+ * Reads where the interrupted SBas function returns to. Nothing is pushed at
+ * its first byte nor at its `ret`. In between, -O0 functions, opening with
+ * `push %rbp`, have `%rbp` pointing at the saved `%rbp` once their frame is
+ * set up. Optimized ones only push registers: those pushed before the
+ * interrupted instruction, or those it and the next ones pop before `ret`.
+ */
+static uintptr_t return_address(const ProfiledFunction* function, uintptr_t rip, const ucontext_t* uc) {
+  const uintptr_t* rsp = (const uintptr_t*)uc->uc_mcontext.gregs[REG_RSP];
+  const uintptr_t* rbp = (const uintptr_t*)uc->uc_mcontext.gregs[REG_RBP];
+  const unsigned char* start = (const unsigned char*)function->start;
+  const unsigned char* at = (const unsigned char*)rip;
+  int size;
+  int pushed = 0;
+
+  if (at == start || *at == OP_RET) {
+    return rsp[0];
+  }
+  if (*start == OP_PUSH_RBP) {
+    // only %rbp was pushed while the frame is being set up
+    return at - start < FRAME_SETUP ? rsp[1] : rbp[1];
+  }
+
+  if (push_pop_size(at, OP_POP_RD) > 0) {
+    for (; (size = push_pop_size(at, OP_POP_RD)) > 0; at += size) {
+      pushed++;
+    }
+    return rsp[pushed];
+  }
+  for (const unsigned char* p = start; p < at && (size = push_pop_size(p, OP_PUSH_RD)) > 0; p += size) {
+    pushed++;
+  }
+  return rsp[pushed];
+}
+
+/**
+ * Tells whether the instruction at `at` is a `push` (`OP_PUSH_RD`) or a `pop`
+ * (`OP_POP_RD`) of a 64-bit register
+ * @returns its size in bytes, 0 if it's something else
+ */
+static int push_pop_size(const unsigned char* at, unsigned char opcode) {
+  if (at[0] >= opcode && at[0] < opcode + 8) return 1;
+  if (at[0] == 0x41 && at[1] >= opcode && at[1] < opcode + 8) return 2;  // REX.B, for r8-r15
+  return 0;
+}
+
+/**
+ * Looks up a registered function by registry index
+ */
+static ProfiledFunction* function_at(int index) {
+  return &atomic_load_explicit(&profile.chunks[index / FUNCTION_CHUNK], memory_order_relaxed)[index % FUNCTION_CHUNK];
+}
+
+/**
+ * Finds the source line whose machine code holds `rip`
+ * @returns the line, 0 for the prologue or when the line table is unknown
+ */
+static unsigned line_at(const ProfiledFunction* function, uintptr_t rip) {
+  const int offset = rip - function->start;
+  unsigned low = 0;
+  unsigned high = function->lineCount;
+
+  // first line starting past `offset`: the one before it holds it
+  while (low < high) {
+    unsigned middle = (low + high) / 2;
+    if (function->lines[middle].offset <= offset) {
+      low = middle + 1;
+    } else {
+      high = middle;
+    }
+  }
+  return low == 0 ? 0 : function->lines[low - 1].line;
+}
+
+/**
+ * Names host code after the dynamic symbol holding `address`, or the object
+ * it belongs to when the symbol isn't exported
+ */
+static void symbol_name(uintptr_t address, char* name, size_t size) {
+  Dl_info info;
+
+  if (address && dladdr((void*)address, &info)) {
+    if (info.dli_sname) {
+      snprintf(name, size, "%s", info.dli_sname);
+      return;
+    }
+    if (info.dli_fname) {
+      const char* base = strrchr(info.dli_fname, '/');
+      snprintf(name, size, "[%s]", base ? base + 1 : info.dli_fname);
+      return;
+    }
+  }
+  snprintf(name, size, "[unknown]");
+}
+
+/**
+ * Orders report keys alphabetically, for `qsort`
+ */
+static int compare_keys(const void* a, const void* b) { return strcmp(*(char* const*)a, *(char* const*)b); }
+
+/**
+ * Orders report rows by decreasing samples, then by key, for `qsort`
+ */
+static int compare_rows(const void* a, const void* b) {
+  const Row* left = a;
+  const Row* right = b;
+  if (left->samples != right->samples) {
+    return left->samples < right->samples ? 1 : -1;
+  }
+  return strcmp(left->key, right->key);
+}
+
+/**
+ * Counts identical keys and writes a row per distinct one, as
+ * `samples percent key` most sampled first, or as `key samples` in key order
+ * @returns 0 on success, -1 on failure
+ */
+static int write_rows(FILE* out, char** keys, size_t count, char byCount) {
+  Row* rows = calloc(count + 1, sizeof(Row));
+  size_t rowCount = 0;
+
+  if (!rows) {
+    fprintf(stderr, "write_rows: failed to alloc rows.\n");
+    return -1;
+  }
+
+  qsort(keys, count, sizeof(char*), compare_keys);
+  for (size_t i = 0; i < count; i++) {
+    if (rowCount == 0 || strcmp(rows[rowCount - 1].key, keys[i]) != 0) {
+      rows[rowCount++].key = keys[i];
+    }
+    rows[rowCount - 1].samples++;
+  }
+
+  if (byCount) {
+    qsort(rows, rowCount, sizeof(Row), compare_rows);
+  }
+  for (size_t i = 0; i < rowCount; i++) {
+    if (byCount) {
+      fprintf(out, "%8zu %6.2f%%  %s\n", rows[i].samples, 100.0 * rows[i].samples / count, rows[i].key);
+    } else {
+      fprintf(out, "%s %zu\n", rows[i].key, rows[i].samples);
+    }
+  }
+
+  free(rows);
+  return 0;
+}
+
+/**
+ * Forgets every registered function, the lock must be held
+ */
+static void free_functions(void) {
+  const int count = atomic_load(&profile.functionCount);
+
+  atomic_store(&profile.functionCount, 0);
+  atomic_store(&profile.low, 0);
+  atomic_store(&profile.high, 0);
+  for (int i = 0; i < count; i++) {
+    free(function_at(i)->lines);
+  }
+  for (int i = 0; i < PROFILE_MAX_FUNCTIONS / FUNCTION_CHUNK; i++) {
+    free(atomic_load(&profile.chunks[i]));
+    atomic_store(&profile.chunks[i], NULL);
+  }
+}
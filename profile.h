@@ -0,0 +1,55 @@
+#ifndef PROFILE_H
+#define PROFILE_H
+#include <stddef.h>
+#include <stdio.h>
+
+#include "types.h"
+
+#define PROFILE_DEFAULT_HZ 1000          // samples per second of CPU time when none is asked for
+#define PROFILE_MAX_SAMPLES (64 * 1024)  // samples kept, older ones are overwritten past it
+#define PROFILE_MAX_FUNCTIONS (1 << 20)  // functions the profiler tells apart
+
+/**
+ * Starts sampling the process with `SIGPROF`, without recompiling anything.
+ *
+ * Every sample records the interrupted instruction. When it lies in a SBas
+ * function compiled since the profiler started, the function's return address
+ * is recorded too, so samples map back to a function, a source line and the
+ * host code that called it. Only the latest `PROFILE_MAX_SAMPLES` are kept,
+ * so the profiler can stay on for the lifetime of a process.
+ *
+ * Starting again drops the samples and functions of the previous run. The
+ * profiler owns `SIGPROF` and `ITIMER_PROF` until `sbasProfileStop`.
+ * @param hz samples per second of CPU time, 0 for `PROFILE_DEFAULT_HZ`
+ * @returns 0 on success, -1 on failure
+ */
+int sbasProfileStart(unsigned hz);
+
+/**
+ * Stops sampling and gives `SIGPROF` back. Samples are kept for `sbasProfileWrite`
+ */
+void sbasProfileStop(void);
+
+/**
+ * Writes out the samples taken so far, while sampling or after it stopped.
+ *
+ * The flat profile lists the samples of every SBas line as `function:line`,
+ * most sampled first, plus a `[host]` row for samples outside SBas code.
+ * The folded stacks are one `caller;function;function:line count` row per
+ * distinct stack, the input of `flamegraph.pl`.
+ * @param flat receives the flat profile, `NULL` to skip it
+ * @param folded receives the folded stacks, `NULL` to skip them
+ * @returns 0 on success, -1 on failure
+ */
+int sbasProfileWrite(FILE* flat, FILE* folded);
+
+/**
+ * Frees the samples and line tables kept by the profiler, once stopped
+ */
+void sbasProfileDiscard(void);
+
+int profileRunning(void);
+unsigned profileRuns(void);
+void profileRecordCode(funcp code, int size, const LineTable* lt, unsigned lines, const char* src, size_t len);
+
+#endif
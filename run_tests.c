@@ -1,13 +1,57 @@
 #include <assert.h>
+#include <elf.h>
 #include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 
+#include "aot.h"
+#include "arena.h"
+#include "async.h"
+#include "cache.h"
 #include "config.h"
+#include "hotswap.h"
+#include "linker.h"
+#include "object.h"
+#include "passes.h"
+#include "perf.h"
+#include "profile.h"
 #include "sbas.h"
+#include "utils.h"
 
 static void run_test_parse_full_grammar();
 static void run_test_callee_saveds();
+static void check_callee_saveds(funcp sbasFunction);
+static void run_test_code_arena();
+static void run_test_dual_mapped_arena();
+static void run_test_compile_buffer();
+static void run_test_async_compile();
+static void run_test_compile_cache();
+static void run_test_code_cache_file();
+static void run_test_object_file();
+static void run_test_large_program();
+static void run_test_hot_swap();
+static void run_test_perf_files();
+static void run_test_cached_perf_files();
+static void run_test_line_counters();
+static void run_test_sampling_profiler();
+static void run_test_cached_profiling();
+static void run_test_optimization_levels();
+static void run_test_unreachable_code();
+static void run_test_dead_stores();
+static void check_levels_agree(const char* source);
+static const unsigned char* instruction_at(const SbasObject* obj,
+                                           unsigned line);
+static void run_test_peephole();
+static void run_test_constant_multiplication();
+static void run_test_return_duplication();
+static void run_test_branch_relaxation();
+static void run_test_code_alignment();
+static void run_test_flag_reuse();
 static void run_test(const char* filePath, const char* testName, int paramCount,
                      int* p1, int* p2, int* p3, int expected);
 static void run_failing_test(const char* filePath, const char* testName,
@@ -18,6 +62,29 @@ int main(void) {
 
   run_test_parse_full_grammar();
   run_test_callee_saveds();
+  run_test_code_arena();
+  run_test_dual_mapped_arena();
+  run_test_compile_buffer();
+  run_test_async_compile();
+  run_test_compile_cache();
+  run_test_code_cache_file();
+  run_test_object_file();
+  run_test_large_program();
+  run_test_hot_swap();
+  run_test_perf_files();
+  run_test_cached_perf_files();
+  run_test_line_counters();
+  run_test_sampling_profiler();
+  run_test_cached_profiling();
+  run_test_optimization_levels();
+  run_test_unreachable_code();
+  run_test_dead_stores();
+  run_test_peephole();
+  run_test_constant_multiplication();
+  run_test_return_duplication();
+  run_test_branch_relaxation();
+  run_test_code_alignment();
+  run_test_flag_reuse();
 
   run_test("test_files/return_constant.sbas", "return constant literal", 0,
            NULL, NULL, NULL, 16909060);
@@ -187,8 +254,6 @@ int main(void) {
                    "File with comments only", 0, NULL, NULL, NULL);
   run_failing_test("test_files/incorrect/newlines_and_spaces.sbas",
                    "File with whitespace only", 0, NULL, NULL, NULL);
-  run_failing_test("test_files/incorrect/over_maxlines.sbas",
-                   "File exceeding MAX_LINES", 0, NULL, NULL, NULL);
   run_failing_test("test_files/incorrect/wrong_return.sbas", "Bad return", 0,
                    NULL, NULL, NULL);
   run_failing_test("test_files/incorrect/bad_att_operation.sbas",
@@ -242,6 +307,9 @@ static void run_test_parse_full_grammar() {
  * It is expected that these values are restored at the function epilogue.
  */
 static void run_test_callee_saveds() {
+  const char* writesAll =
+      "v1: p1\nv2 = v1 * v1\nv3 = v2 + v1\nv4 = v3 - v1\nv5 = v4 * $3\n"
+      "v1 = v5 + v2\nret v1\n";
   FILE* sbasFile;
   funcp sbasFunction;
 
@@ -256,7 +324,30 @@ static void run_test_callee_saveds() {
 
   sbasFunction = sbasCompile(sbasFile);
   assert(sbasFunction != NULL);
+  check_callee_saveds(sbasFunction);
+  fclose(sbasFile);
+  sbasCleanup(sbasFunction);
+
+  // optimized functions keep all five variables in caller-saved registers, so
+  // they push nothing
+  for (int level = 1; level <= OPT_MAX_LEVEL; level++) {
+    CompileOptions options = {.optLevel = level};
+    sbasFunction =
+        sbasCompileWithOptions(writesAll, strlen(writesAll), &options);
+    assert(sbasFunction != NULL);
+    const unsigned char first = *(const unsigned char*)sbasFunction;
+    assert(first != 0x41 && (first & 0xF8) != 0x50);
+    assert(sbasFunction(2) == 16);
+    check_callee_saveds(sbasFunction);
+    sbasCleanup(sbasFunction);
+  }
+}
 
+/**
+ * Calls `sbasFunction` with known values in every callee-saved register it
+ * may use and asserts they're the same once it returns
+ */
+static void check_callee_saveds(funcp sbasFunction) {
   unsigned long rbx, r12, r13, r14, r15;
   rbx = 0x11111111;
   r12 = 0x22222222;
@@ -294,9 +385,1016 @@ static void run_test_callee_saveds() {
   assert(r13_after == r13 && "r13 was altered and not restored!");
   assert(r14_after == r14 && "r14 was altered and not restored!");
   assert(r15_after == r15 && "r15 was altered and not restored!");
+}
 
-  fclose(sbasFile);
+/**
+ * Compiles SBas functions straight from memory. The lexer must stop at the
+ * given length, as mmap'd sources aren't NUL-terminated.
+ */
+static void run_test_compile_buffer() {
+  const char* source =
+      "// triple it\n"
+      "v1: p1\n"
+      "  v1 = v1 * $3\n"
+      "ret v1\n";
+  funcp sbasFunction;
+
+  printf("Testing compilation from memory...\n");
+
+  sbasFunction = sbasCompileBuffer(source, strlen(source));
+  assert(sbasFunction != NULL);
+  assert(sbasFunction(-7) == -21);
+  sbasCleanup(sbasFunction);
+
+  // only "ret $1" is in bounds
+  sbasFunction = sbasCompileBuffer("ret $12345", 6);
+  assert(sbasFunction != NULL);
+  assert(sbasFunction() == 1);
   sbasCleanup(sbasFunction);
+
+  assert(sbasCompileBuffer("ret $1", 0) == NULL);
+}
+
+/**
+ * Submits a burst of compilations to a compile service and checks every
+ * function it hands back, including a failing one and an abandoned one
+ */
+static void run_test_async_compile() {
+  const char* source = "v1: p1\nv1 = v1 + $1\nret v1\n";
+  CompileJob* jobs[64];
+
+  printf("Testing asynchronous compilation...\n");
+
+  CompileService* service = sbasServiceCreate(4);
+  assert(service != NULL);
+
+  for (int i = 0; i < 64; i++) {
+    jobs[i] = sbasCompileAsync(service, source, strlen(source));
+    assert(jobs[i] != NULL);
+  }
+  CompileJob* failing = sbasCompileAsync(service, "ret p1", 6);
+  assert(failing != NULL);
+  sbasJobRelease(sbasCompileAsync(service, source, strlen(source)));
+
+  for (int i = 0; i < 64; i++) {
+    funcp sbasFunction = sbasJobWait(jobs[i]);
+    assert(sbasFunction != NULL);
+    assert(sbasJobPoll(jobs[i]) == JOB_DONE);
+    assert(sbasFunction(i) == i + 1);
+    sbasCleanup(sbasFunction);
+    sbasJobRelease(jobs[i]);
+  }
+
+  assert(sbasJobWait(failing) == NULL);
+  assert(sbasJobPoll(failing) == JOB_FAILED);
+  sbasJobRelease(failing);
+
+  sbasServiceDestroy(service);
+}
+
+/**
+ * Enables the compile cache and checks that sources differing only in spacing
+ * share a function, that unreferenced functions are evicted least recently
+ * used first, and that referenced ones outlive the cache
+ */
+static void run_test_compile_cache() {
+  const char* source = "v1: p1\nv1 = v1 * $2\nret v1\n";
+  const char* respaced = "  v1 :   p1\n  v1 = v1 *\t$2  \nret v1\n\n";
+  const char* other = "ret $3";
+  CacheStats stats;
+
+  printf("Testing compile cache...\n");
+
+  sbasCacheEnable(1 << 20);
+
+  funcp first = sbasCompileBuffer(source, strlen(source));
+  funcp second = sbasCompileBuffer(respaced, strlen(respaced));
+  assert(first != NULL && first == second);
+  assert(first(21) == 42);
+
+  sbasCacheStats(&stats);
+  assert(stats.hits == 1 && stats.misses == 1 && stats.entries == 1);
+
+  // unreferenced functions stay cached
+  sbasCleanup(first);
+  sbasCleanup(second);
+  funcp third = sbasCompileBuffer(source, strlen(source));
+  assert(third == first);
+  sbasCleanup(third);
+
+  // room for a single function: the least recently used one goes
+  sbasCacheStats(&stats);
+  sbasCacheEnable(stats.bytes + 1);
+  funcp constant = sbasCompileBuffer(other, strlen(other));
+  assert(constant() == 3);
+  sbasCleanup(constant);
+
+  sbasCacheStats(&stats);
+  assert(stats.evictions == 1 && stats.entries == 1);
+  constant = sbasCompileBuffer(other, strlen(other));
+  sbasCacheStats(&stats);
+  assert(stats.hits == 3);
+
+  // referenced functions survive disabling the cache
+  sbasCacheDisable();
+  assert(constant() == 3);
+  sbasCleanup(constant);
+}
+
+/**
+ * Keeps the function pointers of the code arena tests up to date when
+ * compaction moves them
+ */
+static void arena_function_moved(funcp from, funcp to, void* ctx) {
+  funcp* functions = ctx;
+  for (int i = 0; i < 3; i++) {
+    if (functions[i] == from) {
+      functions[i] = to;
+    }
+  }
+}
+
+/**
+ * Compiles several SBas files into a single code arena. Checks they run from
+ * it, that committed ones keep running while later ones are compiled, that
+ * freed space is reused and that compaction keeps them working.
+ */
+static void run_test_code_arena() {
+  const char* files[3] = {"test_files/return_constant.sbas",
+                          "test_files/factorial.sbas",
+                          "test_files/add_one_to_arg.sbas"};
+  funcp functions[3];
+  FILE* sbasFile;
+
+  printf("Testing code arena...\n");
+
+  CodeArena* arena = sbasArenaCreate(0);
+  assert(arena != NULL);
+
+  for (int i = 0; i < 3; i++) {
+    sbasFile = fopen(files[i], "r");
+    assert(sbasFile != NULL);
+    functions[i] = sbasArenaCompile(arena, sbasFile);
+    assert(functions[i] != NULL);
+    assert((uintptr_t)functions[i] % ARENA_ALIGNMENT == 0);
+    fclose(sbasFile);
+  }
+  assert(sbasArenaCommit(arena) == 0);
+
+  assert(functions[0]() == 16909060);
+  assert(functions[1](10) == 3628800);
+  assert(functions[2](41) == 42);
+
+  // committed functions keep running while a later one is written elsewhere
+  funcp freed = functions[1];
+  sbasArenaFree(arena, functions[1]);
+  sbasFile = fopen(files[0], "r");
+  assert(sbasFile != NULL);
+  functions[1] = sbasArenaCompile(arena, sbasFile);
+  fclose(sbasFile);
+  assert(functions[1] != NULL && functions[1] != freed);
+  assert(functions[0]() == 16909060);
+  assert(functions[2](41) == 42);
+  assert(sbasArenaCommit(arena) == 0);
+  assert(functions[1]() == 16909060);
+
+  // the smaller function takes the place of one freed before committing
+  const char* constant = "ret $7";
+  funcp staged = sbasArenaCompileBuffer(arena, constant, strlen(constant));
+  sbasArenaFree(arena, staged);
+  funcp reused = sbasArenaCompileBuffer(arena, constant, strlen(constant));
+  assert(reused == staged);
+  assert(sbasArenaCommit(arena) == 0);
+  assert(reused() == 7);
+
+  // freeing the first function leaves a hole that compaction closes
+  funcp last = functions[2];
+  sbasArenaFree(arena, functions[0]);
+  functions[0] = NULL;
+  assert(sbasArenaCompact(arena, arena_function_moved, functions) == 0);
+  assert(functions[2] != last);
+  assert(functions[1]() == 16909060);
+  assert(functions[2](-1) == 0);
+
+  sbasArenaDestroy(arena);
+}
+
+/**
+ * Compiles into a dual-mapped arena and checks that functions run without any
+ * commit, even after being rewritten or moved, while no mapping of the
+ * process is ever writable and executable at once
+ */
+static void run_test_dual_mapped_arena() {
+  const char* constant = "ret $7";
+  const char* addOne = "v1: p1\nv1 = v1 + $1\nret v1";
+  funcp functions[3] = {NULL, NULL, NULL};
+  char line[512];
+
+  printf("Testing dual-mapped code arena...\n");
+
+  CodeArena* arena = sbasArenaCreateDualMapped(0);
+  assert(arena != NULL);
+
+  functions[0] = sbasArenaCompileBuffer(arena, constant, strlen(constant));
+  functions[1] = sbasArenaCompileBuffer(arena, addOne, strlen(addOne));
+  assert(functions[0] != NULL && functions[1] != NULL);
+  assert(functions[0]() == 7);
+  assert(functions[1](41) == 42);
+
+  FILE* maps = fopen("/proc/self/maps", "r");
+  assert(maps != NULL);
+  while (fgets(line, sizeof(line), maps)) {
+    char perms[5];
+    assert(sscanf(line, "%*s %4s", perms) == 1);
+    assert(!(perms[1] == 'w' && perms[2] == 'x'));
+  }
+  fclose(maps);
+
+  // a new function reuses the freed slot and runs right away
+  funcp freed = functions[0];
+  sbasArenaFree(arena, functions[0]);
+  functions[0] = sbasArenaCompileBuffer(arena, addOne, strlen(addOne));
+  assert(functions[0] == freed && functions[0](1) == 2);
+
+  sbasArenaFree(arena, functions[0]);
+  functions[0] = NULL;
+  assert(sbasArenaCompact(arena, arena_function_moved, functions) == 0);
+  assert(functions[1] == freed && functions[1](-1) == 0);
+
+  sbasArenaDestroy(arena);
+}
+
+/**
+ * Checks that a code cache file is only used for the source it was written
+ * for and survives being damaged
+ */
+static void run_test_code_cache_file() {
+  const char* path = "/tmp/sbas_test_code_cache.sbasc";
+  const char* source = "v1: p1\niflez v1 4\nret v1\nret $0\n";
+  const char* edited = "v1: p1\niflez v1 4\nret $1\nret $0\n";
+
+  printf("Testing code cache file...\n");
+  unlink(path);
+
+  // miss: compiled and written
+  assert(sbasAotLoad(path, source, strlen(source), NULL) == NULL);
+  funcp compiled = sbasCompileCached(path, source, strlen(source), NULL);
+  assert(compiled != NULL && compiled(7) == 7 && compiled(-7) == 0);
+  sbasCleanup(compiled);
+
+  // hit: mapped from the file, jumps included
+  funcp loaded = sbasAotLoad(path, source, strlen(source), NULL);
+  assert(loaded != NULL && loaded(7) == 7 && loaded(-7) == 0);
+  sbasCleanup(loaded);
+
+  // a different source never runs the stale code
+  assert(sbasAotLoad(path, edited, strlen(edited), NULL) == NULL);
+  funcp recompiled = sbasCompileCached(path, edited, strlen(edited), NULL);
+  assert(recompiled != NULL && recompiled(7) == 1);
+  sbasCleanup(recompiled);
+
+  // a damaged file is rejected and rewritten
+  FILE* f = fopen(path, "r+b");
+  assert(f != NULL);
+  fseek(f, -1, SEEK_END);
+  fputc(0x90, f);
+  fclose(f);
+  assert(sbasAotLoad(path, edited, strlen(edited), NULL) == NULL);
+  recompiled = sbasCompileCached(path, edited, strlen(edited), NULL);
+  assert(recompiled != NULL && recompiled(7) == 1);
+  sbasCleanup(recompiled);
+  loaded = sbasAotLoad(path, edited, strlen(edited), NULL);
+  assert(loaded != NULL && loaded(-7) == 0);
+  sbasCleanup(loaded);
+
+  unlink(path);
+}
+
+/**
+ * Writes a function as an ELF relocatable object and checks that it exports
+ * the code under the requested symbol
+ */
+static void run_test_object_file() {
+  const char* path = "/tmp/sbas_test_object.o";
+  const char* source = "v1: p1\nv1 = v1 + $1\nret v1\n";
+  SbasObject obj;
+  unsigned char file[4096];
+
+  printf("Testing object file...\n");
+
+  assert(sbasTranslate(source, strlen(source), &obj) == 0);
+  assert(sbasWriteObject(path, "add_one", &obj) == 0);
+
+  FILE* f = fopen(path, "rb");
+  assert(f != NULL);
+  size_t size = fread(file, 1, sizeof(file), f);
+  fclose(f);
+  unlink(path);
+
+  Elf64_Ehdr* ehdr = (Elf64_Ehdr*)file;
+  assert(size > sizeof(Elf64_Ehdr));
+  assert(memcmp(ehdr->e_ident, ELFMAG, SELFMAG) == 0);
+  assert(ehdr->e_type == ET_REL && ehdr->e_machine == EM_X86_64);
+  assert(ehdr->e_shoff + ehdr->e_shnum * sizeof(Elf64_Shdr) <= size);
+
+  Elf64_Shdr* shdrs = (Elf64_Shdr*)(file + ehdr->e_shoff);
+  const char* names = (const char*)file + shdrs[ehdr->e_shstrndx].sh_offset;
+  int foundSymbol = 0, foundStackNote = 0;
+  for (int i = 0; i < ehdr->e_shnum; i++) {
+    if (strcmp(names + shdrs[i].sh_name, ".note.GNU-stack") == 0) {
+      foundStackNote = !(shdrs[i].sh_flags & SHF_EXECINSTR);
+    }
+    if (shdrs[i].sh_type != SHT_SYMTAB) continue;
+
+    Elf64_Sym* symbols = (Elf64_Sym*)(file + shdrs[i].sh_offset);
+    const char* strings = (const char*)file + shdrs[shdrs[i].sh_link].sh_offset;
+    for (size_t j = 0; j < shdrs[i].sh_size / sizeof(Elf64_Sym); j++) {
+      if (strcmp(strings + symbols[j].st_name, "add_one") != 0) continue;
+      Elf64_Shdr* text = &shdrs[symbols[j].st_shndx];
+      assert(ELF64_ST_BIND(symbols[j].st_info) == STB_GLOBAL);
+      assert(ELF64_ST_TYPE(symbols[j].st_info) == STT_FUNC);
+      assert(symbols[j].st_size == (Elf64_Xword)obj.size);
+      const unsigned char* body =
+          file + text->sh_offset + symbols[j].st_value;
+      assert(memcmp(body, obj.code, obj.size) == 0);
+      foundSymbol = 1;
+    }
+  }
+  assert(foundSymbol && foundStackNote);
+
+  sbasFreeObject(&obj);
+}
+
+/**
+ * Compiles a program far longer than the initial code buffer guess, with a
+ * jump over all of it and a jump to a line past the end of the source
+ */
+static void run_test_large_program() {
+  const int additions = 100000;
+  const char* head = "v1: p1\niflez v1 100004\n";
+  const char* tail = "ret v1\nret $-1\n";
+  size_t len = 0;
+
+  printf("Testing large program...\n");
+
+  char* src = malloc(strlen(head) + additions * strlen("v1 = v1 + $1\n") +
+                     strlen(tail) + 1);
+  assert(src != NULL);
+  len += sprintf(src + len, "%s", head);
+  for (int i = 0; i < additions; i++) {
+    len += sprintf(src + len, "v1 = v1 + $1\n");
+  }
+  len += sprintf(src + len, "%s", tail);
+
+  funcp large = sbasCompileBuffer(src, len);
+  assert(large != NULL);
+  assert(large(1) == 1 + additions);
+  assert(large(0) == -1);
+  sbasCleanup(large);
+
+  // line 100006 doesn't exist
+  memcpy(src + strlen("v1: p1\niflez v1 10000"), "6", 1);
+  assert(sbasCompileBuffer(src, len) == NULL);
+
+  free(src);
+}
+
+/**
+ * Keeps calling a handle until told to stop, checking every call
+ * returns the result of one of its two bodies
+ */
+static void* hot_swap_caller(void* arg) {
+  FunctionHandle* handle = ((void**)arg)[0];
+  atomic_int* stop = ((void**)arg)[1];
+
+  while (!atomic_load(stop)) {
+    int result = sbasHandleCall(handle, 20, 0, 0);
+    assert(result == 21 || result == 40);
+  }
+  return NULL;
+}
+
+/**
+ * Swaps the body of a handle back and forth while other threads call it,
+ * and checks that replaced bodies are only freed once no thread can run them
+ */
+static void run_test_hot_swap() {
+  const char* addOne = "v1: p1\nv1 = v1 + $1\nret v1";
+  const char* twice = "v1: p1\nv1 = v1 * $2\nret v1";
+  atomic_int stop = 0;
+  pthread_t callers[4];
+
+  printf("Testing hot swap...\n");
+
+  FunctionHandle* handle = sbasHandleCreate(addOne, strlen(addOne));
+  assert(handle != NULL);
+  funcp entry = sbasHandleEntry(handle);
+  assert(sbasHandleCall(handle, 1, 0, 0) == 2);
+
+  // a thread inside the epoch keeps the old body alive
+  sbasEpochEnter();
+  assert(sbasHandleSwap(handle, twice, strlen(twice)) == 0);
+  assert(sbasHandleEntry(handle) == entry && entry(4) == 8);
+  assert(sbasHandleReclaim() == 1);
+  sbasEpochExit();
+  assert(sbasHandleReclaim() == 0);
+
+  // a source that doesn't compile leaves the body in place
+  assert(sbasHandleSwap(handle, "ret", 3) == -1);
+  assert(sbasHandleCall(handle, 4, 0, 0) == 8);
+
+  void* args[2] = {handle, &stop};
+  for (int i = 0; i < 4; i++) {
+    assert(pthread_create(&callers[i], NULL, hot_swap_caller, args) == 0);
+  }
+  for (int i = 0; i < 200; i++) {
+    const char* src = i % 2 ? twice : addOne;
+    assert(sbasHandleSwap(handle, src, strlen(src)) == 0);
+  }
+  atomic_store(&stop, 1);
+  for (int i = 0; i < 4; i++) {
+    pthread_join(callers[i], NULL);
+  }
+
+  assert(sbasHandleCall(handle, 20, 0, 0) == 40);
+  sbasHandleDestroy(handle);
+  assert(sbasHandleReclaim() == 0);
+}
+
+/**
+ * Enables the perf files and checks that a compiled function shows up in the
+ * perf map and the jitdump
+ */
+static void run_test_perf_files() {
+  const char* source = "v1: p1\nv1 = v1 + $1\nret v1\n";
+  char mapPath[64], dumpPath[64], line[256], expected[64];
+  unsigned magic = 0;
+  int found = 0;
+
+  printf("Testing perf files...\n");
+
+  snprintf(mapPath, sizeof(mapPath), "%s/perf-%d.map", PERF_DIR,
+           (int)getpid());
+  snprintf(dumpPath, sizeof(dumpPath), "%s/jit-%d.dump", PERF_DIR,
+           (int)getpid());
+  unlink(mapPath);
+
+  assert(sbasPerfEnable(PERF_MAP | PERF_JITDUMP) == 0);
+  funcp function = sbasCompileBuffer(source, strlen(source));
+  assert(function != NULL);
+  sbasPerfDisable();
+
+  snprintf(expected, sizeof(expected), "%lx ", (unsigned long)function);
+  FILE* map = fopen(mapPath, "r");
+  assert(map != NULL);
+  while (fgets(line, sizeof(line), map)) {
+    found |= strncmp(line, expected, strlen(expected)) == 0 &&
+             strstr(line, " sbas_") != NULL;
+  }
+  fclose(map);
+  assert(found);
+
+  FILE* dump = fopen(dumpPath, "rb");
+  assert(dump != NULL);
+  assert(fread(&magic, sizeof(magic), 1, dump) == 1 && magic == 0x4A695444);
+  fseek(dump, 0, SEEK_END);
+  assert(ftell(dump) > 40);  // header plus records
+  fclose(dump);
+
+  sbasCleanup(function);
+  unlink(mapPath);
+  unlink(dumpPath);
+}
+
+/**
+ * Compiles a function before enabling the perf map and checks it's described
+ * once, and only once, when later compilations get it from the compile cache
+ */
+static void run_test_cached_perf_files() {
+  const char* source = "v1: p1\nv1 = v1 * $3\nret v1\n";
+  char mapPath[64], line[256], expected[64];
+  int found = 0;
+
+  printf("Testing perf files of cached functions...\n");
+
+  snprintf(mapPath, sizeof(mapPath), "%s/perf-%d.map", PERF_DIR, (int)getpid());
+  unlink(mapPath);
+
+  sbasCacheEnable(1 << 20);
+  funcp first = sbasCompileBuffer(source, strlen(source));
+  assert(first != NULL);
+
+  assert(sbasPerfEnable(PERF_MAP) == 0);
+  funcp second = sbasCompileBuffer(source, strlen(source));
+  funcp third = sbasCompileBuffer(source, strlen(source));
+  assert(second == first && third == first);
+  sbasPerfDisable();
+
+  snprintf(expected, sizeof(expected), "%lx ", (unsigned long)second);
+  FILE* map = fopen(mapPath, "r");
+  assert(map != NULL);
+  while (fgets(line, sizeof(line), map)) {
+    found += strncmp(line, expected, strlen(expected)) == 0;
+  }
+  fclose(map);
+  assert(found == 1);
+
+  sbasCleanup(first);
+  sbasCleanup(second);
+  sbasCleanup(third);
+  sbasCacheDisable();
+  unlink(mapPath);
+}
+
+/**
+ * Compiles an instrumented factorial and checks every line counted its runs,
+ * then that a reset zeroes the counters
+ */
+static void run_test_line_counters() {
+  const char* source =
+      "v1: p1\nv2: $1\nv3: $0\niflez v1 8\nv2 = v2 * v1\nv1 = v1 - $1\n"
+      "iflez v3 4\nret v2\n";
+  const unsigned long long expected[] = {0, 1, 1, 1, 6, 5, 5, 5, 1};
+  unsigned long long counts[9];
+  CompileOptions options = {.instrument = 1};
+
+  printf("Testing line counters...\n");
+
+  funcp function = sbasCompileWithOptions(source, strlen(source), &options);
+  assert(function != NULL);
+
+  assert(function(5) == 120);
+  assert(sbasReadLineCounters(function, counts, 9) == 9);
+  assert(memcmp(counts, expected, sizeof(expected)) == 0);
+
+  sbasResetLineCounters(function);
+  sbasReadLineCounters(function, counts, 9);
+  for (unsigned line = 0; line < 9; line++) {
+    assert(counts[line] == 0);
+  }
+  assert(function(5) == 120);
+  sbasReadLineCounters(function, counts, 9);
+  assert(counts[4] == 6 && counts[6] == 5);
+  sbasCleanup(function);
+
+  // plain compilations carry no counters
+  function = sbasCompileBuffer(source, strlen(source));
+  assert(function != NULL && sbasReadLineCounters(function, counts, 9) == 0);
+  sbasCleanup(function);
+}
+
+/**
+ * Samples a long running loop and checks both reports place the samples
+ * on the loop's lines, below a resolved caller frame rather than `[unknown]`
+ */
+static void run_test_sampling_profiler() {
+  const char* source =
+      "v1: p1\nv2: $0\nv1 = v1 - $1\niflez v1 6\niflez v2 3\nret v1\n";
+  char line[256];
+
+  printf("Testing sampling profiler...\n");
+
+  // optimized functions set up no frame, only push what they change
+  for (int level = 0; level <= OPT_MAX_LEVEL; level += OPT_MAX_LEVEL) {
+    CompileOptions options = {.optLevel = level};
+    int loopSamples = 0;
+    int stacks = 0;
+
+    assert(sbasProfileStart(1000) == 0);
+    funcp function = sbasCompileWithOptions(source, strlen(source), &options);
+    assert(function != NULL);
+    for (int i = 0; i < 4; i++) {
+      assert(function(100000000) == 0);
+    }
+    sbasProfileStop();
+
+    FILE* flat = tmpfile();
+    FILE* folded = tmpfile();
+    assert(flat != NULL && folded != NULL);
+    assert(sbasProfileWrite(flat, folded) == 0);
+
+    rewind(flat);
+    while (fgets(line, sizeof(line), flat)) {
+      const char inLoop = strstr(line, ":3\n") || strstr(line, ":4\n") ||
+                          strstr(line, ":5\n");
+      if (strstr(line, " sbas_") && inLoop) {
+        loopSamples += atoi(line);
+      }
+    }
+    rewind(folded);
+    while (fgets(line, sizeof(line), folded)) {
+      // the caller is its `dladdr` symbol, or its object when it isn't exported
+      const char* sbasFrame = strstr(line, ";sbas_");
+      stacks += sbasFrame != NULL && sbasFrame != line &&
+                strncmp(line, "[unknown];", 10) != 0 &&
+                memchr(line, ';', sbasFrame - line) == NULL;
+    }
+    fclose(flat);
+    fclose(folded);
+    assert(loopSamples > 0 && stacks > 0);
+
+    sbasCleanup(function);
+    sbasProfileDiscard();
+  }
+}
+
+/**
+ * Compiles a loop before starting the profiler and checks its samples are
+ * still placed in SBas code once the compile cache hands it out again
+ */
+static void run_test_cached_profiling() {
+  const char* source =
+      "v1: p1\nv2: $0\nv1 = v1 - $1\niflez v1 6\niflez v2 3\nret v1\n";
+  char line[256];
+  int sbasSamples = 0;
+
+  printf("Testing profiling of cached functions...\n");
+
+  sbasCacheEnable(1 << 20);
+  funcp first = sbasCompileBuffer(source, strlen(source));
+  assert(first != NULL);
+
+  assert(sbasProfileStart(1000) == 0);
+  funcp second = sbasCompileBuffer(source, strlen(source));
+  assert(second == first);
+  for (int i = 0; i < 4; i++) {
+    assert(second(100000000) == 0);
+  }
+  sbasProfileStop();
+
+  FILE* flat = tmpfile();
+  assert(flat != NULL);
+  assert(sbasProfileWrite(flat, NULL) == 0);
+  rewind(flat);
+  while (fgets(line, sizeof(line), flat)) {
+    if (strstr(line, " sbas_")) {
+      sbasSamples += atoi(line);
+    }
+  }
+  fclose(flat);
+  assert(sbasSamples > 0);
+
+  sbasCleanup(first);
+  sbasCleanup(second);
+  sbasCacheDisable();
+  sbasProfileDiscard();
+}
+
+/**
+ * Compiles functions with loops, branches and constants at every level and
+ * checks they all agree, and that unknown levels are rejected
+ */
+static void run_test_optimization_levels() {
+  const char* loop =
+      "v1: p1\nv2: $1\nv3: $0\niflez v1 8\nv2 = v2 * v1\nv1 = v1 - $1\n"
+      "iflez v3 4\nret v2\n";
+  const char* branch =
+      "v1: p1\nv2: p2\nv3 = v1 - v2\niflez v3 6\nret v1\nret v2\nv1: $7\n"
+      "ret v1\n";
+  const char* folded =
+      "v1: p1\nv2: $4\nv3 = v2 * $3\nv1 = v3 - v1\nv4 = v1 - v1\n"
+      "iflez v4 8\nret v4\nv2 = v2 + v1\nret v2\n";
+
+  printf("Testing optimization levels...\n");
+
+  check_levels_agree(loop);
+  check_levels_agree(branch);
+  check_levels_agree(folded);
+
+  // the right operand is read after the destination is written
+  funcp reference = sbasCompileBuffer(folded, strlen(folded));
+  assert(reference != NULL && reference(5) == 11);
+  sbasCleanup(reference);
+
+  CompileOptions unknown = {.optLevel = OPT_MAX_LEVEL + 1};
+  assert(sbasCompileWithOptions(loop, strlen(loop), &unknown) == NULL);
+}
+
+/**
+ * Checks the lines after an unconditional `ret` are gone from -O1 on
+ */
+static void run_test_unreachable_code() {
+  const char* deadCode = "ret $-775\nv1: $5\nv1 = v1 + $1\nret v1\n";
+  SbasObject objects[OPT_MAX_LEVEL + 1];
+
+  printf("Testing unreachable code removal...\n");
+
+  for (int level = 0; level <= OPT_MAX_LEVEL; level++) {
+    CompileOptions options = {.optLevel = level};
+    assert(sbasTranslateWithOptions(deadCode, strlen(deadCode), &options,
+                                    &objects[level]) == 0);
+    assert(objects[level].optLevel == level);
+  }
+  assert(objects[1].size < objects[0].size);
+  assert(objects[2].size <= objects[1].size);
+  for (int level = 0; level <= OPT_MAX_LEVEL; level++) {
+    sbasFreeObject(&objects[level]);
+  }
+}
+
+/**
+ * Checks only the stores the result depends on are left at -O1, so a function
+ * full of dead stores compiles to the same code as one without them
+ */
+static void run_test_dead_stores() {
+  const char* deadStores =
+      "v1: p1\nv2 = v1 * $7\nv2: p2\nv1 = v1 + $1\nret v2\n";
+  const char* liveStores = "v2: p2\nret v2\n";
+  CompileOptions o1 = {.optLevel = 1};
+  SbasObject dead, live;
+
+  printf("Testing dead store removal...\n");
+
+  assert(sbasTranslateWithOptions(deadStores, strlen(deadStores), &o1,
+                                  &dead) == 0);
+  assert(sbasTranslateWithOptions(liveStores, strlen(liveStores), &o1,
+                                  &live) == 0);
+  assert(dead.size == live.size);
+  assert(memcmp(dead.code, live.code, live.size) == 0);
+  sbasFreeObject(&dead);
+  sbasFreeObject(&live);
+
+  check_levels_agree(deadStores);
+}
+
+/**
+ * Compiles a source at every level and checks each one returns what -O0
+ * returns, for small values of the first two parameters
+ */
+static void check_levels_agree(const char* source) {
+  funcp functions[OPT_MAX_LEVEL + 1];
+
+  for (int level = 0; level <= OPT_MAX_LEVEL; level++) {
+    CompileOptions options = {.optLevel = level};
+    functions[level] =
+        sbasCompileWithOptions(source, strlen(source), &options);
+    assert(functions[level] != NULL);
+  }
+  for (int p1 = -3; p1 <= 6; p1++) {
+    for (int p2 = -3; p2 <= 6; p2++) {
+      int expected = functions[0](p1, p2);
+      for (int level = 1; level <= OPT_MAX_LEVEL; level++) {
+        assert(functions[level](p1, p2) == expected);
+      }
+    }
+  }
+  for (int level = 0; level <= OPT_MAX_LEVEL; level++) {
+    sbasCleanup(functions[level]);
+  }
+}
+
+/**
+ * Finds the first instruction of a source line, past its REX prefix
+ */
+static const unsigned char* instruction_at(const SbasObject* obj,
+                                           unsigned line) {
+  const unsigned char* code = obj->code + obj->lt[line].offset;
+  return (*code & 0xF0) == 0x40 ? code + 1 : code;
+}
+
+/**
+ * Checks the peephole optimizer swaps instructions for the shorter `lea`,
+ * `inc`, `dec`, `xor` and `test` at -O1, and that the code got smaller
+ */
+static void run_test_peephole() {
+  const char* arithmetic =
+      "v1: p1\nv2: p2\nv3 = v1 + v2\nv1 = v1 + $1\nv2 = v2 - $1\n"
+      "v4 = v3 * v1\nv4 = v4 * v2\nret v4\n";
+  const char* loop =
+      "v1: $0\nv2: p1\nv3: $0\niflez v2 8\nv1 = v1 + v2\nv2 = v2 - $1\n"
+      "iflez v3 4\nret v1\n";
+  const char* folded =
+      "v1: p1\nv2: p2\nv4 = v1 + v2\nv5 = v4 + $1000\nv3 = v5 - $1\n"
+      "v2 = v3 * $-7\nv1 = v2 + v4\nv1 = v1 - $-1\nret v1\n";
+  CompileOptions o0 = {.optLevel = 0};
+  CompileOptions o1 = {.optLevel = 1};
+  SbasObject plain, optimized;
+  const unsigned char* at;
+
+  printf("Testing peephole optimizer...\n");
+
+  assert(sbasTranslateWithOptions(arithmetic, strlen(arithmetic), &o1,
+                                  &optimized) == 0);
+  assert(instruction_at(&optimized, 3)[0] == 0x8D);  // lea (v1,v2), v3
+  at = instruction_at(&optimized, 4);
+  assert(at[0] == 0xFF && (at[1] >> 3 & 7) == 0);  // inc v1
+  at = instruction_at(&optimized, 5);
+  assert(at[0] == 0xFF && (at[1] >> 3 & 7) == 1);  // dec v2
+  assert(sbasTranslateWithOptions(arithmetic, strlen(arithmetic), &o0,
+                                  &plain) == 0);
+  assert(optimized.size < plain.size);
+  sbasFreeObject(&optimized);
+  sbasFreeObject(&plain);
+
+  assert(sbasTranslateWithOptions(loop, strlen(loop), &o1, &optimized) == 0);
+  assert(instruction_at(&optimized, 1)[0] == 0x31);  // xor v1, v1
+  assert(instruction_at(&optimized, 4)[0] == 0x85);  // test v2, v2
+  sbasFreeObject(&optimized);
+
+  check_levels_agree(arithmetic);
+  check_levels_agree(loop);
+  check_levels_agree(folded);
+}
+
+/**
+ * Checks multiplications by constants become `lea`s, shifts and additions at
+ * -O1 instead of `imul`, and that they agree with -O0 for every kind of factor
+ */
+static void run_test_constant_multiplication() {
+  const char* factors =
+      "v1: p1\nv2: p2\nv3 = v1 * $10\nv4 = v2 * $-8\nv5 = v1 * $7\n"
+      "v3 = v3 * $45\nv4 = v4 + v5\nv3 = v3 + v4\nret v3\n";
+  CompileOptions o1 = {.optLevel = 1};
+  SbasObject obj;
+
+  printf("Testing multiplications by constants...\n");
+
+  FILE* sbasFile = fopen("test_files/multiply_param_by_10.sbas", "r");
+  assert(sbasFile != NULL);
+  size_t len = 0;
+  char* src = readSource(sbasFile, &len);
+  fclose(sbasFile);
+  assert(src != NULL);
+
+  assert(sbasTranslateWithOptions(src, len, &o1, &obj) == 0);
+  for (int i = 0; i < obj.size; i++) {
+    assert(obj.code[i] != 0x6B && obj.code[i] != 0x69);  // imul $imm
+  }
+  sbasFreeObject(&obj);
+  free(src);
+
+  check_levels_agree(factors);
+}
+
+/**
+ * Checks a jump to a line that only returns becomes the return itself at -O1,
+ * so the early exit of the first `iflez` falls straight into a `ret`
+ */
+static void run_test_return_duplication() {
+  const char* source =
+      "v1: p1\niflez v1 5\nv2: $0\niflez v2 7\nv1 = v1 + $9\nret v1\n"
+      "ret v1\n";
+  const char* constant =
+      "v1: p1\niflez v1 4\nv1 = v1 * $-3\nv2: $0\niflez v2 7\nret $9\n"
+      "v1 = v1 + $2\nret v1\n";
+  CompileOptions o1 = {.optLevel = 1};
+  SbasObject obj;
+
+  printf("Testing return duplication...\n");
+
+  assert(sbasTranslateWithOptions(source, strlen(source), &o1, &obj) == 0);
+  assert(obj.code[obj.lt[5].offset - 1] == 0xC3);  // ret, not jmp
+  for (int i = obj.lt[2].offset; i < obj.lt[5].offset; i++) {
+    assert(obj.code[i] != 0xEB && obj.code[i] != 0xE9);
+  }
+  sbasFreeObject(&obj);
+
+  check_levels_agree(source);
+  check_levels_agree(constant);
+}
+
+/**
+ * Grows the body of a loop a line at a time, so its jumps go from short to
+ * long. Checks every level agrees with -O0 on both sides of the boundary, and
+ * that -O1 picks `jle rel8` and `jmp rel8` exactly when their target fits
+ */
+static void run_test_branch_relaxation() {
+  CompileOptions o0 = {.optLevel = 0};
+  CompileOptions o1 = {.optLevel = 1};
+  char src[4096];
+  int shortBodies = 0;
+  int longBodies = 0;
+
+  printf("Testing branch relaxation...\n");
+
+  for (int body = 1; body <= 60; body++) {
+    funcp functions[OPT_MAX_LEVEL + 1];
+    int len = sprintf(src, "v1: p1\nv2: $1\niflez v1 %d\n", body + 7);
+    for (int line = 0; line < body; line++) {
+      len += sprintf(src + len, line % 2 ? "v2 = v2 + $3\n" : "v2 = v2 * v1\n");
+    }
+    len += sprintf(src + len, "v1 = v1 - $1\nv3: $0\niflez v3 3\nret v2\n");
+
+    SbasObject plain, relaxed;
+    assert(sbasTranslateWithOptions(src, len, &o0, &plain) == 0);
+    assert(sbasTranslateWithOptions(src, len, &o1, &relaxed) == 0);
+    assert(relaxed.size < plain.size);
+
+    // the `jle` of line 3 ends where line 4 starts and leaves the loop
+    const int loopExit = relaxed.lt[body + 7].offset;
+    const int jleEnd = relaxed.lt[4].offset;
+    const unsigned char* jle = relaxed.code + jleEnd;
+    const char jleFits = loopExit - jleEnd <= 127;
+    assert(jleFits ? jle[-2] == 0x7E : jle[-6] == 0x0F && jle[-5] == 0x8E);
+
+    // the constant `iflez` closing the loop is a bare `jmp`
+    const int back = relaxed.lt[body + 6].offset;
+    const char jmpFits = relaxed.lt[3].offset - (back + 2) >= -128;
+    assert(relaxed.code[back] == (jmpFits ? 0xEB : 0xE9));
+
+    shortBodies += jleFits && jmpFits;
+    longBodies += !jleFits && !jmpFits;
+    sbasFreeObject(&plain);
+    sbasFreeObject(&relaxed);
+
+    for (int level = 0; level <= OPT_MAX_LEVEL; level++) {
+      CompileOptions options = {.optLevel = level};
+      functions[level] = sbasCompileWithOptions(src, len, &options);
+      assert(functions[level] != NULL);
+    }
+    for (int p1 = -1; p1 <= 5; p1++) {
+      const int expected = functions[0](p1);
+      for (int level = 1; level <= OPT_MAX_LEVEL; level++) {
+        assert(functions[level](p1) == expected);
+      }
+    }
+    for (int level = 0; level <= OPT_MAX_LEVEL; level++) {
+      sbasCleanup(functions[level]);
+    }
+  }
+  assert(shortBodies > 0 && longBodies > 0);
+}
+
+/**
+ * Translates a loop at the level that pads code, with and without padding, and
+ * checks the loop head lands on the boundary the host asks for, that leaving
+ * padding out only makes the code smaller, and that both versions agree
+ */
+static void run_test_code_alignment() {
+  const char* source =
+      "v1: p1\nv2: $1\nv3: $0\niflez v1 8\nv2 = v2 * v1\nv1 = v1 - $1\n"
+      "iflez v3 4\nret v2\n";
+  CompileOptions padded = {.optLevel = OPT_ALIGN_LEVEL};
+  CompileOptions unpadded = {.optLevel = OPT_ALIGN_LEVEL, .noAlign = 1};
+  SbasObject alignedObj, compactObj;
+  Alignment alignment;
+
+  printf("Testing code alignment...\n");
+
+  hostAlignment(&alignment);
+  assert(sbasTranslateWithOptions(source, strlen(source), &padded,
+                                  &alignedObj) == 0);
+  assert(sbasTranslateWithOptions(source, strlen(source), &unpadded,
+                                  &compactObj) == 0);
+  assert(!alignedObj.noAlign && compactObj.noAlign);
+  assert(compactObj.size <= alignedObj.size);
+
+  // the loop head is the first padded spot, so nothing before it moved
+  const int unaligned = compactObj.lt[4].offset;
+  const int boundary = alignment.loopBoundary;
+  const int needed = (boundary - unaligned % boundary) % boundary;
+  const char padsLoop = needed <= alignment.maxLoopPadding;
+  assert(alignedObj.lt[4].offset ==
+         (padsLoop ? unaligned + needed : unaligned));
+
+  funcp aligned = sbasMapObject(&alignedObj);
+  funcp compact = sbasMapObject(&compactObj);
+  assert(aligned != NULL && compact != NULL);
+  for (int p1 = -2; p1 <= 10; p1++) {
+    assert(aligned(p1) == compact(p1));
+  }
+  assert(aligned(5) == 120);
+
+  sbasCleanup(aligned);
+  sbasCleanup(compact);
+  sbasFreeObject(&alignedObj);
+  sbasFreeObject(&compactObj);
+}
+
+/**
+ * Checks an `iflez` right after one on the same variable jumps on the flags
+ * already set, while one after an addition that may overflow keeps its own
+ * `test`, agreeing with -O0 when it does overflow
+ */
+static void run_test_flag_reuse() {
+  const char* retested =
+      "v1: p1\niflez v1 5\niflez v1 6\nret $1\nret $2\nret $3\n";
+  const char* overflowing =
+      "v1: p1\niflez v1 6\nv1 = v1 + $1\niflez v1 7\nret $1\nret $2\n"
+      "ret $3\n";
+  CompileOptions o0 = {.optLevel = 0};
+  CompileOptions o1 = {.optLevel = 1};
+  SbasObject obj;
+
+  printf("Testing flag reuse...\n");
+
+  // the second `iflez` is a bare `jle rel8`
+  assert(sbasTranslateWithOptions(retested, strlen(retested), &o1, &obj) == 0);
+  assert(obj.code[obj.lt[3].offset] == 0x7E);
+  funcp reused = sbasMapObject(&obj);
+  assert(reused != NULL && reused(7) == 1 && reused(0) == 2 && reused(-7) == 2);
+  sbasCleanup(reused);
+  sbasFreeObject(&obj);
+
+  funcp reference =
+      sbasCompileWithOptions(overflowing, strlen(overflowing), &o0);
+  funcp optimized =
+      sbasCompileWithOptions(overflowing, strlen(overflowing), &o1);
+  assert(reference != NULL && optimized != NULL);
+  assert(reference(INT_MAX) == 3 && optimized(INT_MAX) == 3);
+  assert(optimized(5) == reference(5) && optimized(-5) == reference(-5));
+  sbasCleanup(reference);
+  sbasCleanup(optimized);
 }
 
 /**
@@ -1,118 +1,343 @@
 #include "sbas.h"
 
 #include <stdlib.h>
+#include <string.h>
 #include <sys/mman.h>
 #include <unistd.h>
 
 #include "assembler.h"
-#include "config.h"
+#include "cache.h"
+#include "ir.h"
 #include "linker.h"
+#include "passes.h"
+#include "perf.h"
+#include "timing.h"
 #include "types.h"
 #include "utils.h"
 
-#define MAX_CODE_SIZE 1024  // maximum bytes the buffer holds
-
+static funcp map_function(const SbasObject* obj, struct CacheEntry* owner);
 static void* alloc_writable_buffer(size_t size);
 static int make_buffer_executable(void* ptr, size_t size);
+static void place_line_counters(SbasObject* obj, RelocationTable* rt, int* relocCount);
 
 /**
  * Compiles a SBas function described in a .sbas file at
  * the open `FILE*` handle `f`
  */
 funcp sbasCompile(FILE* f) {
-  char assembleRet = 0;        // result of SBas assembling to machine code
-  char linkRet = 0;            // result of machine code fixup patching
-  int relocCount = 0;          // lines with jump offsets
-  unsigned char* code = NULL;  // buffer to write SBas logic
-  funcp result_func = NULL;    // return result: `code` buffer casted to SBas function
-  int mprotectRes = 0;         // holds status of syscall to make buffer executable
-  LineTable* lt = NULL;
+  size_t len = 0;
+  char* src = NULL;
+
+  // compile the whole file, wherever previous reads left it
+  PHASE_TIME(PHASE_READ, {
+    rewind(f);
+    src = readSource(f, &len);
+  });
+  if (!src) {
+    return NULL;
+  }
+
+  funcp result_func = sbasCompileBuffer(src, len);
+  free(src);
+  return result_func;
+}
+
+/**
+ * Compiles a SBas function from the `len` bytes of source at `src`,
+ * sharing the function of an identical source when caching is on
+ */
+funcp sbasCompileBuffer(const char* src, size_t len) { return sbasCompileWithOptions(src, len, NULL); }
+
+/**
+ * Compiles a SBas function from the `len` bytes of source at `src` as told by
+ * `options`. Instrumented functions count their own lines, so they're never shared
+ */
+funcp sbasCompileWithOptions(const char* src, size_t len, const CompileOptions* options) {
+  SbasObject obj = {0};             // linked machine code, still in heap memory
+  struct CacheEntry* entry = NULL;  // cache slot to fill on a miss
+  funcp result_func = NULL;         // return result: the code buffer casted to SBas function
+  unsigned described = 0;           // `perfGeneration` the function is described to perf in
+
+  if (!options || !options->instrument) {
+    result_func = cacheAcquire(src, len, options ? optionsKey(options->optLevel, options->noAlign) : 0, &entry);
+    if (result_func) {
+      return result_func;
+    }
+  }
+
+  if (sbasTranslateWithOptions(src, len, options, &obj) == -1) {
+    goto on_cleanup;
+  }
+
+  result_func = map_function(&obj, entry);
+  if (result_func) {
+    described = perfGeneration();
+    perfRecordCode(result_func, obj.size, obj.lt, obj.lines, src, len);
+  }
+
+on_cleanup:
+  if (entry) {
+    if (result_func) {
+      cachePublish(entry, result_func, &obj, described);
+    } else {
+      cacheAbandon(entry);
+    }
+  }
+
+  sbasFreeObject(&obj);
+
+  return result_func;  // Returns the buffer with SBas code, `NULL` otherwise
+}
+
+/**
+ * Assembles and links the SBas function in the `len` bytes at `src`
+ * into the heap buffer of `obj`
+ */
+char sbasTranslate(const char* src, size_t len, SbasObject* obj) {
+  return sbasTranslateWithOptions(src, len, NULL, obj);
+}
+
+/**
+ * Assembles and links the SBas function in the `len` bytes at `src`
+ * into the heap buffer of `obj`, as told by `options`
+ */
+char sbasTranslateWithOptions(const char* src, size_t len, const CompileOptions* options, SbasObject* obj) {
+  static const CompileOptions defaults = {0};
+  char assembleRet = 0;  // result of SBas assembling to machine code
+  char linkRet = 0;      // result of machine code fixup patching
+  int relocCount = 0;    // lines with jump offsets
+  char result = -1;
   RelocationTable* rt = NULL;
+  AlignPoint* points = NULL;  // spots the optimized code may be padded at
+  int pointCount = 0;
+  Alignment alignment;
+  IrFunction ir = {0};
+
+  if (!options) {
+    options = &defaults;
+  }
+
+  // counting lines needs every line to keep its code
+  const int level = options->instrument ? 0 : options->optLevel;
+  const char alignsCode = level >= OPT_ALIGN_LEVEL && !options->noAlign;
+
+  obj->code = NULL;
+  obj->size = 0;
+  obj->lt = NULL;
+  obj->lines = 0;
+  obj->counterOf = NULL;
+  obj->optLevel = level;
+  obj->noAlign = level >= OPT_ALIGN_LEVEL && options->noAlign;
+
+  if (level < 0 || level > OPT_MAX_LEVEL) {
+    fprintf(stderr, "sbasCompile: unknown optimization level %d.\n", level);
+    goto on_cleanup;
+  }
 
   // Edge case handling: empty file
-  fseek(f, 0, SEEK_END);  // Seek to the end of the file
-  long size = ftell(f);   // Get the current file position: its size
-  if (size == 0) {
+  if (len == 0) {
     fprintf(stderr, "sbasCompile: the provided SBas file is empty. Aborting!\n");
-    goto on_error;
-  } else {
-    rewind(f);  // go back to file's start
+    goto on_cleanup;
   }
 
-  lt = calloc((MAX_LINES + 1), sizeof(LineTable));
-  rt = calloc((MAX_LINES + 1), sizeof(RelocationTable));
-  if (!lt || !rt) {
+  // one entry per source line, so no line or jump can outgrow the tables;
+  // instrumented lines also relocate their counter
+  PHASE_TIME(PHASE_TABLES, {
+    obj->lines = countLines(src, len) + 1;
+    obj->lt = calloc(obj->lines, sizeof(LineTable));
+    rt = calloc(obj->lines * (options->instrument ? 2 : 1), sizeof(RelocationTable));
+    if (options->instrument) {
+      obj->counterOf = calloc(obj->lines, sizeof(unsigned));
+    }
+    // a loop head and an `iflez` at most per line
+    if (alignsCode) {
+      points = calloc(obj->lines * 2, sizeof(AlignPoint));
+    }
+  });
+  if (!obj->lt || !rt || (options->instrument && !obj->counterOf) || (alignsCode && !points)) {
     fprintf(stderr, "sbasCompile: failed to alloc line and/or relocation table!\n");
-    goto on_error;
-  }
-
-  code = alloc_writable_buffer(MAX_CODE_SIZE);
-  if (!code) {
-    fprintf(stderr, "sbasCompile: failed to alloc writable memory.\n");
-    goto on_error;
+    goto on_cleanup;
   }
 
   /**
-   * First pass: emit most instructions and leave 4-byte placeholders for jumps
+   * First pass: emit most instructions and leave 4-byte placeholders for jumps,
+   * either straight from the source or from the optimized IR
    */
-  assembleRet = sbasAssemble(code, f, lt, rt, &relocCount);
+  if (level == 0) {
+    PHASE_TIME(PHASE_ASSEMBLE, assembleRet = sbasAssemble(src, len, options, obj, rt, &relocCount));
+  } else {
+    PHASE_TIME(PHASE_OPTIMIZE, {
+      assembleRet = irBuild(src, len, obj->lines, &ir);
+      if (assembleRet == 0) {
+        assembleRet = irOptimize(&ir, level);
+      }
+    });
+    if (assembleRet == 0) {
+      PHASE_TIME(PHASE_ASSEMBLE, assembleRet = sbasAssembleIr(&ir, obj, rt, &relocCount, points, &pointCount));
+    }
+  }
   if (assembleRet == -1) {
-    goto on_error;
+    goto on_cleanup;
+  }
+
+  if (options->instrument) {
+    place_line_counters(obj, rt, &relocCount);
   }
 
   /**
-   * Second pass: fills 4-byte placeholder with offsets
+   * Second pass: fills 4-byte placeholder with offsets, once optimized code
+   * got its short jumps and padding
    */
-  linkRet = sbasLink(code, lt, rt, &relocCount);
+  PHASE_TIME(PHASE_LINK, {
+    if (alignsCode) {
+      hostAlignment(&alignment);
+    }
+    linkRet = level > 0 ? sbasRelax(obj, rt, relocCount, points, pointCount, alignsCode ? &alignment : NULL) : 0;
+    if (linkRet == 0) {
+      linkRet = sbasLink(obj->code, obj->lt, obj->lines, rt, &relocCount);
+    }
+  });
   if (linkRet == -1) {
-    goto on_error;
+    goto on_cleanup;
   }
 
-  mprotectRes = make_buffer_executable(code, MAX_CODE_SIZE);
-  if (mprotectRes == -1) {
-    fprintf(stderr, "sbasCompile: failed to make_buffer_executable\n");
-    goto on_error;
+  // trailing comments and blank lines have no code
+  while (obj->lines > 1 && obj->lt[obj->lines - 1].line == 0) {
+    obj->lines--;
+  }
+  result = 0;
+
+on_cleanup:
+  // It's safe to call free on NULL
+  free(rt);
+  free(points);
+  irFree(&ir);
+  if (result == -1) {
+    sbasFreeObject(obj);
   }
 
-  result_func = (funcp)code;
-  goto on_cleanup;
+  return result;
+}
 
 /**
- * This label is reached only on errors:
- * Frees SBas buffer if defined, falls through auxiliary data structures `free`s
- * and return result
+ * Releases the heap buffers of a translated SBas function `obj`
  */
-on_error:
-  if (code) {
-    sbasCleanup((funcp)code);
+void sbasFreeObject(SbasObject* obj) {
+  free(obj->code);
+  free(obj->lt);
+  obj->code = NULL;
+  obj->size = 0;
+  obj->lt = NULL;
+  obj->lines = 0;
+  free(obj->counterOf);
+  obj->counterOf = NULL;
+  obj->optLevel = 0;
+  obj->noAlign = 0;
+}
+
+/**
+ * Folds the level and the padding choice into a single number
+ */
+int optionsKey(char optLevel, char noAlign) {
+  return optLevel >= OPT_ALIGN_LEVEL && noAlign ? optLevel + OPT_MAX_LEVEL + 1 : optLevel;
+}
+
+/**
+ * Copies the per-line counts of an instrumented SBas function `sbasFunc`
+ * to `counts`, reading every line's count from the counter it shares
+ */
+unsigned sbasReadLineCounters(funcp sbasFunc, unsigned long long* counts, unsigned capacity) {
+  const CodeHeader* header = (const CodeHeader*)((unsigned char*)sbasFunc - CODE_HEADER_SIZE);
+  const volatile unsigned long long* counters = header->counters;
+
+  for (unsigned line = 0; line < header->counterCount && line < capacity; line++) {
+    counts[line] = counters[header->counterOf[line]];
   }
+  return header->counterCount;
+}
+
 /**
- * This label is hit by both success and error paths:
- * `free`s auxiliary data structures and falls through
- * return result
+ * Zeroes the counters of an instrumented SBas function `sbasFunc`
  */
-on_cleanup:
-  // It's safe to call free on NULL
-  free(lt);
-  free(rt);
+void sbasResetLineCounters(funcp sbasFunc) {
+  const CodeHeader* header = (const CodeHeader*)((unsigned char*)sbasFunc - CODE_HEADER_SIZE);
+  volatile unsigned long long* counters = header->counters;
 
-  return result_func;  // Returns the buffer with SBas code, `NULL` otherwise
+  for (unsigned line = 0; line < header->counterCount; line++) {
+    counters[line] = 0;
+  }
 }
 
 /**
- * Frees the executable buffer of a SBas function `sbasFunc`
+ * Maps the machine code of a translated SBas function `obj`
+ * as a standalone function, outside of any cache
  */
-void sbasCleanup(funcp sbasFunc) { munmap((void*)sbasFunc, MAX_CODE_SIZE); }
+funcp sbasMapObject(const SbasObject* obj) { return map_function(obj, NULL); }
+
+/**
+ * Frees the executable buffer of a SBas function `sbasFunc`,
+ * or drops a reference to it if the compile cache shares it
+ */
+void sbasCleanup(funcp sbasFunc) {
+  if (!sbasFunc) return;
+
+  CodeHeader* header = (CodeHeader*)((unsigned char*)sbasFunc - CODE_HEADER_SIZE);
+  if (header->owner) {
+    cacheRelease(header->owner);
+    return;
+  }
+  munmap(header, header->mapSize);
+}
+
+/**
+ * Copies translated machine code to a mapping of its own, behind a `CodeHeader`,
+ * and makes it executable. Instrumented code gets its line counters in R+W
+ * pages right after its own, where its RIP-relative increments point
+ * @param obj the translated function
+ * @param owner cache entry the function will belong to, `NULL` if none
+ * @returns the entry point, `NULL` on failure
+ */
+static funcp map_function(const SbasObject* obj, struct CacheEntry* owner) {
+  size_t size = CODE_HEADER_SIZE + obj->size;
+  size_t countersSize =
+      obj->counterOf ? roundToPages(obj->lines * (sizeof(unsigned long long) + sizeof(unsigned))) : 0;
+
+  unsigned char* buffer = NULL;
+  int protectRet = 0;
+
+  PHASE_TIME(PHASE_ALLOC, buffer = alloc_writable_buffer(roundToPages(size) + countersSize));
+  if (!buffer) {
+    fprintf(stderr, "sbasCompile: failed to alloc writable memory.\n");
+    return NULL;
+  }
+
+  CodeHeader* header = (CodeHeader*)buffer;
+  header->mapSize = roundToPages(size) + countersSize;
+  header->owner = owner;
+  if (obj->counterOf) {
+    header->counters = (unsigned long long*)(buffer + roundToPages(size));
+    header->counterOf = (unsigned*)(header->counters + obj->lines);
+    header->counterCount = obj->lines;
+    memcpy(header->counterOf, obj->counterOf, obj->lines * sizeof(unsigned));
+  }
+  memcpy(buffer + CODE_HEADER_SIZE, obj->code, obj->size);
+
+  PHASE_TIME(PHASE_PROTECT, protectRet = make_buffer_executable(buffer, size));
+  if (protectRet == -1) {
+    fprintf(stderr, "sbasCompile: failed to make_buffer_executable\n");
+    munmap(buffer, header->mapSize);
+    return NULL;
+  }
+
+  return (funcp)(buffer + CODE_HEADER_SIZE);
+}
 
 /**
  * Allocates a RW buffer for emitting machine code
  * corresponding to SBas code semantics
  */
 static void* alloc_writable_buffer(size_t size) {
-  // Round to page size
-  size_t pagesize = sysconf(_SC_PAGESIZE);
-
-  size_t alloc_size = ((size + pagesize - 1) / pagesize) * pagesize;
+  size_t alloc_size = roundToPages(size);
   void* ptr = mmap(NULL, alloc_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
   if (ptr == MAP_FAILED) {
     fprintf(stderr, "alloc_writable_buffer: failed to mmap writable buffer.\n");
@@ -126,8 +351,7 @@ static void* alloc_writable_buffer(size_t size) {
  * Drops write flag of SBas code buffer after done emitting, enforcing W^X
  */
 static int make_buffer_executable(void* ptr, size_t size) {
-  size_t pagesize = sysconf(_SC_PAGESIZE);
-  size_t alloc_size = ((size + pagesize - 1) / pagesize) * pagesize;
+  size_t alloc_size = roundToPages(size);
 
   // change protection to R+X (drop Write)
   if (mprotect(ptr, alloc_size, PROT_READ | PROT_EXEC) != 0) {
@@ -137,3 +361,49 @@ static int make_buffer_executable(void* ptr, size_t size) {
 
   return 0;
 }
+
+/**
+ * Points the counter increments of an instrumented function at the pages
+ * `map_function` puts right after its code.
+ *
+ * A line only ever entered from the line before it shares that line's counter:
+ * its increment becomes a 7-byte NOP and its relocation is dropped, so a
+ * straight run of lines costs a single increment. Jump targets keep their own
+ * @param obj assembled instrumented function, gets its `counterOf` filled in
+ * @param rt the relocations `obj` was assembled with
+ * @param relocCount amount of entries in `rt`, lowered by the dropped ones
+ */
+static void place_line_counters(SbasObject* obj, RelocationTable* rt, int* relocCount) {
+  static const unsigned char nop7[] = {0x0F, 0x1F, 0x80, 0x00, 0x00, 0x00, 0x00};  // nopl 0x0(%rax)
+  const int incqLength = 3;  // REX.W, opcode and ModRM, before the counter offset
+  const int countersOffset = roundToPages(CODE_HEADER_SIZE + obj->size) - CODE_HEADER_SIZE;
+  int kept = 0;
+
+  // a jump may land on any line, so mark those before deciding
+  for (int i = 0; i < *relocCount; i++) {
+    if (rt[i].kind == RELOC_JUMP && rt[i].targetLine < obj->lines) {
+      obj->counterOf[rt[i].targetLine] = rt[i].targetLine;
+    }
+  }
+
+  // counter relocations come in line order, so the line before is settled already
+  for (int i = 0; i < *relocCount; i++) {
+    RelocationTable reloc = rt[i];
+
+    if (reloc.kind == RELOC_COUNTER) {
+      const unsigned line = reloc.targetOffset / sizeof(unsigned long long);
+      const unsigned fallsFrom = reloc.targetLine;
+
+      if (fallsFrom && obj->counterOf[line] != line) {
+        obj->counterOf[line] = obj->counterOf[fallsFrom];
+        memcpy(obj->code + reloc.offset - incqLength, nop7, sizeof(nop7));
+        continue;
+      }
+      obj->counterOf[line] = line;
+      reloc.targetLine = 0;
+      reloc.targetOffset += countersOffset;
+    }
+    rt[kept++] = reloc;
+  }
+  *relocCount = kept;
+}
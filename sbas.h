@@ -10,10 +10,83 @@
  */
 funcp sbasCompile(FILE* f);
 
+/**
+ * Compiles a SBas function straight from memory, e.g. generated or mmap'd source
+ * @param src SBas source, it doesn't need to be NUL-terminated
+ * @param len amount of bytes in `src`
+ */
+funcp sbasCompileBuffer(const char* src, size_t len);
+
+/**
+ * Compiles a SBas function from memory with non-default options
+ * @param src SBas source, it doesn't need to be NUL-terminated
+ * @param len amount of bytes in `src`
+ * @param options compilation knobs, `NULL` for the defaults of `sbasCompileBuffer`
+ */
+funcp sbasCompileWithOptions(const char* src, size_t len, const CompileOptions* options);
+
+/**
+ * Assembles and links a SBas function without making it executable.
+ * Lets callers such as the code arena decide where the machine code lives.
+ * @param src SBas source, it doesn't need to be NUL-terminated
+ * @param len amount of bytes in `src`
+ * @param obj object receiving the machine code, release it with `sbasFreeObject`
+ * @returns 0 on success, -1 on failure
+ */
+char sbasTranslate(const char* src, size_t len, SbasObject* obj);
+
+/**
+ * Same as `sbasTranslate`, as told by `options`
+ * @param options compilation knobs, `NULL` for the defaults
+ */
+char sbasTranslateWithOptions(const char* src, size_t len, const CompileOptions* options, SbasObject* obj);
+
+/**
+ * Releases the machine code held by a translated SBas function
+ * @param obj the object filled in by `sbasTranslate`
+ */
+void sbasFreeObject(SbasObject* obj);
+
+/**
+ * Makes a translated SBas function executable in a mapping of its own
+ * @param obj the object filled in by `sbasTranslate`, still owned by the caller
+ * @returns the function, free it with `sbasCleanup`; `NULL` on failure
+ */
+funcp sbasMapObject(const SbasObject* obj);
+
+/**
+ * Reads the per-line execution counts of a function compiled with `instrument` set.
+ * Entry `i` is the number of times line `i` started running; lines without
+ * code and entry 0 stay at zero. Counting doesn't use atomics, so concurrent
+ * callers of the same function may lose counts
+ * @param sbasFunc a standalone function from `sbasCompileWithOptions`
+ * @param counts receives up to `capacity` counts, indexed by line
+ * @param capacity amount of entries in `counts`
+ * @returns the amount of lines counted, 0 if the function isn't instrumented
+ */
+unsigned sbasReadLineCounters(funcp sbasFunc, unsigned long long* counts, unsigned capacity);
+
+/**
+ * Zeroes the per-line execution counters of an instrumented function.
+ * It does nothing for functions that aren't instrumented
+ */
+void sbasResetLineCounters(funcp sbasFunc);
+
 /**
  * Frees the executable buffer of a SBas function
  * @param sbasFunc the SBas function pointer to free
  */
 void sbasCleanup(funcp sbasFunc);
 
-#endif
\ No newline at end of file
+/**
+ * Tells apart the options that change the code of a function. Functions are
+ * only shared under the same key: it's part of the compile cache key, the
+ * `options` field of code cache file headers and the `-C` file names.
+ * @param optLevel optimization level, as in `CompileOptions.optLevel`
+ * @param noAlign whether padding is left out, as in `CompileOptions.noAlign`
+ * @returns `optLevel`, moved past `OPT_MAX_LEVEL` when the level would pad the
+ * code but `noAlign` says not to
+ */
+int optionsKey(char optLevel, char noAlign);
+
+#endif
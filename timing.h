@@ -0,0 +1,43 @@
+#ifndef TIMING_H
+#define TIMING_H
+
+/**
+ * Per-phase compile timings, only built in with `-DSBAS_PHASE_TIMING`
+ * (see `make bench-compile`), so regular builds pay nothing for them.
+ */
+#ifdef SBAS_PHASE_TIMING
+
+typedef enum {
+  PHASE_READ,      // rewinding and reading the source file
+  PHASE_TABLES,    // counting lines and allocating the line and relocation tables
+  PHASE_OPTIMIZE,  // building the IR and running its passes, -O1 and up
+  PHASE_ASSEMBLE,  // sbasAssemble or sbasAssembleIr
+  PHASE_LINK,      // sbasLink
+  PHASE_ALLOC,     // mapping the writable buffer
+  PHASE_PROTECT,   // flipping the buffer to R+X
+  PHASE_COUNT,
+} CompilePhase;
+
+// nanoseconds spent in each phase by the calling thread since it last cleared them
+extern _Thread_local long long sbasPhaseNs[PHASE_COUNT];
+
+long long phaseClockNs(void);
+
+// runs `stmt`, adding the time it took to `phase`
+#define PHASE_TIME(phase, stmt)                       \
+  do {                                                \
+    long long phaseStart_ = phaseClockNs();           \
+    stmt;                                             \
+    sbasPhaseNs[phase] += phaseClockNs() - phaseStart_; \
+  } while (0)
+
+#else
+
+#define PHASE_TIME(phase, stmt) \
+  do {                          \
+    stmt;                       \
+  } while (0)
+
+#endif
+
+#endif
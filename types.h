@@ -1,5 +1,6 @@
 #ifndef TYPES_H
 #define TYPES_H
+#include <stddef.h>
 
 /**
  * The SBas function:
@@ -20,6 +21,15 @@ typedef struct {
   int offset;
 } LineTable;
 
+/**
+ * What the placeholder bytes of a fixup point at
+ */
+typedef enum {
+  RELOC_JUMP,        // a line or the stack cleanup code
+  RELOC_COUNTER,     // a line counter of an instrumented function, placed after the code
+  RELOC_SHORT_JUMP,  // a `RELOC_JUMP` shortened by `sbasRelax`, whose offset is a single byte
+} RelocationKind;
+
 /**
  * An entry for a linking step fixup.
  * Maps a desired line OR offset to jump to to a source/requesting offset in the buffer
@@ -27,14 +37,155 @@ typedef struct {
  * Fields:
  * - `targetLine`: line whose relative offset to the next instruction should be filled in
  * - `targetOffset`: desired offset to jump to
- * - `offset`: index 0 of the 4 zero placeholder bytes that should be patched
+ * - `offset`: index 0 of the zero placeholder bytes that should be patched, 4 of them
+ *   unless `kind` is `RELOC_SHORT_JUMP`
+ * - `kind`: what the offset points at. Line counters use `targetOffset`, and
+ *   `targetLine` is the previous line when it always carries on into this one
  */
 typedef struct {
   unsigned targetLine;
   int targetOffset;
   int offset;
+  RelocationKind kind;
 } RelocationTable;
 
+/**
+ * What the code right after an alignment point is, see `sbasRelax`
+ */
+typedef enum {
+  ALIGN_LOOP_HEAD,  // a block jumped back to, padded to start a chunk of `Alignment.loopBoundary` bytes
+  ALIGN_BRANCH,     // the compare of an `iflez`, padded so it and its `jle` neither cross nor end a 32-byte chunk
+} AlignKind;
+
+/**
+ * A spot of the code where NOPs may go
+ *
+ * Fields:
+ * - `offset`: where the NOPs would go, before the block or the compare
+ * - `jump`: for `ALIGN_BRANCH`, the index of the relocation of its `jle`
+ * - `kind`: what starts at `offset`
+ */
+typedef struct {
+  int offset;
+  int jump;
+  AlignKind kind;
+} AlignPoint;
+
+/**
+ * A SBas operand such as:
+ * - variables (vX)
+ * - parameters (pX)
+ * - immediate values ($snum)
+ *
+ * Fields:
+ * - `type`: `v`, `p` or `$`, or `r` once the optimizing assembler placed it in a register
+ * - `value`: variable/parameter index (1..5), an immediate value or a hardware register (0..15)
+ */
+typedef struct {
+  char type;
+  int value;
+} Operand;
+
+/**
+ * The four kinds of SBas commands
+ */
+typedef enum {
+  STMT_RET,          // ret <vX|$num>
+  STMT_ATTRIBUTION,  // vX: <vX|pX|$num>
+  STMT_ARITHMETIC,   // vX = <vX|$num> op <vX|$num>
+  STMT_IFLEZ,        // iflez vX line
+} StatementKind;
+
+/**
+ * A single SBas command as read by the lexer
+ *
+ * Fields:
+ * - `kind`: which command the line holds
+ * - `line`: line in the text file (1-indexed)
+ * - `dest`: variable written by attributions and arithmetic operations
+ * - `lhs`: returned value, attributed value or left operand
+ * - `op`: arithmetic operator (`+`, `-` or `*`)
+ * - `rhs`: right operand of arithmetic operations
+ * - `targetLine`: line to jump to when the `iflez` variable in `lhs` is <= 0
+ */
+typedef struct {
+  StatementKind kind;
+  unsigned line;
+  Operand dest;
+  Operand lhs;
+  char op;
+  Operand rhs;
+  unsigned targetLine;
+} Statement;
+
+/**
+ * Knobs of a SBas compilation. A zeroed struct gives the default compilation.
+ *
+ * Fields:
+ * - `instrument`: count how many times every line runs, see `sbasReadLineCounters`.
+ *   Instrumented code is never optimized, so every line keeps its own code
+ * - `optLevel`: 0 assembles line by line, straight from the source; 1 and 2
+ *   go through the IR and its passes (see `irOptimize`), trading compile time
+ *   for faster code
+ * - `noAlign`: from `OPT_ALIGN_LEVEL` on, loop heads and branches are padded
+ *   with NOPs as suits the CPU (see `hostAlignment`), unless this is set to
+ *   keep the code small
+ */
+typedef struct {
+  char instrument;
+  char optLevel;
+  char noAlign;
+} CompileOptions;
+
+/**
+ * A translated SBas function: linked machine code that still lives in
+ * ordinary heap memory, not yet placed anywhere executable.
+ *
+ * SBas code only ever jumps relative to itself, so these bytes can be
+ * copied to any address and run from there.
+ *
+ * Fields:
+ * - `code`: heap buffer holding the machine code
+ * - `size`: amount of bytes in `code`
+ * - `lt`: heap buffer mapping every executable line to its offset in `code`
+ * - `lines`: amount of entries in `lt`, one past the last executable line
+ * - `counterOf`: when instrumented, the line whose counter each line reads;
+ *   the counters only resolve once mapped by `sbasCompileWithOptions` or `sbasMapObject`.
+ *   `NULL` otherwise
+ * - `optLevel`: optimization level the code was compiled at
+ * - `noAlign`: whether `CompileOptions.noAlign` left out padding the level would add
+ */
+typedef struct {
+  unsigned char* code;
+  int size;
+  LineTable* lt;
+  unsigned lines;
+  unsigned* counterOf;
+  char optLevel;
+  char noAlign;
+} SbasObject;
+
+/**
+ * Bookkeeping placed right before the entry point of every function handed
+ * out by `sbasCompile`, in the same mapping as its code.
+ *
+ * Fields:
+ * - `mapSize`: bytes mapped, starting at the header
+ * - `owner`: compile cache entry sharing the function, `NULL` when the caller owns it
+ * - `counters`: R+W page(s) past the code holding a 64-bit counter per line, `NULL` if not instrumented
+ * - `counterOf`: copy of `SbasObject.counterOf`, right after `counters`
+ * - `counterCount`: amount of entries in `counters` and `counterOf`, indexed by line
+ */
+typedef struct {
+  size_t mapSize;
+  struct CacheEntry* owner;
+  unsigned long long* counters;
+  unsigned* counterOf;
+  unsigned counterCount;
+} CodeHeader;
+
+#define CODE_HEADER_SIZE 64  // room taken by `CodeHeader`, keeps the entry point cache-line aligned
+
 /**
  * @brief An abstraction of a x86-64 machine code instruction:
  *
@@ -61,10 +212,11 @@ typedef struct {
   unsigned char use_modrm;
 
   /**
-   * Bits 7-6 of ModRM. Sets up the addressing mode.
-   * In SBas two modes are used:
+   * Bits 7-6 of ModRM. Sets up the addressing mode:
    * - 3 (11): Register-Direct
+   * - 2 (10): Memory + 32-bit Displacement, only used by `lea`
    * - 1 (01): Memory + 8-bit Displacement
+   * - 0 (00): Memory with no displacement
    */
   unsigned char mod;
 
@@ -83,14 +235,29 @@ typedef struct {
   unsigned char rm;
 
   /**
-   * Enables emission of a displacement byte after the ModR/M byte.
+   * Enables emission of a SIB byte after the ModR/M byte, whose `rm` must then be 4 (100).
+   * Used to address `base + index * 2^scale`
+   */
+  unsigned char use_sib;
+
+  /**
+   * Fields of the SIB byte: `scale` is a shift count (0-3) and `index` and
+   * `base` are full register IDs, 4 (100) as `index` meaning none
+   */
+  unsigned char scale;
+  unsigned char index;
+  unsigned char base;
+
+  /**
+   * Enables emission of the displacement after the ModR/M (and SIB) byte,
+   * a byte or 4 as `mod` says.
    */
   unsigned char use_disp;
 
   /**
-   * The small offset added to the base address stored in a register, for instance -8(%rbp)
+   * The offset added to the base address stored in a register, for instance -8(%rbp)
    */
-  signed char displacement;
+  int displacement;
 
   /**
    * Enables emission of immediate bytes at the end of an instruction.
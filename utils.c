@@ -1,44 +1,17 @@
 #include "utils.h"
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
 
 #include "config.h"
+#include "timing.h"
 #include "types.h"
 
-/**
- * Trims leading spaces (' ')/ 32 (dec)/ 0x20 (hex),
- * modifying `lineBuffer` in-place.
- * Runs in O(n)
- */
-void trimLeadingSpaces(char* lineBuffer) {
-  char* p = lineBuffer;
-  // early return if string doesn't have leading whitespace
-  if (*p != ' ') {
-    return;
-  }
-
-  // count spaces
-  unsigned spaces = 0;
-  while (*p == ' ') {
-    spaces++;
-    p++;
-  }
-
-  char* aux = p;  // helper pointer with whitespace already consumed
-  unsigned i = 0;
-  while (*aux != '\0') {
-#ifdef DEBUG
-    printf("trimLeadingSpaces: setting lineBuffer[i = %d] (%c) to lineBuffer[spaces + i = %d] (%c)\n", i, lineBuffer[i], spaces + i, lineBuffer[spaces + i]);
-#endif
-    // shifts the entire string to beginning, eliminating spaces
-    lineBuffer[i] = lineBuffer[spaces + i];
-    i++;
-    aux++;
-  }
-
-  // "discard" remaining bytes at end of string
-  lineBuffer[i] = '\0';
-}
+#define FNV_OFFSET_BASIS 0xcbf29ce484222325ULL
+#define FNV_PRIME 0x100000001b3ULL
 
 /**
  * Prints the entire string `s`, followed by a character-by-character
@@ -101,6 +74,31 @@ void emitIntegerInHex(unsigned char code[], int* pos, int integer) {
   (*pos)++;
 }
 
+/**
+ * Writes `count` bytes of padding in the buffer `code` at offset `pos`, as the
+ * fewest NOPs of up to 9 bytes, the longest every x86-64 CPU decodes in one go
+ */
+void emitNops(unsigned char code[], int* pos, int count) {
+  static const unsigned char nops[9][9] = {
+      {0x90},                                                // nop
+      {0x66, 0x90},                                          // xchg %ax,%ax
+      {0x0F, 0x1F, 0x00},                                    // nopl (%rax)
+      {0x0F, 0x1F, 0x40, 0x00},                              // nopl 0x0(%rax)
+      {0x0F, 0x1F, 0x44, 0x00, 0x00},                        // nopl 0x0(%rax,%rax,1)
+      {0x66, 0x0F, 0x1F, 0x44, 0x00, 0x00},                  // nopw 0x0(%rax,%rax,1)
+      {0x0F, 0x1F, 0x80, 0x00, 0x00, 0x00, 0x00},            // nopl 0x0(%rax)
+      {0x0F, 0x1F, 0x84, 0x00, 0x00, 0x00, 0x00, 0x00},      // nopl 0x0(%rax,%rax,1)
+      {0x66, 0x0F, 0x1F, 0x84, 0x00, 0x00, 0x00, 0x00, 0x00}  // nopw 0x0(%rax,%rax,1)
+  };
+
+  while (count > 0) {
+    const int size = count < 9 ? count : 9;
+    memcpy(code + *pos, nops[size - 1], size);
+    *pos += size;
+    count -= size;
+  }
+}
+
 /**
  * Dumps the `LineTable` corresponding to the currently compiled SBas file
  * @param lt pointer to the `LineTable`
@@ -130,9 +128,97 @@ void printRelocationTable(RelocationTable* rt, int relocCount) {
   printf("----- END RELOCATION TABLE -----\n");
 }
 
+/**
+ * Reads everything from the current position of the **open** file handle `f`
+ * to its end into a heap buffer. Doesn't seek, so pipes work too.
+ * @param len pointer where the amount of bytes read is stored
+ * @returns the buffer, to be `free`d by the caller, `NULL` on failure
+ */
+char* readSource(FILE* f, size_t* len) {
+  size_t capacity = 4096;
+  size_t size = 0;
+  char* src = malloc(capacity);
+  if (!src) {
+    fprintf(stderr, "readSource: failed to alloc source buffer.\n");
+    return NULL;
+  }
+
+  size_t bytesRead;
+  while ((bytesRead = fread(src + size, 1, capacity - size, f)) > 0) {
+    size += bytesRead;
+    if (size == capacity) {
+      capacity *= 2;
+      char* grown = realloc(src, capacity);
+      if (!grown) {
+        fprintf(stderr, "readSource: failed to grow source buffer.\n");
+        free(src);
+        return NULL;
+      }
+      src = grown;
+    }
+  }
+
+  if (ferror(f)) {
+    fprintf(stderr, "readSource: failed to read SBas file.\n");
+    free(src);
+    return NULL;
+  }
+
+  *len = size;
+  return src;
+}
+
+/**
+ * Hashes `len` bytes at `data` with 64-bit FNV-1a.
+ * Used to key SBas sources in the compile caches.
+ */
+unsigned long long hashBytes(const void* data, size_t len) {
+  const unsigned char* bytes = data;
+  unsigned long long hash = FNV_OFFSET_BASIS;
+  for (size_t i = 0; i < len; i++) {
+    hash ^= bytes[i];
+    hash *= FNV_PRIME;
+  }
+  return hash;
+}
+
+/**
+ * Counts the lines of the `len` bytes at `src`, the last one
+ * counting even without a trailing newline
+ */
+unsigned countLines(const char* src, size_t len) {
+  unsigned lines = 1;
+  const char* end = src + len;
+  for (const char* p = src; (p = memchr(p, '\n', end - p)) != NULL; p++) {
+    lines++;
+  }
+  return lines;
+}
+
+/**
+ * Rounds `size` up to a whole amount of pages
+ */
+size_t roundToPages(size_t size) {
+  size_t pagesize = sysconf(_SC_PAGESIZE);
+  return ((size + pagesize - 1) / pagesize) * pagesize;
+}
+
 /**
  * Prints a SBas compilation error `msg`, found at a given `line`, to `stderr`
  */
 void compilationError(const char* msg, int line) {
   fprintf(stderr, "%s[line %d in .sbas file]: %s%s\n", RED, line, msg, RESET_COLOR);
 }
+
+#ifdef SBAS_PHASE_TIMING
+_Thread_local long long sbasPhaseNs[PHASE_COUNT];
+
+/**
+ * Reads the monotonic clock in nanoseconds
+ */
+long long phaseClockNs(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+#endif
@@ -4,12 +4,16 @@
 
 #include "types.h"
 
-void trimLeadingSpaces(char* lineBuffer);
 void dumpString(char* s);
 int stringToInt(char* str);
 void compilationError(const char* msg, int line);
 void emitIntegerInHex(unsigned char code[], int* pos, int integer);
+void emitNops(unsigned char code[], int* pos, int count);
 void printLineTable(LineTable* lt, int lines);
 void printRelocationTable(RelocationTable* rt, int relocCount);
+char* readSource(FILE* f, size_t* len);
+unsigned long long hashBytes(const void* data, size_t len);
+size_t roundToPages(size_t size);
+unsigned countLines(const char* src, size_t len);
 
 #endif
\ No newline at end of file